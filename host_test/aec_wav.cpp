@@ -0,0 +1,269 @@
+// Runs the echo canceller from main/aec.cpp over a far end (what the speaker
+// played) and a near end (what the mic heard) and reports the echo return
+// loss enhancement and the CPU time per frame.
+//
+//   aec_wav far.wav near.wav [out.wav]
+//
+// Both files are 16 kHz mono 16-bit PCM, recorded in step: near sample n
+// was captured while far sample n was going out. Without arguments a far
+// end and its echo are synthesized, written as aec_far.wav and
+// aec_near.wav, and run; the exit status is then whether the canceller
+// reached MIN_ERLE_DB, found the echo delay and caught the double talk.
+
+#include <cinttypes>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+#include "esp_timer.h"
+#include "reflect.hpp"
+
+#define SAMPLE_RATE 16000
+#define FRAME_SAMPLES (CONFIG_REFLECT_AUDIO_FRAME_MS * SAMPLE_RATE / 1000)
+
+// ERLE is only counted once the delay has been found and the filter had
+// time to converge, and only on frames where the far end is playing
+#define SETTLE_SECONDS 3
+#define FAR_ACTIVE_POWER 1e-5
+
+// What the synthesized echo path has to be cancelled to
+#define SYNTH_SECONDS 15
+#define SYNTH_DELAY_MS 80
+#define SYNTH_PATH_TAPS 160
+#define SYNTH_NOISE_LEVEL 0.0005f
+#define MIN_ERLE_DB 15.0
+
+// The near end talks over the far end for a while, which has to be caught
+// as double talk and is left out of the ERLE
+#define SYNTH_TALK_START_MS 10000
+#define SYNTH_TALK_END_MS 11500
+
+static bool wav_read(const char *path, std::vector<int16_t> *samples) {
+  auto file = fopen(path, "rb");
+  if (file == NULL) {
+    fprintf(stderr, "%s: can't open\n", path);
+    return false;
+  }
+
+  uint8_t header[12];
+  bool ok = fread(header, 1, sizeof(header), file) == sizeof(header) &&
+            memcmp(header, "RIFF", 4) == 0 &&
+            memcmp(header + 8, "WAVE", 4) == 0;
+  bool format_ok = false;
+  while (ok) {
+    uint8_t chunk[8];
+    if (fread(chunk, 1, sizeof(chunk), file) != sizeof(chunk)) {
+      ok = false;
+      break;
+    }
+    uint32_t size = chunk[4] | chunk[5] << 8 | chunk[6] << 16 |
+                    (uint32_t)chunk[7] << 24;
+
+    if (memcmp(chunk, "fmt ", 4) == 0) {
+      uint8_t fmt[16];
+      if (size < sizeof(fmt) || fread(fmt, 1, sizeof(fmt), file) != 16) {
+        ok = false;
+        break;
+      }
+      auto format = fmt[0] | fmt[1] << 8;
+      auto channels = fmt[2] | fmt[3] << 8;
+      auto rate = fmt[4] | fmt[5] << 8 | fmt[6] << 16 | fmt[7] << 24;
+      auto bits = fmt[14] | fmt[15] << 8;
+      format_ok =
+          format == 1 && channels == 1 && rate == SAMPLE_RATE && bits == 16;
+      fseek(file, size - sizeof(fmt) + (size & 1), SEEK_CUR);
+    } else if (memcmp(chunk, "data", 4) == 0) {
+      samples->resize(size / 2);
+      ok = fread(samples->data(), 2, samples->size(), file) ==
+           samples->size();
+      break;
+    } else {
+      fseek(file, size + (size & 1), SEEK_CUR);
+    }
+  }
+  fclose(file);
+
+  if (!ok || !format_ok) {
+    fprintf(stderr, "%s: not a 16 kHz mono 16-bit PCM WAV\n", path);
+    return false;
+  }
+  return true;
+}
+
+static void put_le(uint8_t *out, uint32_t value, size_t bytes) {
+  for (size_t i = 0; i < bytes; i++) {
+    out[i] = (uint8_t)(value >> (8 * i));
+  }
+}
+
+static bool wav_write(const char *path, const std::vector<int16_t> &samples) {
+  auto file = fopen(path, "wb");
+  if (file == NULL) {
+    fprintf(stderr, "%s: can't create\n", path);
+    return false;
+  }
+
+  uint32_t data_size = samples.size() * 2;
+  uint8_t header[44];
+  memcpy(header, "RIFF", 4);
+  put_le(header + 4, 36 + data_size, 4);
+  memcpy(header + 8, "WAVEfmt ", 8);
+  put_le(header + 16, 16, 4);
+  put_le(header + 20, 1, 2);
+  put_le(header + 22, 1, 2);
+  put_le(header + 24, SAMPLE_RATE, 4);
+  put_le(header + 28, SAMPLE_RATE * 2, 4);
+  put_le(header + 32, 2, 2);
+  put_le(header + 34, 16, 2);
+  memcpy(header + 36, "data", 4);
+  put_le(header + 40, data_size, 4);
+
+  bool ok = fwrite(header, 1, sizeof(header), file) == sizeof(header) &&
+            fwrite(samples.data(), 2, samples.size(), file) == samples.size();
+  fclose(file);
+  return ok;
+}
+
+static uint32_t lcg_state = 1;
+
+// Uniform in [-1, 1)
+static float noise() {
+  lcg_state = lcg_state * 1664525 + 1013904223;
+  return (int32_t)lcg_state / 2147483648.0f;
+}
+
+static bool synth_talking(size_t n) {
+  return n >= SYNTH_TALK_START_MS * (SAMPLE_RATE / 1000) &&
+         n < SYNTH_TALK_END_MS * (SAMPLE_RATE / 1000);
+}
+
+// Speech-like far end (low-passed noise in syllable bursts, with pauses
+// between phrases) and the mic picking it up through a delayed, decaying
+// echo path plus a little noise, and for a while the near end talking
+static void synthesize(std::vector<int16_t> *far, std::vector<int16_t> *near) {
+  size_t count = SYNTH_SECONDS * SAMPLE_RATE;
+  std::vector<float> far_f(count);
+  float low_pass = 0;
+  for (size_t n = 0; n < count; n++) {
+    auto t = (float)n / SAMPLE_RATE;
+    auto phrase = fmodf(t, 2.0f) < 1.5f ? 1.0f : 0.0f;
+    auto syllable = fabsf(sinf(2 * (float)M_PI * 3.0f * t));
+    low_pass += 0.3f * (noise() - low_pass);
+    far_f[n] = 0.5f * phrase * syllable * low_pass;
+  }
+
+  float path[SYNTH_PATH_TAPS];
+  float path_energy = 0;
+  for (size_t j = 0; j < SYNTH_PATH_TAPS; j++) {
+    path[j] = noise() * expf(-(float)j / 30.0f);
+    path_energy += path[j] * path[j];
+  }
+  for (size_t j = 0; j < SYNTH_PATH_TAPS; j++) {
+    path[j] *= 0.7f / sqrtf(path_energy);
+  }
+
+  size_t delay = SYNTH_DELAY_MS * SAMPLE_RATE / 1000;
+  far->resize(count);
+  near->resize(count);
+  for (size_t n = 0; n < count; n++) {
+    float echo = 0;
+    for (size_t j = 0; j < SYNTH_PATH_TAPS && j + delay <= n; j++) {
+      echo += path[j] * far_f[n - delay - j];
+    }
+    auto talk = synth_talking(n) ? 0.3f * noise() : 0.0f;
+    (*far)[n] = (int16_t)(far_f[n] * 32767.0f);
+    (*near)[n] =
+        (int16_t)((echo + talk + SYNTH_NOISE_LEVEL * noise()) * 32767.0f);
+  }
+}
+
+int main(int argc, char **argv) {
+  std::vector<int16_t> far, near;
+  bool synthesized = argc < 3;
+  if (synthesized) {
+    synthesize(&far, &near);
+    if (!wav_write("aec_far.wav", far) || !wav_write("aec_near.wav", near)) {
+      return 1;
+    }
+    far.clear();
+    near.clear();
+  }
+  if (!wav_read(synthesized ? "aec_far.wav" : argv[1], &far) ||
+      !wav_read(synthesized ? "aec_near.wav" : argv[2], &near)) {
+    return 1;
+  }
+
+  auto frames = (far.size() < near.size() ? far.size() : near.size()) /
+                FRAME_SAMPLES;
+  std::vector<int16_t> out(frames * FRAME_SAMPLES);
+  reflect_aec();
+
+  double near_energy = 0;
+  double out_energy = 0;
+  int64_t total_us = 0;
+  int64_t max_us = 0;
+  for (size_t f = 0; f < frames; f++) {
+    auto offset = f * FRAME_SAMPLES;
+    reflect_aec_far(&far[offset], FRAME_SAMPLES);
+    auto far_at_capture = reflect_aec_far_position();
+
+    auto frame = &out[offset];
+    memcpy(frame, &near[offset], FRAME_SAMPLES * sizeof(int16_t));
+    auto start_us = esp_timer_get_time();
+    reflect_aec_process(frame, FRAME_SAMPLES, far_at_capture);
+    auto frame_us = esp_timer_get_time() - start_us;
+    total_us += frame_us;
+    max_us = frame_us > max_us ? frame_us : max_us;
+
+    double far_power = 0;
+    for (size_t i = 0; i < FRAME_SAMPLES; i++) {
+      auto x = far[offset + i] / 32768.0;
+      far_power += x * x;
+    }
+    if (offset < SETTLE_SECONDS * SAMPLE_RATE ||
+        far_power / FRAME_SAMPLES < FAR_ACTIVE_POWER ||
+        (synthesized && (synth_talking(offset) ||
+                         synth_talking(offset + FRAME_SAMPLES - 1)))) {
+      continue;
+    }
+    for (size_t i = 0; i < FRAME_SAMPLES; i++) {
+      auto n = near[offset + i] / 32768.0;
+      auto e = frame[i] / 32768.0;
+      near_energy += n * n;
+      out_energy += e * e;
+    }
+  }
+
+  if (argc > 3 && !wav_write(argv[3], out)) {
+    return 1;
+  }
+
+  reflect_aec_stats_t stats;
+  reflect_aec_stats(&stats);
+  auto erle_db = 10 * log10((near_energy + 1e-12) / (out_energy + 1e-12));
+  auto avg_us = frames == 0 ? 0 : total_us / (int64_t)frames;
+  printf("frames(%zu) frame_ms(%d) erle_db(%.1f) delay_ms(%" PRIu32
+         ") delay_changes(%" PRIu32 ") double_talk_frames(%" PRIu32 ")\n",
+         frames, CONFIG_REFLECT_AUDIO_FRAME_MS, erle_db, stats.delay_ms,
+         stats.delay_changes, stats.double_talk_frames);
+  printf("frame_avg_us(%" PRId64 ") frame_max_us(%" PRId64
+         ") budget_percent(%.1f)\n",
+         avg_us, max_us,
+         avg_us * 100.0 / (CONFIG_REFLECT_AUDIO_FRAME_MS * 1000));
+
+  if (!synthesized) {
+    return 0;
+  }
+  // The estimate lands up to a block and its headroom short of the real
+  // delay, and the filter covers the rest
+  auto delay_ok = stats.delay_ms <= SYNTH_DELAY_MS &&
+                  stats.delay_ms + 5 >= SYNTH_DELAY_MS;
+  if (erle_db < MIN_ERLE_DB || !delay_ok || stats.double_talk_frames == 0) {
+    printf("FAIL: expected erle_db >= %.1f, delay_ms near %d and double "
+           "talk caught\n",
+           MIN_ERLE_DB, SYNTH_DELAY_MS);
+    return 1;
+  }
+  return 0;
+}
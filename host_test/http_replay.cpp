@@ -0,0 +1,344 @@
+// Replays recorded and generated signaling answers through main/http.cpp's
+// event handler and client pool, with esp_http_client replaced by a client
+// that hands each request's body to the handler the way the real one does:
+// dechunked, one HTTP_EVENT_ON_DATA per chunk or per TCP segment.
+//
+//   http_replay [data_dir]
+//
+// Checks that a chunked answer (data/answer_chunked.http) comes out as
+// data/answer.sdp, that a large answer arriving in segments is reassembled,
+// that an answer over SDP_ANSWER_MAX_SIZE is dropped rather than cut short,
+// and that two requests are in flight at once on separate clients.
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+// The pool and the response buffer are file-local, so the test builds the
+// file itself rather than linking it
+#include "http.cpp"
+
+#ifndef HOST_TEST_DATA_DIR
+#define HOST_TEST_DATA_DIR "data"
+#endif
+
+// What lwIP typically hands up per read
+#define SEGMENT_SIZE 1460
+
+// How long a request waits in the fake client for the other one to arrive
+#define OVERLAP_WAIT_MS 2000
+
+static const char *data_dir = HOST_TEST_DATA_DIR;
+static int failures = 0;
+
+#define CHECK(condition)                                                       \
+  do {                                                                         \
+    if (!(condition)) {                                                        \
+      printf("FAIL %s:%d: %s\n", __FILE__, __LINE__, #condition);              \
+      failures++;                                                              \
+    }                                                                          \
+  } while (0)
+
+void reflect_boot_wait(uint32_t) {}
+
+esp_err_t esp_crt_bundle_attach(void *) { return ESP_OK; }
+
+// An answer as the server sends it: status and the body in the pieces the
+// handler gets to see
+typedef struct {
+  int status;
+  std::vector<std::string> pieces;
+} replay_answer_t;
+
+struct esp_http_client {
+  http_event_handle_cb handler;
+  esp_http_client_method_t method;
+  std::string post_field;
+  void *user_data;
+  int status;
+  bool connected;
+};
+
+static std::mutex answers_mutex;
+static std::vector<std::pair<std::string, replay_answer_t>> answers;
+static std::atomic<int> in_flight(0);
+static std::atomic<int> max_in_flight(0);
+static std::atomic<bool> wait_for_overlap(false);
+static std::atomic<int> warmups(0);
+
+// Queues the answer for the request whose body is offer
+static void replay_expect(const std::string &offer,
+                          const replay_answer_t &answer) {
+  std::lock_guard<std::mutex> lock(answers_mutex);
+  answers.emplace_back(offer, answer);
+}
+
+static bool replay_take(const std::string &offer, replay_answer_t *answer) {
+  std::lock_guard<std::mutex> lock(answers_mutex);
+  for (auto it = answers.begin(); it != answers.end(); ++it) {
+    if (it->first == offer) {
+      *answer = it->second;
+      answers.erase(it);
+      return true;
+    }
+  }
+  return false;
+}
+
+static void replay_event(esp_http_client_handle_t client,
+                         esp_http_client_event_id_t id,
+                         const std::string *data) {
+  esp_http_client_event_t evt = {};
+  evt.event_id = id;
+  evt.client = client;
+  evt.user_data = client->user_data;
+  if (data != NULL) {
+    evt.data = (void *)data->data();
+    evt.data_len = (int)data->size();
+  }
+  client->handler(&evt);
+}
+
+esp_http_client_handle_t
+esp_http_client_init(const esp_http_client_config_t *config) {
+  auto client = new esp_http_client();
+  client->handler = config->event_handler;
+  return client;
+}
+
+esp_err_t esp_http_client_perform(esp_http_client_handle_t client) {
+  auto now = ++in_flight;
+  auto seen = max_in_flight.load();
+  while (now > seen && !max_in_flight.compare_exchange_weak(seen, now)) {
+  }
+  if (wait_for_overlap) {
+    auto deadline = std::chrono::steady_clock::now() +
+                    std::chrono::milliseconds(OVERLAP_WAIT_MS);
+    while (max_in_flight < 2 && std::chrono::steady_clock::now() < deadline) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+  }
+
+  if (!client->connected) {
+    client->connected = true;
+    replay_event(client, HTTP_EVENT_ON_CONNECTED, NULL);
+  }
+  replay_event(client, HTTP_EVENT_HEADER_SENT, NULL);
+
+  replay_answer_t answer = {};
+  if (client->method == HTTP_METHOD_HEAD) {
+    answer.status = 200;
+  } else if (!replay_take(client->post_field, &answer)) {
+    answer.status = 404;
+  }
+  client->status = answer.status;
+  for (auto &piece : answer.pieces) {
+    replay_event(client, HTTP_EVENT_ON_DATA, &piece);
+  }
+  replay_event(client, HTTP_EVENT_ON_FINISH, NULL);
+
+  if (client->method == HTTP_METHOD_HEAD) {
+    warmups++;
+  }
+  --in_flight;
+  return ESP_OK;
+}
+
+esp_err_t esp_http_client_close(esp_http_client_handle_t client) {
+  client->connected = false;
+  return ESP_OK;
+}
+
+esp_err_t esp_http_client_set_header(esp_http_client_handle_t, const char *,
+                                     const char *) {
+  return ESP_OK;
+}
+
+esp_err_t esp_http_client_set_method(esp_http_client_handle_t client,
+                                     esp_http_client_method_t method) {
+  client->method = method;
+  return ESP_OK;
+}
+
+esp_err_t esp_http_client_set_post_field(esp_http_client_handle_t client,
+                                         const char *data, int length) {
+  client->post_field = data == NULL ? "" : std::string(data, length);
+  return ESP_OK;
+}
+
+esp_err_t esp_http_client_set_user_data(esp_http_client_handle_t client,
+                                        void *user_data) {
+  client->user_data = user_data;
+  return ESP_OK;
+}
+
+esp_err_t esp_http_client_set_redirection(esp_http_client_handle_t) {
+  return ESP_OK;
+}
+
+int esp_http_client_get_status_code(esp_http_client_handle_t client) {
+  return client->status;
+}
+
+static bool read_file(const std::string &name, std::string *contents) {
+  std::ifstream file(std::string(data_dir) + "/" + name, std::ios::binary);
+  if (!file) {
+    printf("%s/%s: can't open\n", data_dir, name.c_str());
+    return false;
+  }
+  std::stringstream buffer;
+  buffer << file.rdbuf();
+  *contents = buffer.str();
+  return true;
+}
+
+// Splits a recorded response into its status and its dechunked body pieces
+static bool parse_chunked(const std::string &raw, replay_answer_t *answer) {
+  if (sscanf(raw.c_str(), "HTTP/1.1 %d", &answer->status) != 1) {
+    return false;
+  }
+  auto pos = raw.find("\r\n\r\n");
+  if (pos == std::string::npos) {
+    return false;
+  }
+  pos += 4;
+  while (true) {
+    auto line_end = raw.find("\r\n", pos);
+    if (line_end == std::string::npos) {
+      return false;
+    }
+    auto size = strtoul(raw.substr(pos, line_end - pos).c_str(), NULL, 16);
+    pos = line_end + 2;
+    if (size == 0) {
+      return true;
+    }
+    if (pos + size + 2 > raw.size()) {
+      return false;
+    }
+    answer->pieces.push_back(raw.substr(pos, size));
+    pos += size + 2;
+  }
+}
+
+static replay_answer_t segmented(const std::string &body) {
+  replay_answer_t answer = {};
+  answer.status = 201;
+  for (size_t pos = 0; pos < body.size(); pos += SEGMENT_SIZE) {
+    answer.pieces.push_back(body.substr(pos, SEGMENT_SIZE));
+  }
+  return answer;
+}
+
+// An answer of about size bytes, made of candidate lines
+static std::string generated_answer(size_t size) {
+  std::string body = "v=0\r\n";
+  for (int i = 0; body.size() < size; i++) {
+    char line[128];
+    snprintf(line, sizeof(line),
+             "a=candidate:%d 1 udp 2130706431 10.0.%d.%d 3478 typ host\r\n",
+             i, (i >> 8) & 0xff, i & 0xff);
+    body += line;
+  }
+  return body;
+}
+
+static std::string request(const char *offer) {
+  auto answer = oai_http_request(offer);
+  std::string result = answer == NULL ? "" : answer;
+  free(answer);
+  return result;
+}
+
+static void test_chunked() {
+  std::string raw, expected;
+  replay_answer_t answer = {};
+  if (!read_file("answer_chunked.http", &raw) ||
+      !read_file("answer.sdp", &expected)) {
+    failures++;
+    return;
+  }
+  CHECK(parse_chunked(raw, &answer));
+  CHECK(answer.pieces.size() > 1);
+
+  replay_expect("offer chunked", answer);
+  auto body = request("offer chunked");
+  CHECK(body == expected);
+  printf("chunked: %zu pieces, %zu bytes\n", answer.pieces.size(),
+         body.size());
+}
+
+static void test_large() {
+  auto expected = generated_answer(20 * 1024);
+  replay_expect("offer large", segmented(expected));
+  auto body = request("offer large");
+  CHECK(body == expected);
+  printf("large: %zu bytes\n", body.size());
+}
+
+static void test_oversized() {
+  replay_expect("offer oversized",
+                segmented(generated_answer(SDP_ANSWER_MAX_SIZE + 1024)));
+  CHECK(request("offer oversized").empty());
+
+  // The client that dropped it still serves the next request
+  replay_expect("offer after", segmented("v=0\r\n"));
+  CHECK(request("offer after") == "v=0\r\n");
+}
+
+static void test_concurrent() {
+  auto first = generated_answer(6 * 1024);
+  auto second = generated_answer(9 * 1024);
+  replay_expect("offer first", segmented(first));
+  replay_expect("offer second", segmented(second));
+
+  max_in_flight = 0;
+  wait_for_overlap = true;
+  std::string first_body, second_body;
+  std::thread a([&] { first_body = request("offer first"); });
+  std::thread b([&] { second_body = request("offer second"); });
+  a.join();
+  b.join();
+  wait_for_overlap = false;
+
+  CHECK(max_in_flight == 2);
+  CHECK(first_body == first);
+  CHECK(second_body == second);
+  printf("concurrent: max_in_flight(%d)\n", max_in_flight.load());
+}
+
+int main(int argc, char **argv) {
+  if (argc > 1) {
+    data_dir = argv[1];
+  }
+
+  oai_http_warmup();
+  // Once the warmup has run, holding every client means it has also let go
+  // of its own
+  while (warmups == 0) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  oai_http_client_t *held[HTTP_CLIENTS];
+  for (auto &client : held) {
+    client = oai_http_acquire();
+  }
+  for (auto client : held) {
+    oai_http_release(client);
+  }
+
+  test_chunked();
+  test_large();
+  test_oversized();
+  test_concurrent();
+
+  if (failures > 0) {
+    printf("%d checks failed\n", failures);
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,33 @@
+#pragma once
+
+#include <stddef.h>
+
+// The declarations main/ uses. There is no cJSON on the host, so tests that
+// reach these define them.
+typedef struct cJSON {
+  struct cJSON *next;
+  struct cJSON *prev;
+  struct cJSON *child;
+  int type;
+  char *valuestring;
+  int valueint;
+  double valuedouble;
+  char *string;
+} cJSON;
+
+typedef struct cJSON_Hooks {
+  void *(*malloc_fn)(size_t);
+  void (*free_fn)(void *);
+} cJSON_Hooks;
+
+cJSON *cJSON_Parse(const char *);
+cJSON *cJSON_ParseWithLength(const char *, size_t);
+void cJSON_Delete(cJSON *);
+cJSON *cJSON_GetObjectItem(const cJSON *, const char *);
+int cJSON_IsString(const cJSON *);
+int cJSON_IsNumber(const cJSON *);
+void cJSON_InitHooks(cJSON_Hooks *);
+
+#define cJSON_ArrayForEach(element, array)                                     \
+  for (element = (array != NULL) ? (array)->child : NULL; element != NULL;     \
+       element = element->next)
@@ -0,0 +1,6 @@
+#pragma once
+
+#include <stdint.h>
+
+// Only read by the on-device benchmarks, which the host tests don't build
+static inline uint32_t esp_cpu_get_cycle_count(void) { return 0; }
@@ -0,0 +1,64 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "esp_err.h"
+
+// The part of esp_http_client main/http.cpp uses. The client itself is left
+// to the test, which decides what each request answers.
+typedef struct esp_http_client *esp_http_client_handle_t;
+
+typedef enum {
+  HTTP_EVENT_ERROR,
+  HTTP_EVENT_ON_CONNECTED,
+  HTTP_EVENT_HEADER_SENT,
+  HTTP_EVENT_ON_HEADER,
+  HTTP_EVENT_ON_DATA,
+  HTTP_EVENT_ON_FINISH,
+  HTTP_EVENT_DISCONNECTED,
+  HTTP_EVENT_REDIRECT,
+} esp_http_client_event_id_t;
+
+typedef struct {
+  esp_http_client_event_id_t event_id;
+  esp_http_client_handle_t client;
+  void *data;
+  int data_len;
+  void *user_data;
+  char *header_key;
+  char *header_value;
+} esp_http_client_event_t;
+
+typedef esp_err_t (*http_event_handle_cb)(esp_http_client_event_t *);
+
+typedef enum {
+  HTTP_METHOD_GET,
+  HTTP_METHOD_POST,
+  HTTP_METHOD_HEAD,
+} esp_http_client_method_t;
+
+typedef struct {
+  const char *url;
+  http_event_handle_cb event_handler;
+  esp_err_t (*crt_bundle_attach)(void *);
+  bool save_client_session;
+  bool keep_alive_enable;
+  int keep_alive_idle;
+  int keep_alive_interval;
+  int keep_alive_count;
+  void *user_data;
+} esp_http_client_config_t;
+
+esp_http_client_handle_t esp_http_client_init(const esp_http_client_config_t *);
+esp_err_t esp_http_client_perform(esp_http_client_handle_t);
+esp_err_t esp_http_client_close(esp_http_client_handle_t);
+esp_err_t esp_http_client_set_header(esp_http_client_handle_t, const char *,
+                                     const char *);
+esp_err_t esp_http_client_set_method(esp_http_client_handle_t,
+                                     esp_http_client_method_t);
+esp_err_t esp_http_client_set_post_field(esp_http_client_handle_t,
+                                         const char *, int);
+esp_err_t esp_http_client_set_user_data(esp_http_client_handle_t, void *);
+esp_err_t esp_http_client_set_redirection(esp_http_client_handle_t);
+int esp_http_client_get_status_code(esp_http_client_handle_t);
@@ -0,0 +1,15 @@
+#pragma once
+
+// ESP-IDF brings in assert() along with the logging headers
+#include <assert.h>
+#include <stdio.h>
+
+#include "sdkconfig.h"
+
+#define ESP_LOGE(tag, format, ...)                                             \
+  printf("E %s: " format "\n", tag, ##__VA_ARGS__)
+#define ESP_LOGW(tag, format, ...)                                             \
+  printf("W %s: " format "\n", tag, ##__VA_ARGS__)
+#define ESP_LOGI(tag, format, ...)                                             \
+  printf("I %s: " format "\n", tag, ##__VA_ARGS__)
+#define ESP_LOGD(tag, format, ...)
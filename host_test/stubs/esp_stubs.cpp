@@ -0,0 +1,107 @@
+#include <stdlib.h>
+#include <time.h>
+
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+#include "esp_err.h"
+#include "esp_heap_caps.h"
+#include "esp_random.h"
+#include "esp_timer.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+
+int64_t esp_timer_get_time(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (int64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+void *heap_caps_malloc(size_t size, uint32_t) { return malloc(size); }
+
+void *heap_caps_calloc(size_t n, size_t size, uint32_t) {
+  return calloc(n, size);
+}
+
+void *heap_caps_realloc(void *ptr, size_t size, uint32_t) {
+  return realloc(ptr, size);
+}
+
+void heap_caps_free(void *ptr) { free(ptr); }
+
+uint32_t esp_random(void) {
+  static uint32_t state = 2463534242;
+  state ^= state << 13;
+  state ^= state >> 17;
+  state ^= state << 5;
+  return state;
+}
+
+const char *esp_err_to_name(esp_err_t err) {
+  switch (err) {
+  case ESP_OK:
+    return "ESP_OK";
+  case ESP_FAIL:
+    return "ESP_FAIL";
+  case ESP_ERR_NO_MEM:
+    return "ESP_ERR_NO_MEM";
+  case ESP_ERR_INVALID_ARG:
+    return "ESP_ERR_INVALID_ARG";
+  case ESP_ERR_TIMEOUT:
+    return "ESP_ERR_TIMEOUT";
+  default:
+    return "UNKNOWN ERROR";
+  }
+}
+
+struct host_semaphore {
+  std::mutex mutex;
+  std::condition_variable available;
+  UBaseType_t count;
+  UBaseType_t max;
+};
+
+SemaphoreHandle_t xSemaphoreCreateMutex(void) {
+  return xSemaphoreCreateCounting(1, 1);
+}
+
+SemaphoreHandle_t xSemaphoreCreateCounting(UBaseType_t max,
+                                           UBaseType_t initial) {
+  auto semaphore = new host_semaphore;
+  semaphore->count = initial;
+  semaphore->max = max;
+  return semaphore;
+}
+
+BaseType_t xSemaphoreTake(SemaphoreHandle_t semaphore, TickType_t ticks) {
+  std::unique_lock<std::mutex> lock(semaphore->mutex);
+  auto ready = [semaphore] { return semaphore->count > 0; };
+  if (ticks == portMAX_DELAY) {
+    semaphore->available.wait(lock, ready);
+  } else if (!semaphore->available.wait_for(
+                 lock, std::chrono::milliseconds(ticks), ready)) {
+    return pdFALSE;
+  }
+  semaphore->count--;
+  return pdTRUE;
+}
+
+BaseType_t xSemaphoreGive(SemaphoreHandle_t semaphore) {
+  std::lock_guard<std::mutex> lock(semaphore->mutex);
+  if (semaphore->count == semaphore->max) {
+    return pdFALSE;
+  }
+  semaphore->count++;
+  semaphore->available.notify_one();
+  return pdTRUE;
+}
+
+BaseType_t xTaskCreate(TaskFunction_t function, const char *, uint32_t,
+                       void *arg, UBaseType_t, TaskHandle_t *) {
+  std::thread(function, arg).detach();
+  return pdPASS;
+}
+
+void vTaskDelete(TaskHandle_t) {}
@@ -0,0 +1,11 @@
+#pragma once
+
+#include "freertos/FreeRTOS.h"
+
+typedef void *TaskHandle_t;
+typedef void (*TaskFunction_t)(void *);
+
+// Runs the task on a detached std::thread; it ends when the function returns
+BaseType_t xTaskCreate(TaskFunction_t, const char *, uint32_t, void *,
+                       UBaseType_t, TaskHandle_t *);
+void vTaskDelete(TaskHandle_t);
@@ -0,0 +1,10 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Only the handle type reflect.hpp refers to, and the data channel send
+// realtimeapi.cpp makes
+typedef struct PeerConnection PeerConnection;
+
+int peer_connection_datachannel_send(PeerConnection *, char *, size_t);
@@ -0,0 +1,19 @@
+// Configuration the host tests build main/ with, mirroring the Kconfig
+// defaults except where a test needs a feature turned on
+#pragma once
+
+#define CONFIG_REFLECT_STATS_INTERVAL 10
+#define CONFIG_REFLECT_AUDIO_FRAME_MS 20
+
+#define CONFIG_REFLECT_VAD_THRESHOLD_DB 9
+#define CONFIG_REFLECT_VAD_HANGOVER_MS 300
+
+#define CONFIG_REFLECT_AEC 1
+#define CONFIG_REFLECT_AEC_FILTER_MS 32
+#define CONFIG_REFLECT_AEC_MAX_DELAY_MS 250
+
+#define CONFIG_OPENAI_API_KEY "host-test"
+#define CONFIG_OPENAI_REALTIME_API_URL                                         \
+  "https://api.openai.com/v1/realtime/calls?model=gpt-realtime"
+
+#define CONFIG_REFLECT_TOOL_RESPONSE_CREATE 1
@@ -0,0 +1,510 @@
+// Fuzzes and times the tool call decoder in main/realtimeapi.cpp, checks
+// that the session.update it generates is valid JSON, and that the results
+// of a response's tool calls get one response.create once it is done, even
+// when that response.done is too large to keep.
+//
+//   tools_fuzz [mutations]
+//
+// Every tool's sample arguments are fed through the decoder truncated at each
+// byte and with runs of random edits (bytes replaced, inserted, dropped).
+// Accepted arguments must decode to values inside their declared ranges. The
+// fuzz target is built with ASan and UBSan, so out-of-bounds reads in the
+// scanner and undefined behaviour fail the run; tools_bench is the same
+// source built plainly for timing.
+
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+// The decoder and the tool tables are file-local, so the test builds the
+// file itself rather than linking it
+#include "realtimeapi.cpp"
+
+#define DEFAULT_MUTATIONS 200000
+#define MAX_EDITS 4
+#define BENCHMARK_CALLS 1000000
+
+// A response.done transcript past what main/events.cpp keeps, delivered in
+// SCTP-sized fragments
+#define LARGE_RESPONSE_DONE_SIZE 40000
+#define FRAGMENT_SIZE 1200
+
+static int failures = 0;
+
+#define CHECK(condition)                                                       \
+  do {                                                                         \
+    if (!(condition)) {                                                        \
+      printf("FAIL %s:%d: %s\n", __FILE__, __LINE__, #condition);              \
+      failures++;                                                              \
+    }                                                                          \
+  } while (0)
+
+// What the handlers and the event paths reach outside realtimeapi.cpp.
+// Handlers are never called by the fuzz, only by the known cases.
+bool send_lifx_set_power(int, uint32_t) { return true; }
+bool send_lifx_set_color(uint16_t, uint16_t, uint16_t, uint16_t, uint32_t) {
+  return true;
+}
+
+// Bulbs reflect_lifx_bulbs reports, all with full-length labels
+static size_t lifx_bulb_count = 0;
+
+size_t reflect_lifx_bulbs(reflect_lifx_bulb_t *bulbs, size_t max) {
+  for (size_t i = 0; i < lifx_bulb_count && i < max; i++) {
+    memset(&bulbs[i], 0, sizeof(bulbs[i]));
+    memset(bulbs[i].label, 'l', REFLECT_LIFX_LABEL_SIZE - 1);
+    memset(bulbs[i].group, 'g', REFLECT_LIFX_LABEL_SIZE - 1);
+    bulbs[i].hue = bulbs[i].saturation = 65535;
+    bulbs[i].brightness = bulbs[i].kelvin = 65535;
+    bulbs[i].reported_us = 1;
+  }
+  return lifx_bulb_count;
+}
+void reflect_effect_stop() {}
+void reflect_effect_start(const reflect_effect_t *) {}
+
+static std::vector<std::string> datachannel_sent;
+static bool datachannel_open = true;
+
+bool reflect_datachannel_send(const char *data, size_t size) {
+  if (!datachannel_open) {
+    return false;
+  }
+  datachannel_sent.emplace_back(data, size);
+  return true;
+}
+void reflect_peer_loop_wake() {}
+int peer_connection_datachannel_send(PeerConnection *, char *, size_t) {
+  return 0;
+}
+cJSON *cJSON_ParseWithLength(const char *, size_t) { return NULL; }
+void cJSON_Delete(cJSON *) {}
+cJSON *cJSON_GetObjectItem(const cJSON *, const char *) { return NULL; }
+int cJSON_IsString(const cJSON *) { return 0; }
+int cJSON_IsNumber(const cJSON *) { return 0; }
+
+// A tool with as many parameters as the registry allows, all required, so
+// the last one sits on the top bit of the seen mask
+typedef struct {
+  uint8_t values[TOOL_PARAMETERS_MAX];
+} wide_args_t;
+
+static constexpr const char *kWideNames[TOOL_PARAMETERS_MAX] = {
+    "p0",  "p1",  "p2",  "p3",  "p4",  "p5",  "p6",  "p7",
+    "p8",  "p9",  "p10", "p11", "p12", "p13", "p14", "p15",
+    "p16", "p17", "p18", "p19", "p20", "p21", "p22", "p23",
+    "p24", "p25", "p26", "p27", "p28", "p29", "p30", "p31"};
+
+struct WideParameters {
+  tool_parameter_t table[TOOL_PARAMETERS_MAX];
+};
+
+static constexpr WideParameters wide_parameters() {
+  WideParameters parameters{};
+  for (size_t i = 0; i < TOOL_PARAMETERS_MAX; i++) {
+    parameters.table[i] = {kWideNames[i],
+                           TOOL_PARAMETER_NUMBER,
+                           "",
+                           0,
+                           255,
+                           0,
+                           true,
+                           offsetof(wide_args_t, values) + i,
+                           sizeof(uint8_t),
+                           nullptr};
+  }
+  return parameters;
+}
+
+static constexpr WideParameters kWideParameters = wide_parameters();
+
+static bool wide(const void *, char *, size_t) { return true; }
+
+static constexpr tool_t kWideTool = {
+    "wide", "", kWideParameters.table, TOOL_PARAMETERS_MAX,
+    sizeof(wide_args_t), wide};
+
+// Arguments with the top bit's parameter left out when skip is 31, or all of
+// them when skip is out of range
+static std::string wide_arguments(size_t skip) {
+  std::string json = "{";
+  for (size_t i = 0; i < TOOL_PARAMETERS_MAX; i++) {
+    if (i == skip) {
+      continue;
+    }
+    if (json.size() > 1) {
+      json += ",";
+    }
+    json += "\"" + std::string(kWideNames[i]) + "\":" + std::to_string(i);
+  }
+  return json + "}";
+}
+
+static const char kSetColorArguments[] =
+    "{\"hue\":43690,\"saturation\":65535,\"brightness\":32768,"
+    "\"kelvin\":3500,\"duration\":2000}";
+
+typedef struct {
+  const tool_t *tool;
+  const char *arguments;
+} fuzz_seed_t;
+
+static const fuzz_seed_t kSeeds[] = {
+    {&kSetColorTool, kSetColorArguments},
+    {&kSetLightPowerTool, "{\"on\":true,\"duration\":250}"},
+    {&kRunEffectTool,
+     "{\"kind\":\"breathe\",\"hue\":120,\"brightness\":40000,"
+     "\"period\":2500,\"duration\":30,\"extra\":[1,{\"a\":\"}\"}]}"},
+};
+
+typedef struct {
+  const tool_t *tool;
+  const char *arguments;
+  bool accepted;
+} known_case_t;
+
+static const known_case_t kKnownCases[] = {
+    {&kSetLightPowerTool, "{\"on\":false,\"duration\":0}", true},
+    {&kSetLightPowerTool, " { \"duration\" : 10 , \"on\" : true } ", true},
+    {&kSetLightPowerTool, "{\"on\":1,\"duration\":0}", false},
+    {&kSetLightPowerTool, "{\"on\":true}", false},
+    {&kSetLightPowerTool, "{\"on\":true,\"duration\":1e3}", false},
+    {&kSetLightPowerTool, "{\"on\":true,\"duration\":5} x", false},
+    {&kSetLightPowerTool, "{\"on\":true,\"duration\":5,}", false},
+    {&kSetLightPowerTool, "[]", false},
+    {&kSetLightPowerTool, "", false},
+    {&kRunEffectTool, "{\"kind\":\"candle\"}", true},
+    {&kRunEffectTool, "{\"kind\":\"disco\"}", false},
+    {&kRunEffectTool, "{}", false},
+    {&kGetLightStateTool, "{}", true},
+    {&kGetLightStateTool, "{\"anything\":[1,2,{}]}", true},
+};
+
+static int64_t read_field(const tool_parameter_t *parameter,
+                          const uint8_t *arguments) {
+  auto field = arguments + parameter->offset;
+  if (parameter->type == TOOL_PARAMETER_BOOLEAN) {
+    return *(const bool *)field;
+  }
+  if (parameter->size == sizeof(uint8_t)) {
+    return *field;
+  }
+  if (parameter->size == sizeof(uint16_t)) {
+    return *(const uint16_t *)field;
+  }
+  return *(const uint32_t *)field;
+}
+
+// Decodes from a heap copy sized to the input, so ASan catches any read past
+// its terminator
+static bool decode(const tool_t *tool, const std::string &json,
+                   uint8_t *decoded) {
+  auto copy = (char *)malloc(json.size() + 1);
+  memcpy(copy, json.c_str(), json.size() + 1);
+  auto accepted = tool_decode(tool, copy, decoded);
+  free(copy);
+  if (!accepted) {
+    return false;
+  }
+
+  for (size_t i = 0; i < tool->parameter_count; i++) {
+    auto parameter = &tool->parameters[i];
+    auto value = read_field(parameter, decoded);
+    if (value < parameter->minimum || value > parameter->maximum) {
+      printf("FAIL %s %s out of range (%lld) in %s\n", tool->name,
+             parameter->name, (long long)value, json.c_str());
+      failures++;
+    }
+  }
+  return true;
+}
+
+// Minimal strict JSON check for the generated session.update
+static const char *json_validate(const char *json, int depth);
+
+static const char *json_validate_string(const char *json) {
+  for (json++; *json != '"'; json++) {
+    if (*json == '\0' || (unsigned char)*json < 0x20) {
+      return NULL;
+    }
+    if (*json == '\\') {
+      json++;
+      if (*json == 'u') {
+        for (int i = 1; i <= 4; i++) {
+          if (!isxdigit((unsigned char)json[i])) {
+            return NULL;
+          }
+        }
+        json += 4;
+      } else if (strchr("\"\\/bfnrt", *json) == NULL || *json == '\0') {
+        return NULL;
+      }
+    }
+  }
+  return json + 1;
+}
+
+static const char *json_validate(const char *json, int depth) {
+  json = json_skip_space(json);
+  if (depth > 32) {
+    return NULL;
+  }
+  if (*json == '"') {
+    return json_validate_string(json);
+  }
+  if (*json == '{' || *json == '[') {
+    auto close = *json == '{' ? '}' : ']';
+    json = json_skip_space(json + 1);
+    if (*json == close) {
+      return json + 1;
+    }
+    while (true) {
+      if (close == '}') {
+        if (*json != '"' || (json = json_validate_string(json)) == NULL) {
+          return NULL;
+        }
+        json = json_skip_space(json);
+        if (*json++ != ':') {
+          return NULL;
+        }
+      }
+      if ((json = json_validate(json, depth + 1)) == NULL) {
+        return NULL;
+      }
+      json = json_skip_space(json);
+      if (*json == close) {
+        return json + 1;
+      }
+      if (*json++ != ',') {
+        return NULL;
+      }
+      json = json_skip_space(json);
+    }
+  }
+  for (auto literal : {"true", "false", "null"}) {
+    if (strncmp(json, literal, strlen(literal)) == 0) {
+      return json + strlen(literal);
+    }
+  }
+  int64_t value;
+  return json_number(json, &value);
+}
+
+static void test_session_update() {
+  auto &payload = LunaSessionUpdate::payload;
+  CHECK(strlen(payload.data) == payload.size);
+  auto end = json_validate(payload.data, 0);
+  CHECK(end != NULL && *json_skip_space(end) == '\0');
+  for (auto tool : LunaTools::table) {
+    CHECK(strstr(payload.data, tool->name) != NULL);
+  }
+  printf("session_update: %zu bytes, %zu tools\n", payload.size,
+         LunaTools::count);
+}
+
+static void test_known_cases() {
+  alignas(8) uint8_t decoded[TOOL_ARGUMENTS_MAX_SIZE];
+  for (auto &known : kKnownCases) {
+    auto accepted = decode(known.tool, known.arguments, decoded);
+    if (accepted != known.accepted) {
+      printf("FAIL %s %s: expected %s\n", known.tool->name, known.arguments,
+             known.accepted ? "accepted" : "rejected");
+      failures++;
+    }
+  }
+
+  // Out of range numbers are clamped, fractions rounded
+  CHECK(decode(&kSetColorTool,
+               "{\"hue\":70000,\"saturation\":-5,\"brightness\":1.5,"
+               "\"kelvin\":3500,\"duration\":0}",
+               decoded));
+  auto color = (const set_color_args_t *)decoded;
+  CHECK(color->hue == 65535 && color->saturation == 0 &&
+        color->brightness == 2);
+
+  // Defaults fill what optional parameters leave out
+  CHECK(decode(&kRunEffectTool, "{\"kind\":\"pulse\"}", decoded));
+  auto effect = (const reflect_effect_t *)decoded;
+  CHECK(effect->kind == REFLECT_EFFECT_PULSE && effect->kelvin == 2700 &&
+        effect->period == 4000);
+
+  CHECK(decode(&kWideTool, wide_arguments(TOOL_PARAMETERS_MAX), decoded));
+  CHECK(((const wide_args_t *)decoded)->values[31] == 31);
+  CHECK(!decode(&kWideTool, wide_arguments(31), decoded));
+  CHECK(!decode(&kWideTool, wide_arguments(0), decoded));
+}
+
+static void test_light_state() {
+  char output[TOOL_OUTPUT_SIZE];
+  lifx_bulb_count = 0;
+  CHECK(!get_light_state(NULL, output, sizeof(output)));
+
+  lifx_bulb_count = LIGHT_STATE_MAX_BULBS + 2;
+  CHECK(get_light_state(NULL, output, sizeof(output)));
+  auto end = json_validate(output, 0);
+  CHECK(end != NULL && *end == '\0');
+  size_t bulbs = 0;
+  for (auto p = output; (p = strstr(p, "\"label\"")) != NULL; p++) {
+    bulbs++;
+  }
+  CHECK(bulbs == LIGHT_STATE_MAX_BULBS);
+  printf("light_state: %zu bulbs in %zu of %d bytes\n", bulbs,
+         strlen(output), TOOL_OUTPUT_SIZE);
+  lifx_bulb_count = 0;
+}
+
+// Two parallel calls in one response, the way the API streams them
+static void test_response_create() {
+  static const char *const kEvents[] = {
+      "{\"type\":\"response.output_item.added\",\"item\":{}}",
+      "{\"type\":\"response.function_call_arguments.done\",\"call_id\":"
+      "\"call_1\",\"name\":\"set_light_power\",\"arguments\":"
+      "\"{\\\"on\\\":true,\\\"duration\\\":0}\"}",
+      "{\"type\":\"response.function_call_arguments.done\",\"call_id\":"
+      "\"call_2\",\"name\":\"get_light_state\",\"arguments\":\"{}\"}",
+  };
+  static const char kResponseDone[] =
+      "{\"type\":\"response.done\",\"response\":{\"status\":"
+      "\"completed\",\"output\":[{\"type\":\"function_call\"}]}}";
+
+  send_session_update(NULL);
+  reflect_events_reset();
+  datachannel_sent.clear();
+  for (auto event : kEvents) {
+    reflect_events_push(event, strlen(event));
+  }
+
+  // Results go out as they are ready, the response.create only at the end
+  CHECK(datachannel_sent.size() == 2);
+  for (auto &message : datachannel_sent) {
+    CHECK(message.find("function_call_output") != std::string::npos);
+  }
+  reflect_events_push(kResponseDone, strlen(kResponseDone));
+  CHECK(datachannel_sent.size() == 3);
+  CHECK(datachannel_sent.back() == kResponseCreate);
+
+  // The response that answers them makes no calls and asks for nothing
+  reflect_events_push(kResponseDone, strlen(kResponseDone));
+  CHECK(datachannel_sent.size() == 3);
+
+  // Results that never went out aren't answered for either
+  datachannel_open = false;
+  for (auto event : kEvents) {
+    reflect_events_push(event, strlen(event));
+  }
+  datachannel_open = true;
+  reflect_events_push(kResponseDone, strlen(kResponseDone));
+  CHECK(datachannel_sent.size() == 3);
+
+  // A response.done too large to keep still gets its response.create
+  reflect_events_push(kEvents[1], strlen(kEvents[1]));
+  CHECK(datachannel_sent.size() == 4);
+  std::string large = "{\"type\":\"response.done\",\"response\":{"
+                      "\"output\":[{\"transcript\":\"";
+  large += std::string(LARGE_RESPONSE_DONE_SIZE, 'x');
+  large += "\"}]}}";
+  for (size_t i = 0; i < large.size(); i += FRAGMENT_SIZE) {
+    auto size = std::min<size_t>(FRAGMENT_SIZE, large.size() - i);
+    reflect_events_push(large.data() + i, size);
+  }
+  CHECK(datachannel_sent.size() == 5);
+  CHECK(datachannel_sent.back() == kResponseCreate);
+}
+
+#if !TOOLS_BENCH
+static std::string mutate(const std::string &json) {
+  static const char alphabet[] = "{}[]\",:\\ -.0123456789eEtrufalsn\x01\xff";
+  auto mutated = json;
+  auto edits = 1 + esp_random() % MAX_EDITS;
+  for (uint32_t i = 0; i < edits; i++) {
+    auto position = mutated.empty() ? 0 : esp_random() % mutated.size();
+    auto c = alphabet[esp_random() % (sizeof(alphabet) - 1)];
+    switch (esp_random() % 3) {
+    case 0:
+      if (!mutated.empty()) {
+        mutated[position] = c;
+      }
+      break;
+    case 1:
+      mutated.insert(mutated.begin() + position, c);
+      break;
+    default:
+      if (!mutated.empty()) {
+        mutated.erase(mutated.begin() + position);
+      }
+      break;
+    }
+  }
+  return mutated;
+}
+
+static void fuzz(uint32_t mutations) {
+  alignas(8) uint8_t decoded[TOOL_ARGUMENTS_MAX_SIZE];
+  uint32_t inputs = 0;
+  uint32_t accepted = 0;
+
+  std::string wide = wide_arguments(TOOL_PARAMETERS_MAX);
+  fuzz_seed_t seeds[sizeof(kSeeds) / sizeof(kSeeds[0]) + 1];
+  memcpy(seeds, kSeeds, sizeof(kSeeds));
+  seeds[sizeof(kSeeds) / sizeof(kSeeds[0])] = {&kWideTool, wide.c_str()};
+
+  for (auto &seed : seeds) {
+    std::string arguments = seed.arguments;
+    CHECK(decode(seed.tool, arguments, decoded));
+    for (size_t i = 0; i < arguments.size(); i++) {
+      accepted += decode(seed.tool, arguments.substr(0, i), decoded);
+      inputs++;
+    }
+  }
+
+  for (uint32_t i = 0; i < mutations; i++) {
+    auto &seed = seeds[esp_random() % (sizeof(seeds) / sizeof(seeds[0]))];
+    accepted += decode(seed.tool, mutate(seed.arguments), decoded);
+    inputs++;
+  }
+
+  printf("fuzz: inputs(%" PRIu32 ") accepted(%" PRIu32 ") rejected(%" PRIu32
+         ")\n",
+         inputs, accepted, inputs - accepted);
+}
+
+#else
+static void benchmark() {
+  alignas(8) uint8_t decoded[TOOL_ARGUMENTS_MAX_SIZE];
+  uint32_t accepted = 0;
+  auto start = std::chrono::steady_clock::now();
+  for (uint32_t i = 0; i < BENCHMARK_CALLS; i++) {
+    auto tool = tool_find("set_color");
+    accepted += tool_decode(tool, kSetColorArguments, decoded);
+  }
+  auto elapsed = std::chrono::steady_clock::now() - start;
+  auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed);
+  CHECK(accepted == BENCHMARK_CALLS);
+  printf("benchmark: set_color lookup and decode %.0f ns/call, "
+         "0 allocations\n",
+         (double)ns.count() / BENCHMARK_CALLS);
+}
+#endif
+
+int main(int argc, char **argv) {
+  test_session_update();
+  test_known_cases();
+  test_light_state();
+  test_response_create();
+#if TOOLS_BENCH
+  (void)argc;
+  (void)argv;
+  benchmark();
+#else
+  fuzz(argc > 1 ? (uint32_t)strtoul(argv[1], NULL, 10) : DEFAULT_MUTATIONS);
+#endif
+
+  if (failures > 0) {
+    printf("%d checks failed\n", failures);
+    return 1;
+  }
+  return 0;
+}
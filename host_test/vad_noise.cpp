@@ -0,0 +1,106 @@
+// Runs the voice activity detector from main/vad.cpp over synthesized mic
+// input and checks that it lets go of a background noise that steps up and
+// stays, while still holding on through continuous speech.
+//
+//   vad_noise
+//
+// A low hum plays for a while and then gets louder by STEP_DB, the way an
+// HVAC unit or a TV coming on would; the VAD may fire on the step but has to
+// release within RELEASE_MAX_MS. Then speech starts over the louder hum and
+// has to be counted as speech for at least SPEECH_MIN_PERCENT of its frames.
+
+#include <cmath>
+#include <cstdio>
+#include <vector>
+
+#include "reflect.hpp"
+
+#define SAMPLE_RATE 16000
+#define FRAME_SAMPLES (CONFIG_REFLECT_AUDIO_FRAME_MS * SAMPLE_RATE / 1000)
+
+#define HUM_HZ 120.0f
+#define HUM_LEVEL 0.01f
+#define STEP_DB 15.0f
+
+#define QUIET_MS 5000
+#define LOUD_MS 20000
+#define SPEECH_MS 10000
+
+#define RELEASE_MAX_MS 6000
+#define SPEECH_MIN_PERCENT 90
+
+static uint32_t lcg_state = 1;
+
+// Uniform in [-1, 1)
+static float noise() {
+  lcg_state = lcg_state * 1664525 + 1013904223;
+  return (int32_t)lcg_state / 2147483648.0f;
+}
+
+// Runs duration_ms of input through the VAD, returning how many frames were
+// active and when the last active one ended
+static void run(float (*sample)(size_t), size_t *n, uint32_t duration_ms,
+                uint32_t *active_frames, uint32_t *last_active_ms) {
+  int16_t frame[FRAME_SAMPLES];
+  *active_frames = 0;
+  *last_active_ms = 0;
+  for (uint32_t ms = 0; ms < duration_ms;
+       ms += CONFIG_REFLECT_AUDIO_FRAME_MS) {
+    for (size_t i = 0; i < FRAME_SAMPLES; i++, (*n)++) {
+      frame[i] = (int16_t)(sample(*n) * 32767.0f);
+    }
+    reflect_vad_t vad;
+    reflect_vad_process(frame, FRAME_SAMPLES, CONFIG_REFLECT_AUDIO_FRAME_MS,
+                        &vad);
+    if (vad.active) {
+      (*active_frames)++;
+      *last_active_ms = ms + CONFIG_REFLECT_AUDIO_FRAME_MS;
+    }
+  }
+}
+
+static float hum(size_t n, float level) {
+  auto t = (float)n / SAMPLE_RATE;
+  return level * (sinf(2 * (float)M_PI * HUM_HZ * t) + 0.1f * noise());
+}
+
+static float quiet_hum(size_t n) { return hum(n, HUM_LEVEL); }
+
+static float loud_hum(size_t n) {
+  return hum(n, HUM_LEVEL * powf(10.0f, STEP_DB / 20.0f));
+}
+
+// Low-passed noise in syllable bursts over the loud hum
+static float speech(size_t n) {
+  static float low_pass = 0;
+  auto t = (float)n / SAMPLE_RATE;
+  auto syllable = fabsf(sinf(2 * (float)M_PI * 3.0f * t));
+  low_pass += 0.3f * (noise() - low_pass);
+  return loud_hum(n) + 0.5f * syllable * low_pass;
+}
+
+int main() {
+  size_t n = 0;
+  uint32_t active_frames, last_active_ms;
+
+  run(quiet_hum, &n, QUIET_MS, &active_frames, &last_active_ms);
+  printf("quiet: active_frames(%u)\n", active_frames);
+
+  run(loud_hum, &n, LOUD_MS, &active_frames, &last_active_ms);
+  printf("step: active_frames(%u) released_ms(%u)\n", active_frames,
+         last_active_ms);
+  auto released = last_active_ms <= RELEASE_MAX_MS;
+
+  run(speech, &n, SPEECH_MS, &active_frames, &last_active_ms);
+  auto speech_percent =
+      active_frames * 100 / (SPEECH_MS / CONFIG_REFLECT_AUDIO_FRAME_MS);
+  printf("speech: active_percent(%u)\n", speech_percent);
+
+  if (!released || speech_percent < SPEECH_MIN_PERCENT) {
+    printf("FAIL: expected release within %dms of the step and speech "
+           "active for %d%% of frames\n",
+           RELEASE_MAX_MS, SPEECH_MIN_PERCENT);
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,360 @@
+#include <atomic>
+#include <cinttypes>
+#include <cmath>
+#include <cstring>
+#include <esp_heap_caps.h>
+#include <esp_timer.h>
+
+#include "reflect.hpp"
+
+#if CONFIG_REFLECT_AEC
+
+#define LOG_TAG "aec"
+
+#define AEC_SAMPLE_RATE 16000
+#define AEC_TAPS (CONFIG_REFLECT_AEC_FILTER_MS * AEC_SAMPLE_RATE / 1000)
+#define AEC_MAX_FRAME_SAMPLES 960
+
+// Far end (speaker) history, power of two. Has to cover the largest delay
+// plus the filter plus however far the sender lags behind capture.
+#define FAR_RING_SAMPLES 16384
+
+// Delay is estimated by correlating far and near energy envelopes, built
+// from blocks of this many samples (divides every supported frame size)
+#define ENV_BLOCK_SAMPLES 32
+#define FAR_ENV_BLOCKS 1024
+#define MIC_ENV_BLOCKS 512
+#define MAX_LAG_BLOCKS                                                         \
+  (CONFIG_REFLECT_AEC_MAX_DELAY_MS * AEC_SAMPLE_RATE / 1000 / ENV_BLOCK_SAMPLES)
+#define DELAY_ESTIMATE_FRAMES 50
+#define DELAY_MIN_CORRELATION 0.5f
+
+// Part of the filter kept ahead of the estimated delay, for the estimate's
+// block resolution
+#define DELAY_HEADROOM_SAMPLES ENV_BLOCK_SAMPLES
+
+#define NLMS_STEP 0.3f
+#define NLMS_EPSILON (AEC_TAPS * 1e-6f)
+
+// Far end frames quieter than this (mean square, full scale = 1) don't adapt
+#define FAR_ACTIVE_POWER 1e-6f
+
+// Once the filter has converged, a mic frame this much louder than the far
+// end through the echo path means the near end is talking too
+#define CONVERGED_ERLE_DB 6.0f
+#define DOUBLE_TALK_RATIO 2.0f
+
+// Nobody talks over the far end this long; it's the echo path that changed
+// (the device moved), and the echo gain has to be learned again
+#define DOUBLE_TALK_MAX_MS 3000
+
+static int16_t *far_ring = NULL;
+static std::atomic<uint32_t> far_pos{0};
+static float far_env[FAR_ENV_BLOCKS];
+static float far_block_energy = 0;
+static size_t far_block_fill = 0;
+
+static float mic_env[MIC_ENV_BLOCKS];
+static uint32_t mic_env_far_block[MIC_ENV_BLOCKS];
+static uint32_t mic_env_count = 0;
+static uint32_t frames_since_estimate = 0;
+static uint32_t blocks_since_double_talk = MIC_ENV_BLOCKS;
+
+static float *weights = NULL;
+static float *reference = NULL;
+static float *error = NULL;
+
+static uint32_t delay_samples = 0;
+// Mic power over reference power while only the far end is playing
+static float echo_gain = 0;
+// Set once the ERLE first gets past CONVERGED_ERLE_DB, and only cleared by
+// a delay change, since the ERLE itself drops as soon as double talk is
+// missed
+static bool converged = false;
+static uint32_t double_talk_ms = 0;
+static float near_power = 0;
+static float error_power = 0;
+static std::atomic<float> erle_db{0};
+
+static uint32_t frame_us = 0;
+static uint32_t frame_max_us = 0;
+static uint32_t double_talk_frames = 0;
+static uint32_t delay_changes = 0;
+
+uint32_t reflect_aec_far_position() {
+  return far_pos.load(std::memory_order_acquire);
+}
+
+// Called with every frame handed to the speaker, silence included, so the
+// far end timeline runs at the codec clock
+void reflect_aec_far(const int16_t *samples, size_t count) {
+  auto pos = far_pos.load(std::memory_order_relaxed);
+  for (size_t i = 0; i < count; i++) {
+    far_ring[(pos + i) & (FAR_RING_SAMPLES - 1)] = samples[i];
+
+    auto x = samples[i] / 32768.0f;
+    far_block_energy += x * x;
+    if (++far_block_fill == ENV_BLOCK_SAMPLES) {
+      auto block = (pos + i) / ENV_BLOCK_SAMPLES;
+      far_env[block % FAR_ENV_BLOCKS] =
+          sqrtf(far_block_energy / ENV_BLOCK_SAMPLES);
+      far_block_energy = 0;
+      far_block_fill = 0;
+    }
+  }
+  far_pos.store(pos + count, std::memory_order_release);
+}
+
+// Until the ERLE is back past CONVERGED_ERLE_DB every frame with far end
+// audio adapts, which also learns the echo gain again
+static void reset_convergence() {
+  near_power = 0;
+  error_power = 0;
+  erle_db = 0;
+  converged = false;
+}
+
+static void record_mic_envelope(const int16_t *samples, size_t count,
+                                uint32_t far_at_capture) {
+  auto blocks = count / ENV_BLOCK_SAMPLES;
+  auto last_far_block = far_at_capture / ENV_BLOCK_SAMPLES;
+
+  for (size_t b = 0; b < blocks; b++) {
+    float energy = 0;
+    for (size_t i = 0; i < ENV_BLOCK_SAMPLES; i++) {
+      auto x = samples[b * ENV_BLOCK_SAMPLES + i] / 32768.0f;
+      energy += x * x;
+    }
+
+    auto slot = mic_env_count % MIC_ENV_BLOCKS;
+    mic_env[slot] = sqrtf(energy / ENV_BLOCK_SAMPLES);
+    mic_env_far_block[slot] = last_far_block - (blocks - 1 - b);
+    mic_env_count++;
+  }
+}
+
+// Finds the lag (in far end blocks) at which the mic envelope best matches
+// the far end envelope, using normalized cross-correlation
+static void estimate_delay() {
+  if (mic_env_count < MIC_ENV_BLOCKS) {
+    return;
+  }
+
+  float mic_mean = 0;
+  for (size_t i = 0; i < MIC_ENV_BLOCKS; i++) {
+    mic_mean += mic_env[i];
+  }
+  mic_mean /= MIC_ENV_BLOCKS;
+
+  float best_correlation = 0;
+  int best_lag = -1;
+  for (int lag = 0; lag <= MAX_LAG_BLOCKS; lag++) {
+    float far_mean = 0;
+    for (size_t i = 0; i < MIC_ENV_BLOCKS; i++) {
+      far_mean += far_env[(mic_env_far_block[i] - lag) % FAR_ENV_BLOCKS];
+    }
+    far_mean /= MIC_ENV_BLOCKS;
+
+    float cross = 0;
+    float mic_var = 0;
+    float far_var = 0;
+    for (size_t i = 0; i < MIC_ENV_BLOCKS; i++) {
+      auto far = far_env[(mic_env_far_block[i] - lag) % FAR_ENV_BLOCKS];
+      auto m = mic_env[i] - mic_mean;
+      auto f = far - far_mean;
+      cross += m * f;
+      mic_var += m * m;
+      far_var += f * f;
+    }
+
+    if (mic_var <= 0 || far_var <= 0) {
+      continue;
+    }
+
+    auto correlation = cross / sqrtf(mic_var * far_var);
+    if (correlation > best_correlation) {
+      best_correlation = correlation;
+      best_lag = lag;
+    }
+  }
+
+  if (best_lag < 0 || best_correlation < DELAY_MIN_CORRELATION) {
+    return;
+  }
+
+  auto lag_samples = (uint32_t)best_lag * ENV_BLOCK_SAMPLES;
+  auto delay = lag_samples > DELAY_HEADROOM_SAMPLES
+                   ? lag_samples - DELAY_HEADROOM_SAMPLES
+                   : 0;
+
+  // Small moves are left to the filter, a real jump restarts it
+  auto moved = delay > delay_samples ? delay - delay_samples
+                                     : delay_samples - delay;
+  if (moved > 2 * ENV_BLOCK_SAMPLES) {
+    ESP_LOGI(LOG_TAG, "Echo delay %" PRIu32 "ms (correlation %.2f)",
+             delay * 1000 / AEC_SAMPLE_RATE, best_correlation);
+    delay_samples = delay;
+    memset(weights, 0, AEC_TAPS * sizeof(float));
+    // Otherwise everything the empty filter leaves looks like double talk,
+    // and it never adapts again
+    reset_convergence();
+    delay_changes++;
+  }
+}
+
+// Gathers the far end samples that line up with a mic frame: the newest one
+// is delay_samples before the far position recorded when the frame was
+// captured, plus AEC_TAPS - 1 older ones for the filter history
+static float load_reference(size_t count, uint32_t far_at_capture) {
+  auto newest = (int64_t)far_at_capture - delay_samples;
+  auto oldest = newest - ((int64_t)count - 1) - (AEC_TAPS - 1);
+  auto written = (int64_t)far_pos.load(std::memory_order_acquire);
+
+  float power = 0;
+  for (size_t i = 0; i < count + AEC_TAPS - 1; i++) {
+    auto pos = oldest + (int64_t)i;
+    if (pos < 0 || pos >= written || written - pos > FAR_RING_SAMPLES) {
+      reference[i] = 0;
+    } else {
+      reference[i] = far_ring[pos & (FAR_RING_SAMPLES - 1)] / 32768.0f;
+    }
+
+    if (i >= AEC_TAPS - 1) {
+      power += reference[i] * reference[i];
+    }
+  }
+  return power / count;
+}
+
+void reflect_aec_process(int16_t *samples, size_t count,
+                         uint32_t far_at_capture) {
+  auto start_us = esp_timer_get_time();
+
+  // Near end speech in the envelope can line up with the far end at some
+  // other lag, so the delay is only estimated over stretches without it
+  record_mic_envelope(samples, count, far_at_capture);
+  if (++frames_since_estimate >= DELAY_ESTIMATE_FRAMES &&
+      blocks_since_double_talk >= MIC_ENV_BLOCKS) {
+    frames_since_estimate = 0;
+    estimate_delay();
+  }
+
+  auto far_power = load_reference(count, far_at_capture);
+
+  // Once the filter has converged, a frame much louder than the far end
+  // through the echo path is the near end talking, which would pull the
+  // weights away. Decided before adapting, so not even one frame of it
+  // gets in.
+  bool far_active = far_power > FAR_ACTIVE_POWER;
+  float frame_near_power = 0;
+  for (size_t n = 0; n < count; n++) {
+    auto near = samples[n] / 32768.0f;
+    frame_near_power += near * near;
+  }
+  auto frame_far_power = far_power * count;
+  if (erle_db > CONVERGED_ERLE_DB) {
+    converged = true;
+  }
+  bool double_talk =
+      far_active && converged &&
+      frame_near_power > DOUBLE_TALK_RATIO * echo_gain * frame_far_power;
+  if (double_talk) {
+    double_talk_frames++;
+    blocks_since_double_talk = 0;
+    double_talk_ms += count * 1000 / AEC_SAMPLE_RATE;
+    if (double_talk_ms >= DOUBLE_TALK_MAX_MS) {
+      reset_convergence();
+      double_talk = false;
+    }
+  } else {
+    blocks_since_double_talk += count / ENV_BLOCK_SAMPLES;
+  }
+  if (!double_talk) {
+    double_talk_ms = 0;
+  }
+
+  // Adapts (NLMS) one sample at a time, so each error is measured with
+  // the weights the previous sample left
+  bool adapt = far_active && !double_talk;
+  float power = 0;
+  for (size_t k = 0; k < AEC_TAPS; k++) {
+    power += reference[k] * reference[k];
+  }
+
+  float frame_error_power = 0;
+  for (size_t n = 0; n < count; n++) {
+    auto x = &reference[n];
+    float echo = 0;
+    for (size_t k = 0; k < AEC_TAPS; k++) {
+      echo += weights[k] * x[k];
+    }
+
+    auto near = samples[n] / 32768.0f;
+    error[n] = near - echo;
+
+    frame_error_power += error[n] * error[n];
+
+    if (adapt) {
+      auto step = NLMS_STEP * error[n] / (power + NLMS_EPSILON);
+      for (size_t k = 0; k < AEC_TAPS; k++) {
+        weights[k] += step * x[k];
+      }
+    }
+
+    auto leaving = x[0];
+    auto entering = n + 1 < count ? x[AEC_TAPS] : 0;
+    power += entering * entering - leaving * leaving;
+    if (power < 0) {
+      power = 0;
+    }
+  }
+
+  if (adapt) {
+    near_power += (frame_near_power - near_power) * 0.1f;
+    error_power += (frame_error_power - error_power) * 0.1f;
+    erle_db = 10.0f * log10f((near_power + 1e-9f) / (error_power + 1e-9f));
+    echo_gain += (frame_near_power / frame_far_power - echo_gain) * 0.1f;
+  }
+
+  for (size_t n = 0; n < count; n++) {
+    auto out = error[n] * 32768.0f;
+    out = out > 32767.0f ? 32767.0f : (out < -32768.0f ? -32768.0f : out);
+    samples[n] = (int16_t)out;
+  }
+
+  frame_us = (uint32_t)(esp_timer_get_time() - start_us);
+  if (frame_us > frame_max_us) {
+    frame_max_us = frame_us;
+  }
+}
+
+float reflect_aec_erle_db() { return erle_db; }
+
+void reflect_aec_stats(reflect_aec_stats_t *stats) {
+  stats->delay_ms = delay_samples * 1000 / AEC_SAMPLE_RATE;
+  stats->delay_changes = delay_changes;
+  stats->erle_db = erle_db;
+  stats->frame_us = frame_us;
+  stats->frame_max_us = frame_max_us;
+  stats->double_talk_frames = double_talk_frames;
+}
+
+void reflect_aec() {
+  far_ring = (int16_t *)heap_caps_calloc(FAR_RING_SAMPLES, sizeof(int16_t),
+                                         MALLOC_CAP_INTERNAL);
+  assert(far_ring != nullptr);
+
+  weights = (float *)heap_caps_calloc(AEC_TAPS, sizeof(float),
+                                      MALLOC_CAP_INTERNAL);
+  assert(weights != nullptr);
+
+  reference = (float *)heap_caps_calloc(
+      AEC_MAX_FRAME_SAMPLES + AEC_TAPS, sizeof(float), MALLOC_CAP_INTERNAL);
+  assert(reference != nullptr);
+
+  error = (float *)heap_caps_calloc(AEC_MAX_FRAME_SAMPLES, sizeof(float),
+                                    MALLOC_CAP_INTERNAL);
+  assert(error != nullptr);
+}
+
+#endif
@@ -1,21 +1,50 @@
 #include <atomic>
 #include <bsp/esp-bsp.h>
+#include <cinttypes>
+#include <esp_timer.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+#include <freertos/task.h>
 #include <opus.h>
 
 #include "reflect.hpp"
+#include "ring.hpp"
+
+#define LOG_TAG "audio"
 
 #define GAIN 5.0
+#define GAIN_Q12 ((int16_t)(GAIN * 4096))
 
 #define CHANNELS 1
 #define SAMPLE_RATE (16000)
 #define BITS_PER_SAMPLE 16
 
+// Downlink frames are always 20ms
 #define PCM_BUFFER_SIZE 640
 
+#define CAPTURE_FRAME_MS CONFIG_REFLECT_AUDIO_FRAME_MS
+#define CAPTURE_FRAME_SAMPLES (SAMPLE_RATE * CAPTURE_FRAME_MS / 1000)
+#define CAPTURE_FRAME_SIZE (CAPTURE_FRAME_SAMPLES * sizeof(opus_int16))
+
 #define OPUS_BUFFER_SIZE 1276
 #define OPUS_ENCODER_BITRATE 30000
 #define OPUS_ENCODER_COMPLEXITY 0
 
+// Roughly 160ms of mic audio the network side can fall behind by
+#if CAPTURE_FRAME_MS <= 10
+#define CAPTURE_RING_FRAMES 16
+#elif CAPTURE_FRAME_MS <= 20
+#define CAPTURE_RING_FRAMES 8
+#else
+#define CAPTURE_RING_FRAMES 4
+#endif
+#define CAPTURE_TASK_STACK_SIZE 4096
+#define CAPTURE_TASK_PRIORITY 20
+#define CAPTURE_TASK_CORE 1
+
+// Floor for the loss rate given to the encoder so some FEC is always sent
+#define OPUS_MIN_PACKET_LOSS_PERC 5
+
 esp_codec_dev_sample_info_t fs = {
     .bits_per_sample = BITS_PER_SAMPLE,
     .channel = CHANNELS,
@@ -32,17 +61,67 @@ opus_int16 *decoder_buffer = NULL;
 
 OpusEncoder *opus_encoder = NULL;
 uint8_t *encoder_output_buffer = NULL;
-uint8_t *read_buffer = NULL;
-
-std::atomic<bool> is_playing = false;
-void set_is_playing(int16_t *in_buf) {
-  bool any_set = false;
-  for (size_t i = 0; i < (PCM_BUFFER_SIZE / 2); i++) {
-    if (in_buf[i] != -1 && in_buf[i] != 0 && in_buf[i] != 1) {
-      any_set = true;
+
+SpscRing<CAPTURE_RING_FRAMES> capture_ring;
+uint8_t *capture_overflow_buffer = NULL;
+SemaphoreHandle_t capture_ready = NULL;
+int64_t capture_times_us[CAPTURE_RING_FRAMES];
+uint32_t capture_far_pos[CAPTURE_RING_FRAMES];
+uint32_t encoded_frames = 0;
+
+std::atomic<bool> uplink_started = false;
+std::atomic<uint32_t> captured_frames = 0;
+std::atomic<uint32_t> capture_overruns = 0;
+uint32_t capture_ring_high_water = 0;
+
+uint32_t packets_sent = 0;
+int64_t last_send_us = 0;
+float send_jitter_us = 0;
+uint32_t send_interval_max_us = 0;
+int64_t last_stats_us = 0;
+
+bool vad_active = false;
+uint32_t vad_latency_us = 0;
+uint32_t speech_frames = 0;
+uint32_t speech_bytes = 0;
+uint32_t silence_frames = 0;
+uint32_t silence_bytes = 0;
+
+// Set from the playout task, applied by the encoder on its next frame
+std::atomic<int> packet_loss_perc = -1;
+
+// Time and level of the last downlink frame loud enough to echo into the mic
+std::atomic<int64_t> last_playback_us = 0;
+std::atomic<float> playback_level_db = 0;
+
+// Paced by the I2S RX DMA: every read returns once a full frame has been
+// captured, and each committed frame wakes the sender. When the ring is full
+// the frame is read into a scratch buffer and dropped, so a stalled network
+// costs ring headroom but never blocks capture.
+static void reflect_capture_audio_task(void *) {
+  while (true) {
+    auto frame = capture_ring.acquire();
+    auto buffer = frame != nullptr ? frame : capture_overflow_buffer;
+    ESP_ERROR_CHECK(
+        esp_codec_dev_read(mic_codec_dev, buffer, CAPTURE_FRAME_SIZE));
+
+    if (frame == nullptr) {
+      if (uplink_started) {
+        capture_overruns++;
+      }
+      continue;
     }
+
+    capture_times_us[captured_frames % CAPTURE_RING_FRAMES] =
+        esp_timer_get_time();
+#if CONFIG_REFLECT_AEC
+    capture_far_pos[captured_frames % CAPTURE_RING_FRAMES] =
+        reflect_aec_far_position();
+#endif
+    capture_ring.commit();
+    captured_frames++;
+    xSemaphoreGive(capture_ready);
   }
-  is_playing = any_set;
 }
 
 void reflect_audio() {
@@ -61,7 +140,9 @@ void reflect_audio() {
   int opus_error = 0;
   opus_decoder = opus_decoder_create(SAMPLE_RATE, 1, &opus_error);
   assert(opus_error == OPUS_OK);
-  decoder_buffer = (opus_int16 *)malloc(PCM_BUFFER_SIZE);
+  // 16 byte aligned for the vector gain kernel
+  decoder_buffer = (opus_int16 *)heap_caps_aligned_alloc(16, PCM_BUFFER_SIZE,
+                                                         MALLOC_CAP_DEFAULT);
   assert(decoder_buffer != nullptr);
 
   // Encoder
@@ -74,52 +155,278 @@ void reflect_audio() {
   opus_encoder_ctl(opus_encoder, OPUS_SET_BITRATE(OPUS_ENCODER_BITRATE));
   opus_encoder_ctl(opus_encoder, OPUS_SET_COMPLEXITY(OPUS_ENCODER_COMPLEXITY));
   opus_encoder_ctl(opus_encoder, OPUS_SET_SIGNAL(OPUS_SIGNAL_VOICE));
-
-  read_buffer =
-      (uint8_t *)heap_caps_malloc(PCM_BUFFER_SIZE, MALLOC_CAP_DEFAULT);
-  assert(read_buffer != nullptr);
+  opus_encoder_ctl(opus_encoder, OPUS_SET_INBAND_FEC(1));
+  opus_encoder_ctl(opus_encoder, OPUS_SET_DTX(1));
+  opus_encoder_ctl(opus_encoder,
+                   OPUS_SET_PACKET_LOSS_PERC(OPUS_MIN_PACKET_LOSS_PERC));
 
   encoder_output_buffer = (uint8_t *)malloc(OPUS_BUFFER_SIZE);
   assert(encoder_output_buffer != nullptr);
+
+  // Capture
+  auto capture_storage = (uint8_t *)heap_caps_malloc(
+      CAPTURE_RING_FRAMES * CAPTURE_FRAME_SIZE, MALLOC_CAP_DEFAULT);
+  assert(capture_storage != nullptr);
+  capture_ring.init(capture_storage, CAPTURE_FRAME_SIZE);
+
+  capture_overflow_buffer =
+      (uint8_t *)heap_caps_malloc(CAPTURE_FRAME_SIZE, MALLOC_CAP_DEFAULT);
+  assert(capture_overflow_buffer != nullptr);
+
+  capture_ready = xSemaphoreCreateBinary();
+  assert(capture_ready != nullptr);
+
+#if CONFIG_REFLECT_AEC
+  reflect_aec();
+#endif
+
+  xTaskCreatePinnedToCore(reflect_capture_audio_task, "audio_capture",
+                          CAPTURE_TASK_STACK_SIZE, NULL, CAPTURE_TASK_PRIORITY,
+                          NULL, CAPTURE_TASK_CORE);
+
+#if CONFIG_REFLECT_AUDIO_BENCHMARK
+  reflect_dsp_benchmark(GAIN_Q12);
+#endif
 }
 
-void apply_gain(int16_t *samples) {
-  for (size_t i = 0; i < (PCM_BUFFER_SIZE / 2); i++) {
-    float scaled = (float)samples[i] * GAIN;
+static void play_decoded(int decoded_size) {
+  if (decoded_size > 0) {
+    reflect_level_t level;
+    reflect_gain_and_measure(decoder_buffer, PCM_BUFFER_SIZE / sizeof(int16_t),
+                             GAIN_Q12, &level);
 
-    // Clamp to 16-bit range
-    if (scaled > 32767.0f)
-      scaled = 32767.0f;
-    if (scaled < -32768.0f)
-      scaled = -32768.0f;
+    auto level_db = reflect_level_db(&level, PCM_BUFFER_SIZE / sizeof(int16_t));
+    if (level_db > CONFIG_REFLECT_PLAYBACK_THRESHOLD_DB) {
+      playback_level_db = level_db;
+      last_playback_us = esp_timer_get_time();
+    }
 
-    samples[i] = (int16_t)scaled;
+#if CONFIG_REFLECT_AEC
+    reflect_aec_far(decoder_buffer, PCM_BUFFER_SIZE / sizeof(int16_t));
+#endif
+    esp_codec_dev_write(spk_codec_dev, decoder_buffer, PCM_BUFFER_SIZE);
+#if CONFIG_REFLECT_REACTIVE
+    reflect_reactive_level(level_db);
+#endif
   }
 }
 
 void reflect_play_audio(uint8_t *data, size_t size) {
-  auto decoded_size = opus_decode(opus_decoder, data, size, decoder_buffer,
-                                  PCM_BUFFER_SIZE / sizeof(uint16_t), 0);
+  static bool first = true;
+  if (first) {
+    reflect_boot_mark(REFLECT_BOOT_FIRST_DOWNLINK);
+    first = false;
+  }
+  play_decoded(opus_decode(opus_decoder, data, size, decoder_buffer,
+                           PCM_BUFFER_SIZE / sizeof(uint16_t), 0));
+}
 
-  if (decoded_size > 0) {
-    set_is_playing(decoder_buffer);
-    apply_gain((int16_t *)decoder_buffer);
-    esp_codec_dev_write(spk_codec_dev, decoder_buffer, PCM_BUFFER_SIZE);
+// Rebuild a missing frame from the in-band FEC data of the packet that
+// follows it, or through Opus PLC when that packet hasn't arrived either
+void reflect_conceal_audio(uint8_t *next, size_t size) {
+  play_decoded(opus_decode(opus_decoder, next, size, decoder_buffer,
+                           PCM_BUFFER_SIZE / sizeof(uint16_t), 1));
+}
+
+void reflect_play_silence() {
+  memset(decoder_buffer, 0, PCM_BUFFER_SIZE);
+#if CONFIG_REFLECT_AEC
+  reflect_aec_far(decoder_buffer, PCM_BUFFER_SIZE / sizeof(int16_t));
+#endif
+  esp_codec_dev_write(spk_codec_dev, decoder_buffer, PCM_BUFFER_SIZE);
+}
+
+void reflect_set_packet_loss(int perc) {
+  packet_loss_perc =
+      perc < OPUS_MIN_PACKET_LOSS_PERC ? OPUS_MIN_PACKET_LOSS_PERC : perc;
+}
+
+void reflect_audio_stats(reflect_audio_stats_t *stats) {
+  stats->captured = captured_frames;
+  stats->overruns = capture_overruns;
+  stats->ring_depth = capture_ring.depth();
+  stats->ring_high_water = capture_ring_high_water;
+  stats->packets_sent = packets_sent;
+  stats->send_jitter_us = (uint32_t)send_jitter_us;
+  stats->send_interval_max_us = send_interval_max_us;
+  stats->vad_active = vad_active;
+  stats->vad_latency_us = vad_latency_us;
+  stats->speech_frames = speech_frames;
+  stats->speech_bytes = speech_bytes;
+  stats->silence_frames = silence_frames;
+  stats->silence_bytes = silence_bytes;
+}
+
+// Average bitrate of uplink frames that took a number of bytes to send
+static float bitrate_kbps(uint32_t bytes, uint32_t frames) {
+  if (frames == 0) {
+    return 0;
   }
+  return (bytes * 8.0f) / (frames * CAPTURE_FRAME_MS);
 }
 
+static void log_audio_stats(int64_t elapsed_us) {
+  static uint32_t last_packets_sent = 0;
+
+  reflect_audio_stats_t stats;
+  reflect_audio_stats(&stats);
+
+  auto packet_rate = (stats.packets_sent - last_packets_sent) * 1000000.0f /
+                     (float)elapsed_us;
+  last_packets_sent = stats.packets_sent;
+
+  ESP_LOGI(LOG_TAG,
+           "frame_ms(%d) captured(%" PRIu32 ") overruns(%" PRIu32
+           ") ring_depth(%" PRIu32 ") ring_high_water(%" PRIu32
+           ") packets_per_s(%.1f) send_jitter_us(%" PRIu32
+           ") send_interval_max_us(%" PRIu32 ")",
+           CAPTURE_FRAME_MS, stats.captured, stats.overruns, stats.ring_depth,
+           stats.ring_high_water, packet_rate, stats.send_jitter_us,
+           stats.send_interval_max_us);
+  ESP_LOGI(LOG_TAG,
+           "vad_active(%d) vad_latency_us(%" PRIu32
+           ") speech_kbps(%.1f) silence_kbps(%.2f)",
+           stats.vad_active, stats.vad_latency_us,
+           bitrate_kbps(stats.speech_bytes, stats.speech_frames),
+           bitrate_kbps(stats.silence_bytes, stats.silence_frames));
+
+#if CONFIG_REFLECT_AEC
+  reflect_aec_stats_t aec;
+  reflect_aec_stats(&aec);
+  ESP_LOGI(LOG_TAG,
+           "aec delay_ms(%" PRIu32 ") delay_changes(%" PRIu32
+           ") erle_db(%.1f) frame_us(%" PRIu32 ") frame_max_us(%" PRIu32
+           ") double_talk_frames(%" PRIu32 ")",
+           aec.delay_ms, aec.delay_changes, aec.erle_db, aec.frame_us,
+           aec.frame_max_us, aec.double_talk_frames);
+#endif
+  send_interval_max_us = 0;
+}
+
+// Blocks until the capture task has committed at least one frame
+bool reflect_wait_audio(uint32_t timeout_ms) {
+  return xSemaphoreTake(capture_ready, pdMS_TO_TICKS(timeout_ms)) == pdTRUE;
+}
+
+// Deviation of the send timestamps from the frame clock, smoothed the same
+// way as RTP interarrival jitter
+static void record_send_time(bool sent) {
+  auto now_us = esp_timer_get_time();
+  if (!sent) {
+    last_send_us = 0;
+    return;
+  }
+
+  if (last_send_us != 0) {
+    auto interval_us = (uint32_t)(now_us - last_send_us);
+    auto deviation_us = (int32_t)interval_us - CAPTURE_FRAME_MS * 1000;
+    if (deviation_us < 0) {
+      deviation_us = -deviation_us;
+    }
+    send_jitter_us += ((float)deviation_us - send_jitter_us) / 16.0f;
+
+    if (interval_us > send_interval_max_us) {
+      send_interval_max_us = interval_us;
+    }
+  }
+  last_send_us = now_us;
+  if (packets_sent++ == 0) {
+    reflect_boot_mark(REFLECT_BOOT_FIRST_UPLINK);
+  }
+}
+
+// The mic goes out while someone is talking, unless it would only be sending
+// back our own playback. Talking over playback has to clearly beat its level,
+// less whatever the echo canceller has already removed.
+static bool uplink_open(const reflect_vad_t *vad, bool is_muted) {
+  if (is_muted || !vad->active) {
+    return false;
+  }
+
+  auto since_playback_us = esp_timer_get_time() - last_playback_us;
+  if (since_playback_us > CONFIG_REFLECT_PLAYBACK_TAIL_MS * 1000LL) {
+    return true;
+  }
+
+  float echo_db = playback_level_db;
+#if CONFIG_REFLECT_AEC
+  echo_db -= reflect_aec_erle_db();
+#endif
+  return vad->level_db > echo_db + CONFIG_REFLECT_BARGE_IN_MARGIN_DB;
+}
+
+// Encodes and sends every frame the capture task has queued up. Without a
+// peer_connection (while reconnecting) frames are still drained and encoded,
+// just not sent.
 void reflect_send_audio(PeerConnection *peer_connection, bool is_muted) {
-  if (is_playing || is_muted) {
-    memset(read_buffer, 0, PCM_BUFFER_SIZE);
-  } else {
-    ESP_ERROR_CHECK(
-        esp_codec_dev_read(mic_codec_dev, read_buffer, PCM_BUFFER_SIZE));
+  uplink_started = true;
+
+  uint32_t depth = capture_ring.depth();
+  if (depth > capture_ring_high_water) {
+    capture_ring_high_water = depth;
+  }
+
+  uint8_t *frame = NULL;
+  while ((frame = capture_ring.peek()) != nullptr) {
+    auto capture_us = capture_times_us[encoded_frames % CAPTURE_RING_FRAMES];
+#if CONFIG_REFLECT_AEC
+    reflect_aec_process((int16_t *)frame, CAPTURE_FRAME_SAMPLES,
+                        capture_far_pos[encoded_frames % CAPTURE_RING_FRAMES]);
+#endif
+    encoded_frames++;
+
+    reflect_vad_t vad;
+    reflect_vad_process((int16_t *)frame, CAPTURE_FRAME_SAMPLES,
+                        CAPTURE_FRAME_MS, &vad);
+    if (vad.onset) {
+      vad_latency_us = (uint32_t)(esp_timer_get_time() - capture_us);
+    }
+    vad_active = vad.active;
+
+    // Silence goes to the encoder as digital zero, which DTX turns into
+    // packets of a byte or two. Those are still sent: libpeer steps the RTP
+    // timestamp once per packet, so skipping them would leave the first
+    // packet after every pause stamped a whole silence late, and they are
+    // what the receiver's DTX handling expects.
+    if (!uplink_open(&vad, is_muted)) {
+      memset(frame, 0, CAPTURE_FRAME_SIZE);
+    }
+
+    auto loss = packet_loss_perc.exchange(-1);
+    if (loss >= 0) {
+      opus_encoder_ctl(opus_encoder, OPUS_SET_PACKET_LOSS_PERC(loss));
+    }
+
+    auto encoded_size = opus_encode(opus_encoder, (const opus_int16 *)frame,
+                                    CAPTURE_FRAME_SAMPLES,
+                                    encoder_output_buffer, OPUS_BUFFER_SIZE);
+    capture_ring.release();
+
+    assert(encoded_size > 0);
+    bool sent = peer_connection != nullptr;
+    if (sent) {
+      peer_connection_send_audio(peer_connection, encoder_output_buffer,
+                                 encoded_size);
+      reflect_peer_loop_wake();
+    }
+    record_send_time(sent);
+
+    if (vad.active) {
+      speech_frames++;
+      speech_bytes += sent ? encoded_size : 0;
+    } else {
+      silence_frames++;
+      silence_bytes += sent ? encoded_size : 0;
+    }
   }
 
-  auto encoded_size = opus_encode(opus_encoder, (const opus_int16 *)read_buffer,
-                                  PCM_BUFFER_SIZE / sizeof(uint16_t),
-                                  encoder_output_buffer, OPUS_BUFFER_SIZE);
-  assert(encoded_size > 0);
-  peer_connection_send_audio(peer_connection, encoder_output_buffer,
-                             encoded_size);
+  auto now_us = esp_timer_get_time();
+  if (last_stats_us == 0) {
+    last_stats_us = now_us;
+  } else if (CONFIG_REFLECT_STATS_INTERVAL > 0 &&
+             now_us - last_stats_us >=
+                 CONFIG_REFLECT_STATS_INTERVAL * 1000000LL) {
+    log_audio_stats(now_us - last_stats_us);
+    last_stats_us = now_us;
+  }
 }
@@ -0,0 +1,51 @@
+#include <atomic>
+#include <cinttypes>
+#include <esp_timer.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/event_groups.h>
+
+#include "reflect.hpp"
+
+#define LOG_TAG "boot"
+
+static EventGroupHandle_t reflect_events = NULL;
+
+static const char *phase_names[REFLECT_BOOT_PHASES] = {
+    "display",   "audio",     "ip",          "offer",         "answer",
+    "connected", "completed", "first_uplink", "first_downlink",
+};
+static std::atomic<int64_t> phase_us[REFLECT_BOOT_PHASES];
+static std::atomic<int64_t> last_phase_us{0};
+
+void reflect_boot() {
+  reflect_events = xEventGroupCreate();
+  assert(reflect_events != nullptr);
+}
+
+void reflect_boot_set(uint32_t bits) {
+  xEventGroupSetBits(reflect_events, bits);
+}
+
+void reflect_boot_clear(uint32_t bits) {
+  xEventGroupClearBits(reflect_events, bits);
+}
+
+// Blocks until all of bits are set
+void reflect_boot_wait(uint32_t bits) {
+  xEventGroupWaitBits(reflect_events, bits, pdFALSE, pdTRUE, portMAX_DELAY);
+}
+
+// Records when a phase is first reached. Later sessions reach the same
+// phases again, but only the cold start is logged.
+void reflect_boot_mark(reflect_boot_phase_t phase) {
+  auto now_us = esp_timer_get_time();
+  int64_t unset = 0;
+  if (!phase_us[phase].compare_exchange_strong(unset, now_us)) {
+    return;
+  }
+
+  auto previous_us = last_phase_us.exchange(now_us);
+  ESP_LOGI(LOG_TAG, "%s at %" PRIu32 "ms (+%" PRIu32 "ms)", phase_names[phase],
+           (uint32_t)(now_us / 1000),
+           (uint32_t)((now_us - previous_us) / 1000));
+}
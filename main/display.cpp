@@ -1,9 +1,18 @@
+#include <atomic>
+#include <cinttypes>
+#include <cmath>
+
 #include "bsp/esp-bsp.h"
-#include "bsp/touch.h"
-#include "esp_lcd_touch.h"
+#include "esp_heap_caps.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
 
 #include "reflect.hpp"
 
+#define LOG_TAG "display"
+
 #define LV_ATTRIBUTE_MEM_ALIGN
 #define LV_ATTRIBUTE_OAI
 #define LV_ATTRIBUTE_MIC
@@ -212,21 +221,214 @@ const lv_image_dsc_t mic = {
     .reserved_2 = NULL,
 };
 
+// The LVGL task runs at the bottom of the priority range on core 0, with
+// WiFi and the publisher, which preempt it. Core 1 is left to capture and
+// playout, so rendering and the first turn's frame rotation never sit in
+// front of audio there.
+#define DISPLAY_TASK_PRIORITY 1
+#define DISPLAY_TASK_CORE 0
+
+// The logo spins through frames rotated once and kept in PSRAM, so LVGL
+// only copies pixels. Its content fits a circle of this diameter, which
+// every frame is cropped to.
+#define SPIN_FRAMES 90
+#define SPIN_SIZE 116
+#define SPIN_PERIOD_MS 5000
+
 static lv_obj_t *spinning_img;
 static lv_obj_t *mic_img;
 
-static bool should_spin = false;
+static uint16_t *spin_pixels = NULL;
+static lv_image_dsc_t spin_frames[SPIN_FRAMES];
+static bool spin_rendered[SPIN_FRAMES];
+static int32_t spin_frame = -1;
+
+// Spinning can be asked for before the display is up, and is applied once
+// it is
+static std::atomic<bool> should_spin{false};
+static std::atomic<bool> display_ready{false};
+
+static uint32_t rendered_frames = 0;
+static int64_t render_start_us = 0;
+static int64_t render_total_us = 0;
+static uint32_t invalidated_pixels = 0;
+// Whose CPU time the stats report, taken on the first render
+static std::atomic<TaskHandle_t> lvgl_task{NULL};
+
+// Rotates the logo clockwise by frame / SPIN_FRAMES of a turn, with
+// bilinear filtering
+static void spin_render(int32_t frame) {
+  auto pixels = spin_pixels + frame * SPIN_SIZE * SPIN_SIZE;
+  auto source = (const uint16_t *)oai_map;
+  auto angle = 2 * M_PI * frame / SPIN_FRAMES;
+  auto c = (float)cos(angle);
+  auto s = (float)sin(angle);
+
+  for (int y = 0; y < SPIN_SIZE; y++) {
+    for (int x = 0; x < SPIN_SIZE; x++) {
+      auto dx = x + 0.5f - SPIN_SIZE / 2.0f;
+      auto dy = y + 0.5f - SPIN_SIZE / 2.0f;
+      auto sx = c * dx + s * dy + oai.header.w / 2.0f - 0.5f;
+      auto sy = -s * dx + c * dy + oai.header.h / 2.0f - 0.5f;
+
+      auto x0 = (int)floorf(sx);
+      auto y0 = (int)floorf(sy);
+      auto fx = sx - x0;
+      auto fy = sy - y0;
+      float r = 0, g = 0, b = 0;
+      for (int i = 0; i < 4; i++) {
+        auto px = x0 + (i & 1);
+        auto py = y0 + (i >> 1);
+        if (px < 0 || py < 0 || px >= (int)oai.header.w ||
+            py >= (int)oai.header.h) {
+          continue;
+        }
+        auto weight = ((i & 1) ? fx : 1 - fx) * ((i >> 1) ? fy : 1 - fy);
+        auto pixel = source[py * oai.header.w + px];
+        r += weight * (pixel >> 11);
+        g += weight * ((pixel >> 5) & 0x3f);
+        b += weight * (pixel & 0x1f);
+      }
+      pixels[y * SPIN_SIZE + x] =
+          (uint16_t)(((int)(r + 0.5f) << 11) | ((int)(g + 0.5f) << 5) |
+                     (int)(b + 0.5f));
+    }
+  }
+  spin_rendered[frame] = true;
+}
+
+// Frames are rotated the first time they are shown, so the first turn costs
+// what every turn used to and boot costs nothing
+static void spin_show(void *, int32_t v) {
+  auto frame = v % SPIN_FRAMES;
+  if (frame == spin_frame) {
+    return;
+  }
+  if (!spin_rendered[frame]) {
+    spin_render(frame);
+  }
+  spin_frame = frame;
+  lv_image_set_src(spinning_img, &spin_frames[frame]);
+}
 
-static void spinner_set_angle(void *obj, int32_t v) {
-  if (should_spin) {
-    lv_image_set_rotation((lv_obj_t *)obj, v);
+// With the animation deleted rather than muted, LVGL has nothing to redraw
+// while the logo stands still. Called with the display lock held.
+static void spin_apply(bool spin) {
+  lv_anim_delete(NULL, spin_show);
+  if (!spin) {
+    return;
   }
+
+  lv_anim_t a;
+  lv_anim_init(&a);
+  lv_anim_set_exec_cb(&a, spin_show);
+  lv_anim_set_duration(&a, SPIN_PERIOD_MS);
+  lv_anim_set_values(&a, spin_frame, spin_frame + SPIN_FRAMES);
+  lv_anim_set_repeat_count(&a, LV_ANIM_REPEAT_INFINITE);
+  lv_anim_start(&a);
 }
 
-esp_lcd_touch_handle_t tp = NULL;
+static void spin_init(lv_obj_t *scr) {
+  spin_pixels = (uint16_t *)heap_caps_malloc(
+      SPIN_FRAMES * SPIN_SIZE * SPIN_SIZE * sizeof(uint16_t),
+      MALLOC_CAP_SPIRAM);
+  assert(spin_pixels != nullptr);
+  for (int i = 0; i < SPIN_FRAMES; i++) {
+    spin_frames[i] = oai;
+    spin_frames[i].header.w = SPIN_SIZE;
+    spin_frames[i].header.h = SPIN_SIZE;
+    spin_frames[i].header.stride = SPIN_SIZE * sizeof(uint16_t);
+    spin_frames[i].data_size = SPIN_SIZE * SPIN_SIZE * sizeof(uint16_t);
+    spin_frames[i].data =
+        (const uint8_t *)(spin_pixels + i * SPIN_SIZE * SPIN_SIZE);
+  }
+
+  spinning_img = lv_image_create(scr);
+  spin_show(NULL, 0);
+  lv_obj_center(spinning_img);
+}
+
+static void on_render(lv_event_t *e) {
+  if (lv_event_get_code(e) == LV_EVENT_RENDER_START) {
+    if (lvgl_task.load() == NULL) {
+      lvgl_task = xTaskGetCurrentTaskHandle();
+    }
+    render_start_us = esp_timer_get_time();
+  } else {
+    render_total_us += esp_timer_get_time() - render_start_us;
+    rendered_frames++;
+  }
+}
+
+// LVGL redraws and flushes only the areas marked invalid, so their sum is
+// what each frame sends to the panel (overlaps counted twice)
+static void on_invalidate(lv_event_t *e) {
+  auto area = (const lv_area_t *)lv_event_get_param(e);
+  invalidated_pixels += lv_area_get_size(area);
+}
+
+// task_us is the LVGL task's whichever task asks, and 0 until it has
+// rendered once
+void reflect_display_stats(reflect_display_stats_t *stats) {
+  stats->frames = rendered_frames;
+  stats->render_us = (uint32_t)render_total_us;
+  stats->redrawn_pixels = invalidated_pixels;
+  stats->task_us = 0;
+#if CONFIG_FREERTOS_GENERATE_RUN_TIME_STATS
+  // The run time counter ticks in esp_timer microseconds
+  auto task = lvgl_task.load();
+  if (task != NULL) {
+    stats->task_us = ulTaskGetRunTimeCounter(task);
+  }
+#endif
+}
+
+// Runs as an LVGL timer, so on the LVGL task
+static void log_display_stats(lv_timer_t *) {
+  static reflect_display_stats_t last = {};
+  static int64_t last_us = 0;
+  reflect_display_stats_t stats;
+  reflect_display_stats(&stats);
+  auto now_us = esp_timer_get_time();
+  if (last_us == 0) {
+    last = stats;
+    last_us = now_us;
+    return;
+  }
+
+  auto elapsed_us = now_us - last_us;
+  auto frames = stats.frames - last.frames;
+  auto redrawn = frames == 0
+                     ? 0
+                     : (stats.redrawn_pixels - last.redrawn_pixels) / frames;
+  auto screen = lv_display_get_horizontal_resolution(NULL) *
+                lv_display_get_vertical_resolution(NULL);
+  ESP_LOGI(LOG_TAG,
+           "fps(%.1f) render_avg_us(%" PRIu32 ") cpu_percent(%.1f) "
+           "redrawn_avg_px(%" PRIu32 ") redrawn_percent(%.1f) spinning(%d)",
+           frames * 1000000.0f / elapsed_us,
+           frames == 0 ? 0 : (stats.render_us - last.render_us) / frames,
+           (stats.task_us - last.task_us) * 100.0f / elapsed_us, redrawn,
+           redrawn * 100.0f / screen, should_spin.load());
+  last = stats;
+  last_us = now_us;
+}
 
 void reflect_display(void) {
-  bsp_display_start();
+  bsp_display_cfg_t cfg = {
+      .lvgl_port_cfg = ESP_LVGL_PORT_INIT_CONFIG(),
+      .buffer_size = BSP_LCD_DRAW_BUFF_SIZE,
+      .double_buffer = BSP_LCD_DRAW_BUFF_DOUBLE,
+      .flags =
+          {
+              .buff_dma = true,
+              .buff_spiram = false,
+          },
+  };
+  cfg.lvgl_port_cfg.task_priority = DISPLAY_TASK_PRIORITY;
+  cfg.lvgl_port_cfg.task_affinity = DISPLAY_TASK_CORE;
+  auto display = bsp_display_start_with_config(&cfg);
+  assert(display != nullptr);
   bsp_display_backlight_on();
 
   bsp_display_lock(0);
@@ -235,22 +437,7 @@ void reflect_display(void) {
   lv_obj_set_style_bg_color(scr, lv_color_black(), LV_PART_MAIN);
   lv_obj_set_style_bg_opa(scr, LV_OPA_COVER, LV_PART_MAIN);
 
-  spinning_img = lv_image_create(scr);
-  lv_image_set_src(spinning_img, &oai);
-  lv_obj_center(spinning_img);
-
-  lv_image_set_pivot(spinning_img, oai.header.w / 2, oai.header.h / 2);
-
-  lv_image_set_antialias(spinning_img, true);
-
-  lv_anim_t a;
-  lv_anim_init(&a);
-  lv_anim_set_var(&a, spinning_img);
-  lv_anim_set_exec_cb(&a, spinner_set_angle);
-  lv_anim_set_duration(&a, 5000);
-  lv_anim_set_values(&a, 0, 3600);
-  lv_anim_set_repeat_count(&a, LV_ANIM_REPEAT_INFINITE);
-  lv_anim_start(&a);
+  spin_init(scr);
 
   mic_img = lv_img_create(scr);
   lv_img_set_src(mic_img, &mic);
@@ -262,24 +449,29 @@ void reflect_display(void) {
   lv_obj_set_style_img_recolor_opa(mic_img, LV_OPA_COVER, LV_PART_MAIN);
   reflect_set_mic_color(false);
 
-  ESP_ERROR_CHECK(bsp_touch_new(NULL, &tp));
+  lv_display_add_event_cb(display, on_render, LV_EVENT_RENDER_START, NULL);
+  lv_display_add_event_cb(display, on_render, LV_EVENT_RENDER_READY, NULL);
+  lv_display_add_event_cb(display, on_invalidate, LV_EVENT_INVALIDATE_AREA,
+                          NULL);
+  if (CONFIG_REFLECT_STATS_INTERVAL > 0) {
+    lv_timer_create(log_display_stats, CONFIG_REFLECT_STATS_INTERVAL * 1000,
+                    NULL);
+  }
 
+  display_ready = true;
+  spin_apply(should_spin);
   bsp_display_unlock();
 }
 
-bool reflect_display_pressed(void) {
-  uint16_t touch_x[1];
-  uint16_t touch_y[1];
-  uint16_t touch_strength[1];
-  uint8_t touch_cnt = 0;
-
-  esp_lcd_touch_read_data(tp);
-  return esp_lcd_touch_get_coordinates(tp, touch_x, touch_y, touch_strength,
-                                       &touch_cnt, 1);
+void reflect_set_spin(bool s) {
+  should_spin = s;
+  if (display_ready) {
+    bsp_display_lock(0);
+    spin_apply(should_spin);
+    bsp_display_unlock();
+  }
 }
 
-void reflect_set_spin(bool s) { should_spin = s; }
-
 void reflect_set_mic_color(bool muted) {
   bsp_display_lock(0);
 
@@ -0,0 +1,284 @@
+#include <cinttypes>
+#include <cstring>
+#include <esp_cpu.h>
+#include <esp_heap_caps.h>
+
+#include "reflect.hpp"
+
+#define LOG_TAG "dsp"
+
+// Gains are Q3.12 so values up to ~8x fit in an int16
+#define GAIN_SHIFT 12
+
+#define BENCHMARK_SAMPLES 320
+#define BENCHMARK_ITERATIONS 1000
+
+// Largest input that doesn't overflow once the gain is applied. Clamping the
+// input instead of the product keeps both paths free of 32-bit intermediates.
+static int16_t gain_limit(int16_t gain_q12) {
+  auto limit = ((int32_t)INT16_MAX << GAIN_SHIFT) / gain_q12;
+  return limit > INT16_MAX ? INT16_MAX : (int16_t)limit;
+}
+
+static int16_t peak_of(int16_t max, int16_t min) {
+  int32_t peak = max > -(int32_t)min ? max : -(int32_t)min;
+  return peak > INT16_MAX ? INT16_MAX : (int16_t)peak;
+}
+
+static void gain_and_measure_scalar(int16_t *samples, size_t count,
+                                    int16_t gain_q12, reflect_level_t *level) {
+  auto limit = gain_limit(gain_q12);
+  uint64_t energy = 0;
+  int16_t max = INT16_MIN;
+  int16_t min = INT16_MAX;
+
+  for (size_t i = 0; i < count; i++) {
+    int32_t x = samples[i];
+    energy += x * x;
+    max = x > max ? x : max;
+    min = x < min ? x : min;
+
+    x = x > limit ? limit : (x < -limit ? -limit : x);
+    samples[i] = (int16_t)((x * gain_q12) >> GAIN_SHIFT);
+  }
+
+  level->energy = (uint32_t)(energy >> REFLECT_LEVEL_ENERGY_SHIFT);
+  level->peak = peak_of(max, min);
+}
+
+static void measure_scalar(const int16_t *samples, size_t count,
+                           reflect_level_t *level) {
+  uint64_t energy = 0;
+  int16_t max = INT16_MIN;
+  int16_t min = INT16_MAX;
+
+  for (size_t i = 0; i < count; i++) {
+    int32_t x = samples[i];
+    energy += x * x;
+    max = x > max ? x : max;
+    min = x < min ? x : min;
+  }
+
+  level->energy = (uint32_t)(energy >> REFLECT_LEVEL_ENERGY_SHIFT);
+  level->peak = peak_of(max, min);
+}
+
+#if CONFIG_IDF_TARGET_ESP32S3
+// SAR and the zero-overhead loop registers belong to the surrounding code,
+// which may itself be running a loop, so PIE kernels keep them in
+// saved[0..3] while they run. The Q registers and ACCX are never allocated
+// by the compiler and are switched with the task's coprocessor context.
+#define PIE_SAVE_STATE                                                         \
+  "rsr.sar %[scratch]\n"                                                       \
+  "s32i %[scratch], %[saved], 0\n"                                             \
+  "rsr.lbeg %[scratch]\n"                                                      \
+  "s32i %[scratch], %[saved], 4\n"                                             \
+  "rsr.lend %[scratch]\n"                                                      \
+  "s32i %[scratch], %[saved], 8\n"                                             \
+  "rsr.lcount %[scratch]\n"                                                    \
+  "s32i %[scratch], %[saved], 12\n"
+
+#define PIE_RESTORE_STATE                                                      \
+  "l32i %[scratch], %[saved], 0\n"                                             \
+  "wsr.sar %[scratch]\n"                                                       \
+  "l32i %[scratch], %[saved], 4\n"                                             \
+  "wsr.lbeg %[scratch]\n"                                                      \
+  "l32i %[scratch], %[saved], 8\n"                                             \
+  "wsr.lend %[scratch]\n"                                                      \
+  "l32i %[scratch], %[saved], 12\n"                                            \
+  "wsr.lcount %[scratch]\n"                                                    \
+  "isync\n"
+
+// PIE version of the above, 8 samples per 128-bit Q register. ACCX is 40 bits
+// wide, which covers the sum of squares of up to 512 full-scale samples.
+static void gain_and_measure_pie(int16_t *samples, size_t count,
+                                 int16_t gain_q12, reflect_level_t *level) {
+  alignas(16) int16_t lanes[16];
+  auto high = gain_limit(gain_q12);
+  // Broadcast one after another into q2, q5, q6, q3 and q4
+  const int16_t constants[5] = {gain_q12, high, (int16_t)-high, INT16_MIN,
+                                INT16_MAX};
+  uint32_t saved[4];
+  uint32_t scratch;
+  int32_t energy;
+  auto ptr = samples;
+  auto constants_ptr = constants;
+  auto lanes_ptr = lanes;
+
+  asm volatile(PIE_SAVE_STATE
+               "wsr.sar %[shift]\n"
+               "ee.zero.accx\n"
+               "ee.vldbc.16.ip q2, %[constants], 2\n"
+               "ee.vldbc.16.ip q5, %[constants], 2\n"
+               "ee.vldbc.16.ip q6, %[constants], 2\n"
+               "ee.vldbc.16.ip q3, %[constants], 2\n"
+               "ee.vldbc.16.ip q4, %[constants], 2\n"
+               "loopgtz %[blocks], 1f\n"
+               "ee.vld.128.ip q0, %[ptr], 0\n"
+               "ee.vmulas.s16.accx q0, q0\n"
+               "ee.vmax.s16 q3, q3, q0\n"
+               "ee.vmin.s16 q4, q4, q0\n"
+               "ee.vmin.s16 q0, q0, q5\n"
+               "ee.vmax.s16 q0, q0, q6\n"
+               "ee.vmul.s16 q1, q0, q2\n"
+               "ee.vst.128.ip q1, %[ptr], 16\n"
+               "1:\n"
+               "ee.srs.accx %[energy], %[energy_shift], 0\n"
+               "ee.vst.128.ip q3, %[lanes], 16\n"
+               "ee.vst.128.ip q4, %[lanes], 0\n" PIE_RESTORE_STATE
+               : [ptr] "+r"(ptr), [constants] "+r"(constants_ptr),
+                 [lanes] "+r"(lanes_ptr), [energy] "=&r"(energy),
+                 [scratch] "=&r"(scratch)
+               : [saved] "r"(saved), [shift] "r"(GAIN_SHIFT),
+                 [blocks] "r"(count / 8),
+                 [energy_shift] "r"(REFLECT_LEVEL_ENERGY_SHIFT)
+               : "memory");
+
+  int16_t max = INT16_MIN;
+  int16_t min = INT16_MAX;
+  for (size_t i = 0; i < 8; i++) {
+    max = lanes[i] > max ? lanes[i] : max;
+    min = lanes[8 + i] < min ? lanes[8 + i] : min;
+  }
+
+  level->energy = (uint32_t)energy;
+  level->peak = peak_of(max, min);
+}
+
+// Only the level half of the kernel above, for frames that are read but
+// not changed
+static void measure_pie(const int16_t *samples, size_t count,
+                        reflect_level_t *level) {
+  alignas(16) int16_t lanes[16];
+  const int16_t constants[2] = {INT16_MIN, INT16_MAX};
+  uint32_t saved[4];
+  uint32_t scratch;
+  int32_t energy;
+  auto ptr = samples;
+  auto constants_ptr = constants;
+  auto lanes_ptr = lanes;
+
+  asm volatile(PIE_SAVE_STATE
+               "ee.zero.accx\n"
+               "ee.vldbc.16.ip q3, %[constants], 2\n"
+               "ee.vldbc.16.ip q4, %[constants], 2\n"
+               "loopgtz %[blocks], 1f\n"
+               "ee.vld.128.ip q0, %[ptr], 16\n"
+               "ee.vmulas.s16.accx q0, q0\n"
+               "ee.vmax.s16 q3, q3, q0\n"
+               "ee.vmin.s16 q4, q4, q0\n"
+               "1:\n"
+               "ee.srs.accx %[energy], %[energy_shift], 0\n"
+               "ee.vst.128.ip q3, %[lanes], 16\n"
+               "ee.vst.128.ip q4, %[lanes], 0\n" PIE_RESTORE_STATE
+               : [ptr] "+r"(ptr), [constants] "+r"(constants_ptr),
+                 [lanes] "+r"(lanes_ptr), [energy] "=&r"(energy),
+                 [scratch] "=&r"(scratch)
+               : [saved] "r"(saved), [blocks] "r"(count / 8),
+                 [energy_shift] "r"(REFLECT_LEVEL_ENERGY_SHIFT)
+               : "memory");
+
+  int16_t max = INT16_MIN;
+  int16_t min = INT16_MAX;
+  for (size_t i = 0; i < 8; i++) {
+    max = lanes[i] > max ? lanes[i] : max;
+    min = lanes[8 + i] < min ? lanes[8 + i] : min;
+  }
+
+  level->energy = (uint32_t)energy;
+  level->peak = peak_of(max, min);
+}
+#endif
+
+void reflect_gain_and_measure(int16_t *samples, size_t count, int16_t gain_q12,
+                              reflect_level_t *level) {
+#if CONFIG_IDF_TARGET_ESP32S3
+  if (((uintptr_t)samples & 15) == 0 && (count & 7) == 0 && count <= 512) {
+    gain_and_measure_pie(samples, count, gain_q12, level);
+    return;
+  }
+#endif
+  gain_and_measure_scalar(samples, count, gain_q12, level);
+}
+
+// Level of a frame without touching it
+void reflect_measure(const int16_t *samples, size_t count,
+                     reflect_level_t *level) {
+#if CONFIG_IDF_TARGET_ESP32S3
+  if (((uintptr_t)samples & 15) == 0 && (count & 7) == 0 && count <= 512) {
+    measure_pie(samples, count, level);
+    return;
+  }
+#endif
+  measure_scalar(samples, count, level);
+}
+
+#if CONFIG_REFLECT_AUDIO_BENCHMARK
+// The float gain/clamp and playback detection passes this kernel replaced,
+// kept to benchmark against
+static void legacy_apply_gain(int16_t *samples, size_t count, float gain) {
+  for (size_t i = 0; i < count; i++) {
+    float scaled = (float)samples[i] * gain;
+
+    // Clamp to 16-bit range
+    if (scaled > 32767.0f)
+      scaled = 32767.0f;
+    if (scaled < -32768.0f)
+      scaled = -32768.0f;
+
+    samples[i] = (int16_t)scaled;
+  }
+}
+
+static bool legacy_is_playing(int16_t *samples, size_t count) {
+  bool any_set = false;
+  for (size_t i = 0; i < count; i++) {
+    if (samples[i] != -1 && samples[i] != 0 && samples[i] != 1) {
+      any_set = true;
+    }
+  }
+  return any_set;
+}
+
+static void fill_benchmark_frame(int16_t *samples) {
+  uint32_t state = 1;
+  for (size_t i = 0; i < BENCHMARK_SAMPLES; i++) {
+    state = state * 1664525 + 1013904223;
+    samples[i] = (int16_t)(state >> 16) / 4;
+  }
+}
+
+void reflect_dsp_benchmark(int16_t gain_q12) {
+  auto samples = (int16_t *)heap_caps_aligned_alloc(
+      16, BENCHMARK_SAMPLES * sizeof(int16_t), MALLOC_CAP_INTERNAL);
+  assert(samples != nullptr);
+
+  uint32_t legacy_cycles = 0;
+  uint32_t fused_cycles = 0;
+  // Keeps the legacy results from being optimized away
+  volatile uint32_t sink = 0;
+  reflect_level_t level;
+
+  for (size_t i = 0; i < BENCHMARK_ITERATIONS; i++) {
+    fill_benchmark_frame(samples);
+    auto start = esp_cpu_get_cycle_count();
+    sink += legacy_is_playing(samples, BENCHMARK_SAMPLES);
+    legacy_apply_gain(samples, BENCHMARK_SAMPLES,
+                      (float)gain_q12 / (1 << GAIN_SHIFT));
+    legacy_cycles += esp_cpu_get_cycle_count() - start;
+
+    fill_benchmark_frame(samples);
+    start = esp_cpu_get_cycle_count();
+    reflect_gain_and_measure(samples, BENCHMARK_SAMPLES, gain_q12, &level);
+    fused_cycles += esp_cpu_get_cycle_count() - start;
+    sink += level.peak;
+  }
+
+  ESP_LOGI(LOG_TAG,
+           "gain+level cycles/frame: float two-pass(%" PRIu32
+           ") fused(%" PRIu32 ")",
+           legacy_cycles / BENCHMARK_ITERATIONS,
+           fused_cycles / BENCHMARK_ITERATIONS);
+  heap_caps_free(samples);
+}
+#endif
@@ -0,0 +1,241 @@
+#include <esp_log.h>
+#include <esp_random.h>
+#include <esp_timer.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+#include <freertos/task.h>
+#include <inttypes.h>
+#include <string.h>
+
+#include "reflect.hpp"
+
+#define LOG_TAG "effects"
+
+#define EFFECTS_TASK_STACK_SIZE 4096
+#define EFFECTS_TASK_PRIORITY 4
+
+// Cycles asked of the bulb for a waveform with no duration, about 46 days
+// at the default period; the bulb runs it without any further packets
+#define EFFECT_FOREVER_CYCLES 1000000.0f
+
+// Candle flicker: a brightness dip of a random depth every so often, run
+// by the bulb as one transient half sine
+#define CANDLE_KELVIN 2000
+#define CANDLE_INTERVAL_MIN_MS 150
+#define CANDLE_INTERVAL_MAX_MS 500
+#define CANDLE_DIP_MIN_PERCENT 60
+#define CANDLE_DIP_MAX_PERCENT 95
+
+#define SUNRISE_DEFAULT_DURATION_S 1200
+
+// The bulb's own fades between these colors make up the sunrise; each one
+// takes its share of the duration
+typedef struct {
+  uint16_t share_percent;
+  uint16_t hue;
+  uint16_t saturation;
+  uint16_t brightness;
+  uint16_t kelvin;
+} sunrise_step_t;
+
+static constexpr sunrise_step_t kSunriseSteps[] = {
+    {0, 1000, 65535, 655, 2500},    // deep red, barely on
+    {30, 5461, 50000, 13107, 2500}, // orange
+    {40, 8000, 0, 39321, 2700},     // warm white
+    {30, 8000, 0, 65535, 5000},     // daylight
+};
+
+#define SUNRISE_STEP_COUNT (sizeof(kSunriseSteps) / sizeof(kSunriseSteps[0]))
+
+static SemaphoreHandle_t effect_mutex = NULL;
+static TaskHandle_t effect_task = NULL;
+
+// The effect asked for but not yet started, and the one running
+static reflect_effect_t requested;
+static bool start_pending = false;
+static reflect_effect_t effect;
+static int64_t effect_end_us = 0;
+static int64_t next_step_us = 0;
+static uint32_t step = 0;
+
+static uint32_t random_between(uint32_t minimum, uint32_t maximum) {
+  return minimum + esp_random() % (maximum - minimum + 1);
+}
+
+// Breathe and pulse leave the bulbs cycling until their cycles are up, so
+// they are put back on the color they had before. Bulbs that differed all
+// get the first one's.
+static void effect_end() {
+  if (effect.kind == REFLECT_EFFECT_BREATHE ||
+      effect.kind == REFLECT_EFFECT_PULSE) {
+    reflect_lifx_bulb_t bulb;
+    if (reflect_lifx_bulbs(&bulb, 1) > 0) {
+      send_lifx_set_color(bulb.hue, bulb.saturation, bulb.brightness,
+                          bulb.kelvin, 0);
+    }
+  }
+  if (effect.kind != REFLECT_EFFECT_STOP) {
+    ESP_LOGI(LOG_TAG, "%s ended", reflect_effect_names[effect.kind]);
+  }
+  effect.kind = REFLECT_EFFECT_STOP;
+}
+
+static void effect_begin(int64_t now_us) {
+  effect = requested;
+  step = 0;
+  next_step_us = now_us;
+  effect_end_us =
+      effect.duration == 0 ? 0 : now_us + effect.duration * 1000000LL;
+  if (effect.kind == REFLECT_EFFECT_STOP) {
+    return;
+  }
+  ESP_LOGI(LOG_TAG,
+           "%s hue(%d) saturation(%d) brightness(%d) kelvin(%d) period(%" PRIu32
+           "ms) duration(%" PRIu32 "s)",
+           reflect_effect_names[effect.kind], effect.hue, effect.saturation,
+           effect.brightness, effect.kelvin, effect.period, effect.duration);
+
+  if (effect.kind == REFLECT_EFFECT_BREATHE ||
+      effect.kind == REFLECT_EFFECT_PULSE) {
+    auto cycles = effect.duration == 0
+                      ? EFFECT_FOREVER_CYCLES
+                      : effect.duration * 1000.0f / effect.period;
+    send_lifx_set_power(true, 0);
+    send_lifx_set_waveform(true, effect.hue, effect.saturation,
+                           effect.brightness, effect.kelvin, effect.period,
+                           cycles, 0,
+                           effect.kind == REFLECT_EFFECT_BREATHE
+                               ? REFLECT_LIFX_SINE
+                               : REFLECT_LIFX_PULSE);
+    // The bulb runs the rest by itself
+    next_step_us = 0;
+  } else if (effect.kind == REFLECT_EFFECT_CANDLE) {
+    send_lifx_set_color(0, 0, effect.brightness, CANDLE_KELVIN, 500);
+    send_lifx_set_power(true, 0);
+    next_step_us = now_us + 500000;
+  } else if (effect.kind == REFLECT_EFFECT_SUNRISE) {
+    if (effect.duration == 0) {
+      effect.duration = SUNRISE_DEFAULT_DURATION_S;
+      effect_end_us = now_us + effect.duration * 1000000LL;
+    }
+  }
+}
+
+static void candle_step(int64_t now_us) {
+  auto interval_ms =
+      random_between(CANDLE_INTERVAL_MIN_MS, CANDLE_INTERVAL_MAX_MS);
+  auto dip = effect.brightness *
+             random_between(CANDLE_DIP_MIN_PERCENT, CANDLE_DIP_MAX_PERCENT) /
+             100;
+  send_lifx_set_waveform_optional(true, 0, 0, dip, 0, interval_ms, 1, 0,
+                                  REFLECT_LIFX_HALF_SINE,
+                                  REFLECT_LIFX_BRIGHTNESS);
+  next_step_us = now_us + interval_ms * 1000LL;
+}
+
+static void sunrise_step(int64_t now_us) {
+  if (step == SUNRISE_STEP_COUNT) {
+    next_step_us = 0;
+    return;
+  }
+
+  auto &target = kSunriseSteps[step];
+  auto fade_ms = (uint32_t)((uint64_t)effect.duration * 1000 *
+                            target.share_percent / 100);
+  send_lifx_set_color(target.hue, target.saturation, target.brightness,
+                      target.kelvin, fade_ms);
+  if (step == 0) {
+    send_lifx_set_power(true, 0);
+  }
+  step++;
+  next_step_us = now_us + fade_ms * 1000LL;
+}
+
+// Starts, advances or ends the effect, returning how long until it next
+// needs to
+static TickType_t effect_run() {
+  auto now_us = esp_timer_get_time();
+  xSemaphoreTake(effect_mutex, portMAX_DELAY);
+  if (start_pending) {
+    start_pending = false;
+    effect_end();
+    effect_begin(now_us);
+  }
+
+  if (effect.kind != REFLECT_EFFECT_STOP && effect_end_us != 0 &&
+      now_us >= effect_end_us) {
+    // Waveforms already ran out on the bulb, and the last sunrise fade
+    // has landed
+    ESP_LOGI(LOG_TAG, "%s finished", reflect_effect_names[effect.kind]);
+    effect.kind = REFLECT_EFFECT_STOP;
+  }
+
+  if (effect.kind != REFLECT_EFFECT_STOP && next_step_us != 0 &&
+      now_us >= next_step_us) {
+    if (effect.kind == REFLECT_EFFECT_CANDLE) {
+      candle_step(now_us);
+    } else if (effect.kind == REFLECT_EFFECT_SUNRISE) {
+      sunrise_step(now_us);
+    }
+  }
+
+  int64_t wake_us = 0;
+  if (effect.kind != REFLECT_EFFECT_STOP) {
+    wake_us = next_step_us;
+    if (effect_end_us != 0 && (wake_us == 0 || effect_end_us < wake_us)) {
+      wake_us = effect_end_us;
+    }
+  }
+  xSemaphoreGive(effect_mutex);
+
+  if (wake_us == 0) {
+    return portMAX_DELAY;
+  }
+  auto wait_ticks = pdMS_TO_TICKS((wake_us - now_us + 999) / 1000);
+  return wait_ticks > 0 ? wait_ticks : 1;
+}
+
+static void effects_task(void *) {
+  while (true) {
+    ulTaskNotifyTake(pdTRUE, effect_run());
+  }
+}
+
+// Replaces whatever effect is running. Returns at once; the effect task
+// sends the packets.
+void reflect_effect_start(const reflect_effect_t *start) {
+  xSemaphoreTake(effect_mutex, portMAX_DELAY);
+  requested = *start;
+  if (requested.period == 0) {
+    requested.period = 1;
+  }
+  start_pending = true;
+  xSemaphoreGive(effect_mutex);
+  xTaskNotifyGive(effect_task);
+}
+
+bool reflect_effect_running() {
+  xSemaphoreTake(effect_mutex, portMAX_DELAY);
+  auto running = effect.kind != REFLECT_EFFECT_STOP || start_pending;
+  xSemaphoreGive(effect_mutex);
+  return running;
+}
+
+// Ends the running effect before the caller sends a command of its own,
+// which then lands after anything sent to end it
+void reflect_effect_stop() {
+  xSemaphoreTake(effect_mutex, portMAX_DELAY);
+  start_pending = false;
+  effect_end();
+  xSemaphoreGive(effect_mutex);
+}
+
+void reflect_effects() {
+  effect_mutex = xSemaphoreCreateMutex();
+  assert(effect_mutex != NULL);
+  effect.kind = REFLECT_EFFECT_STOP;
+
+  xTaskCreate(effects_task, "effects", EFFECTS_TASK_STACK_SIZE, NULL,
+              EFFECTS_TASK_PRIORITY, &effect_task);
+  assert(effect_task != NULL);
+}
@@ -0,0 +1,442 @@
+#include <cinttypes>
+#include <cstring>
+#include <esp_heap_caps.h>
+#include <esp_timer.h>
+
+#include "cJSON.h"
+#include "reflect.hpp"
+
+#define LOG_TAG "events"
+
+// The type is looked for in this much of a message before giving up and
+// keeping the whole thing
+#define EVENT_SNIFF_SIZE 256
+#define EVENT_TYPE_SIZE 64
+#define EVENT_BUFFER_INITIAL_SIZE 1024
+#define EVENT_MAX_SIZE 32768
+
+// Messages on the data channel arrive as libpeer delivers SCTP chunks, so a
+// large event shows up as several fragments. Fragments are stitched back
+// together by tracking JSON nesting: an event ends where its outermost
+// object closes. Only events the Realtime API client asks for are kept;
+// everything else is scanned once and dropped.
+typedef enum {
+  EVENT_SNIFFING,
+  EVENT_KEEPING,
+  EVENT_SKIPPING,
+} event_mode_t;
+
+static event_mode_t mode = EVENT_SNIFFING;
+static int depth = 0;
+static bool in_string = false;
+static bool escaped = false;
+
+static char *buffer = NULL;
+static size_t length = 0;
+static size_t capacity = 0;
+static char type[EVENT_TYPE_SIZE];
+// The event in progress outgrew EVENT_MAX_SIZE after its type was sniffed
+static bool overflowed = false;
+
+static uint32_t messages = 0;
+static uint32_t fragments = 0;
+static uint32_t handled = 0;
+static uint32_t skipped = 0;
+static uint32_t dropped = 0;
+static uint32_t bytes = 0;
+static uint32_t buffer_grows = 0;
+
+// Copies a JSON string body (without quotes) into out, undoing escapes.
+// Returns false if it doesn't fit.
+static bool unescape(const char *in, size_t size, char *out, size_t out_size) {
+  size_t o = 0;
+  for (size_t i = 0; i < size; i++) {
+    auto c = in[i];
+    if (c == '\\' && i + 1 < size) {
+      c = in[++i];
+      switch (c) {
+      case 'n':
+        c = '\n';
+        break;
+      case 't':
+        c = '\t';
+        break;
+      case 'r':
+        c = '\r';
+        break;
+      case 'b':
+        c = '\b';
+        break;
+      case 'f':
+        c = '\f';
+        break;
+      case 'u': {
+        if (i + 4 >= size) {
+          return false;
+        }
+        char hex[5] = {in[i + 1], in[i + 2], in[i + 3], in[i + 4], 0};
+        auto code = strtoul(hex, NULL, 16);
+        i += 4;
+        // Nothing we read is expected outside ASCII
+        c = code < 0x80 ? (char)code : '?';
+        break;
+      }
+      default:
+        break;
+      }
+    }
+
+    if (o + 1 >= out_size) {
+      return false;
+    }
+    out[o++] = c;
+  }
+  out[o] = '\0';
+  return true;
+}
+
+// Finds the end of the string starting after the opening quote at start,
+// returns the index of the closing quote or size if it isn't there (yet)
+static size_t string_end(const char *json, size_t start, size_t size) {
+  for (size_t i = start; i < size; i++) {
+    if (json[i] == '\\') {
+      i++;
+    } else if (json[i] == '"') {
+      return i;
+    }
+  }
+  return size;
+}
+
+static size_t skip_space(const char *json, size_t i, size_t size) {
+  while (i < size && (json[i] == ' ' || json[i] == '\t' || json[i] == '\n' ||
+                      json[i] == '\r')) {
+    i++;
+  }
+  return i;
+}
+
+bool reflect_json_string(const char *json, size_t size, const char *key,
+                         char *out, size_t out_size) {
+  auto key_size = strlen(key);
+  int level = 0;
+  bool expect_key = false;
+
+  for (size_t i = 0; i < size; i++) {
+    auto c = json[i];
+    if (c == '"') {
+      auto end = string_end(json, i + 1, size);
+      if (end == size) {
+        return false;
+      }
+
+      bool is_key = level == 1 && expect_key;
+      bool matches = is_key && end - i - 1 == key_size &&
+                     memcmp(json + i + 1, key, key_size) == 0;
+      i = end;
+      if (!matches) {
+        continue;
+      }
+
+      auto value = skip_space(json, end + 1, size);
+      if (value >= size || json[value] != ':') {
+        return false;
+      }
+      value = skip_space(json, value + 1, size);
+      if (value >= size || json[value] != '"') {
+        return false;
+      }
+      auto value_end = string_end(json, value + 1, size);
+      if (value_end == size) {
+        return false;
+      }
+      return unescape(json + value + 1, value_end - value - 1, out, out_size);
+    } else if (c == '{' || c == '[') {
+      level++;
+      expect_key = c == '{' && level == 1;
+    } else if (c == '}' || c == ']') {
+      level--;
+    } else if (c == ',' && level == 1) {
+      expect_key = true;
+    } else if (c == ':' && level == 1) {
+      expect_key = false;
+    }
+  }
+  return false;
+}
+
+static bool append(const char *data, size_t size) {
+  if (length + size + 1 > EVENT_MAX_SIZE) {
+    return false;
+  }
+
+  if (length + size + 1 > capacity) {
+    auto grown = capacity == 0 ? EVENT_BUFFER_INITIAL_SIZE : capacity;
+    while (grown < length + size + 1) {
+      grown *= 2;
+    }
+    auto bigger = (char *)heap_caps_realloc(buffer, grown, MALLOC_CAP_SPIRAM);
+    if (bigger == NULL) {
+      return false;
+    }
+    buffer = bigger;
+    capacity = grown;
+    buffer_grows++;
+  }
+
+  memcpy(buffer + length, data, size);
+  length += size;
+  buffer[length] = '\0';
+  return true;
+}
+
+// Decides what to do with the event in progress once its type is known
+static void sniff(bool complete) {
+  if (mode != EVENT_SNIFFING) {
+    return;
+  }
+
+  if (reflect_json_string(buffer, length, "type", type, sizeof(type))) {
+    mode = realtimeapi_wants_event(type) ? EVENT_KEEPING : EVENT_SKIPPING;
+    if (mode == EVENT_SKIPPING) {
+      length = 0;
+    }
+  } else if (length >= EVENT_SNIFF_SIZE || complete) {
+    mode = EVENT_KEEPING;
+  }
+}
+
+static void log_events_stats() {
+  static int64_t last_stats_us = esp_timer_get_time();
+  auto now_us = esp_timer_get_time();
+  if (CONFIG_REFLECT_STATS_INTERVAL <= 0 ||
+      now_us - last_stats_us < CONFIG_REFLECT_STATS_INTERVAL * 1000000LL) {
+    return;
+  }
+  last_stats_us = now_us;
+
+  ESP_LOGI(LOG_TAG,
+           "messages(%" PRIu32 ") fragments(%" PRIu32 ") handled(%" PRIu32
+           ") skipped(%" PRIu32 ") dropped(%" PRIu32 ") bytes(%" PRIu32
+           ") grows(%" PRIu32 ")",
+           messages, fragments, handled, skipped, dropped, bytes, buffer_grows);
+}
+
+static void finish_event() {
+  messages++;
+  sniff(true);
+
+  if (mode == EVENT_KEEPING) {
+    if (type[0] == '\0' &&
+        !reflect_json_string(buffer, length, "type", type, sizeof(type))) {
+      dropped++;
+    } else if (realtimeapi_wants_event(type)) {
+      handled++;
+      realtimeapi_handle_event(type, buffer, length);
+    } else {
+      skipped++;
+    }
+  } else if (overflowed && type[0] != '\0') {
+    // Too large to keep, but some events still matter for having happened
+    realtimeapi_handle_dropped_event(type);
+  } else {
+    skipped++;
+  }
+
+  mode = EVENT_SNIFFING;
+  length = 0;
+  type[0] = '\0';
+  overflowed = false;
+  log_events_stats();
+}
+
+void reflect_events_reset() {
+  mode = EVENT_SNIFFING;
+  depth = 0;
+  in_string = false;
+  escaped = false;
+  length = 0;
+  type[0] = '\0';
+  overflowed = false;
+}
+
+void reflect_events_push(const char *data, size_t size) {
+  fragments++;
+  bytes += size;
+
+  size_t start = 0;
+  for (size_t i = 0; i < size; i++) {
+    auto c = data[i];
+    if (in_string) {
+      if (escaped) {
+        escaped = false;
+      } else if (c == '\\') {
+        escaped = true;
+      } else if (c == '"') {
+        in_string = false;
+      }
+      continue;
+    }
+
+    if (c == '"') {
+      in_string = true;
+    } else if (c == '{' || c == '[') {
+      if (depth == 0) {
+        start = i;
+      }
+      depth++;
+    } else if ((c == '}' || c == ']') && depth > 0) {
+      depth--;
+      if (depth == 0) {
+        if (mode != EVENT_SKIPPING && !append(data + start, i + 1 - start)) {
+          dropped++;
+          overflowed = true;
+          mode = EVENT_SKIPPING;
+        }
+        finish_event();
+      }
+    }
+  }
+
+  // Keep whatever part of an unfinished event this fragment carried
+  if (depth > 0 && mode != EVENT_SKIPPING) {
+    if (append(data + start, size - start)) {
+      sniff(false);
+    } else {
+      dropped++;
+      overflowed = true;
+      mode = EVENT_SKIPPING;
+      length = 0;
+    }
+  }
+}
+
+void reflect_events_stats(reflect_events_stats_t *stats) {
+  stats->messages = messages;
+  stats->fragments = fragments;
+  stats->handled = handled;
+  stats->skipped = skipped;
+  stats->dropped = dropped;
+  stats->bytes = bytes;
+  stats->buffer_grows = buffer_grows;
+}
+
+#if CONFIG_REFLECT_EVENTS_BENCHMARK
+#define BENCHMARK_DELTAS 200
+#define BENCHMARK_ITERATIONS 10
+#define BENCHMARK_FRAGMENT_SIZE 1200
+
+static uint32_t cjson_allocations = 0;
+
+static void *counting_malloc(size_t size) {
+  cjson_allocations++;
+  return malloc(size);
+}
+
+// A turn's worth of the events the Realtime API streams: transcript and
+// audio deltas followed by a large response.done, none of which are acted on
+static char *build_benchmark_stream(size_t *count) {
+  static const char delta[] =
+      "{\"type\":\"response.output_audio_transcript.delta\",\"event_id\":"
+      "\"event_CCrJqIxwxF4s1B7jALVfB\",\"response_id\":"
+      "\"resp_CCrJpPbqoQ4dX2iTSiZTr\",\"item_id\":\"item_CCrJpm1v5Hlk6tZ0T6\","
+      "\"output_index\":0,\"content_index\":0,\"delta\":\" brighter\"}";
+  static const char done_head[] =
+      "{\"type\":\"response.done\",\"event_id\":\"event_CCrJr0gS7zZ6\","
+      "\"response\":{\"object\":\"realtime.response\",\"id\":"
+      "\"resp_CCrJpPbqoQ4dX2iTSiZTr\",\"status\":\"completed\",\"output\":[{"
+      "\"id\":\"item_CCrJpm1v5Hlk6tZ0T6\",\"type\":\"message\",\"role\":"
+      "\"assistant\",\"content\":[{\"type\":\"output_audio\",\"transcript\":\"";
+  static const char done_tail[] =
+      "\"}]}],\"usage\":{\"total_tokens\":1876,\"input_tokens\":1553,"
+      "\"output_tokens\":323,\"input_token_details\":{\"text_tokens\":1409,"
+      "\"audio_tokens\":144,\"cached_tokens\":1344},\"output_token_details\":"
+      "{\"text_tokens\":78,\"audio_tokens\":245}}}}";
+
+  auto transcript_size = BENCHMARK_DELTAS * 9;
+  auto size = BENCHMARK_DELTAS * (sizeof(delta) - 1) + sizeof(done_head) - 1 +
+              transcript_size + sizeof(done_tail) - 1 + 1;
+  auto stream = (char *)heap_caps_malloc(size, MALLOC_CAP_SPIRAM);
+  assert(stream != nullptr);
+
+  size_t offset = 0;
+  for (size_t i = 0; i < BENCHMARK_DELTAS; i++) {
+    memcpy(stream + offset, delta, sizeof(delta) - 1);
+    offset += sizeof(delta) - 1;
+  }
+  memcpy(stream + offset, done_head, sizeof(done_head) - 1);
+  offset += sizeof(done_head) - 1;
+  for (size_t i = 0; i < BENCHMARK_DELTAS; i++) {
+    memcpy(stream + offset, " brighter", 9);
+    offset += 9;
+  }
+  memcpy(stream + offset, done_tail, sizeof(done_tail) - 1);
+  offset += sizeof(done_tail) - 1;
+  stream[offset] = '\0';
+
+  *count = offset;
+  return stream;
+}
+
+// Splits the stream back into its events for the cJSON path, which needs
+// each one on its own
+static void parse_with_cjson(char *stream, size_t size) {
+  size_t start = 0;
+  int level = 0;
+  for (size_t i = 0; i < size; i++) {
+    if (stream[i] == '{') {
+      level++;
+    } else if (stream[i] == '}' && --level == 0) {
+      auto saved = stream[i + 1];
+      stream[i + 1] = '\0';
+      auto root = cJSON_Parse(stream + start);
+      if (root != nullptr) {
+        cJSON_GetObjectItem(root, "type");
+        cJSON_Delete(root);
+      }
+      stream[i + 1] = saved;
+      start = i + 1;
+    }
+  }
+}
+
+void reflect_events_benchmark() {
+  size_t size = 0;
+  auto stream = build_benchmark_stream(&size);
+
+  cJSON_Hooks hooks = {.malloc_fn = counting_malloc, .free_fn = free};
+  cJSON_InitHooks(&hooks);
+  auto start_us = esp_timer_get_time();
+  for (size_t i = 0; i < BENCHMARK_ITERATIONS; i++) {
+    parse_with_cjson(stream, size);
+  }
+  auto cjson_us = esp_timer_get_time() - start_us;
+  cJSON_InitHooks(NULL);
+
+  auto grows_before = buffer_grows;
+  start_us = esp_timer_get_time();
+  for (size_t i = 0; i < BENCHMARK_ITERATIONS; i++) {
+    for (size_t offset = 0; offset < size; offset += BENCHMARK_FRAGMENT_SIZE) {
+      auto fragment = size - offset < BENCHMARK_FRAGMENT_SIZE
+                          ? size - offset
+                          : BENCHMARK_FRAGMENT_SIZE;
+      reflect_events_push(stream + offset, fragment);
+    }
+  }
+  auto streaming_us = esp_timer_get_time() - start_us;
+
+  auto total = (uint64_t)size * BENCHMARK_ITERATIONS;
+  ESP_LOGI(LOG_TAG,
+           "%" PRIu32 " bytes x %d: cJSON %" PRIu32 " KB/s, %" PRIu32
+           " allocations; streaming %" PRIu32 " KB/s, %" PRIu32
+           " allocations",
+           (uint32_t)size, BENCHMARK_ITERATIONS,
+           (uint32_t)(total * 1000000 / cjson_us / 1024), cjson_allocations,
+           (uint32_t)(total * 1000000 / streaming_us / 1024),
+           buffer_grows - grows_before);
+
+  heap_caps_free(stream);
+  reflect_events_reset();
+  messages = fragments = handled = skipped = dropped = bytes = 0;
+}
+#endif
@@ -1,18 +1,106 @@
 #include <esp_crt_bundle.h>
 #include <esp_http_client.h>
 #include <esp_log.h>
+#include <esp_timer.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+#include <freertos/task.h>
+#include <inttypes.h>
 #include <string.h>
 
 #include "reflect.hpp"
 
 #define LOG_TAG "HTTP"
 
-#ifndef MIN
-#define MIN(a, b) (((a) < (b)) ? (a) : (b))
-#endif
+// Answers start out this big and double as needed, up to the limit
+#define SDP_ANSWER_INITIAL_SIZE 4096
+#define SDP_ANSWER_MAX_SIZE 65536
+
+#define WARMUP_TASK_STACK_SIZE 8192
+#define WARMUP_TASK_PRIORITY 5
+
+// TCP keepalive for the idle signaling connection, so NAT state outlives
+// the time between sessions
+#define KEEP_ALIVE_IDLE_S 30
+#define KEEP_ALIVE_INTERVAL_S 10
+#define KEEP_ALIVE_COUNT 3
+
+// Signaling requests that can be in flight at once, each on its own client
+#define HTTP_CLIENTS 2
+
+// Clients live as long as the device: each keeps its connection open between
+// requests, and when it has to be reopened offers its saved TLS session
+// ticket for resumption
+typedef struct {
+  esp_http_client_handle_t handle;
+  bool busy;
+  bool have_session;
+} oai_http_client_t;
+
+static oai_http_client_t clients[HTTP_CLIENTS];
+static SemaphoreHandle_t clients_free = NULL;
+static SemaphoreHandle_t clients_mutex = NULL;
+static char authorization[256];
+
+// Everything one request accumulates, handed to the event handler as
+// user_data so concurrent requests (on separate clients) don't share state
+typedef struct {
+  char *body;
+  size_t length;
+  size_t capacity;
+  bool truncated;
+  // Set when the request had to open a new connection
+  int64_t connected_us;
+} oai_http_response_t;
+
+static void oai_http_response_reset(oai_http_response_t *response) {
+  response->length = 0;
+  response->truncated = false;
+  response->connected_us = 0;
+  if (response->body != NULL) {
+    response->body[0] = '\0';
+  }
+}
+
+// Appends body data, growing the buffer as needed. The client has already
+// removed any chunked transfer encoding by the time data gets here.
+static void oai_http_response_append(oai_http_response_t *response,
+                                     const char *data, size_t size) {
+  if (response->truncated) {
+    return;
+  }
+
+  auto needed = response->length + size + 1;
+  if (needed > SDP_ANSWER_MAX_SIZE) {
+    ESP_LOGE(LOG_TAG, "Response larger than %d bytes, dropping it",
+             SDP_ANSWER_MAX_SIZE);
+    response->truncated = true;
+    return;
+  }
+
+  if (needed > response->capacity) {
+    auto capacity = response->capacity == 0 ? SDP_ANSWER_INITIAL_SIZE
+                                            : response->capacity;
+    while (capacity < needed) {
+      capacity *= 2;
+    }
+    auto body = (char *)realloc(response->body, capacity);
+    if (body == NULL) {
+      ESP_LOGE(LOG_TAG, "Out of memory for %d byte response", (int)capacity);
+      response->truncated = true;
+      return;
+    }
+    response->body = body;
+    response->capacity = capacity;
+  }
+
+  memcpy(response->body + response->length, data, size);
+  response->length += size;
+  response->body[response->length] = '\0';
+}
 
 esp_err_t oai_http_event_handler(esp_http_client_event_t *evt) {
-  static int output_len;
+  auto response = (oai_http_response_t *)evt->user_data;
   switch (evt->event_id) {
   case HTTP_EVENT_REDIRECT:
     ESP_LOGD(LOG_TAG, "HTTP_EVENT_REDIRECT");
@@ -25,6 +113,9 @@ esp_err_t oai_http_event_handler(esp_http_client_event_t *evt) {
     break;
   case HTTP_EVENT_ON_CONNECTED:
     ESP_LOGD(LOG_TAG, "HTTP_EVENT_ON_CONNECTED");
+    if (response != NULL) {
+      response->connected_us = esp_timer_get_time();
+    }
     break;
   case HTTP_EVENT_HEADER_SENT:
     ESP_LOGD(LOG_TAG, "HTTP_EVENT_HEADER_SENT");
@@ -33,66 +124,165 @@ esp_err_t oai_http_event_handler(esp_http_client_event_t *evt) {
     ESP_LOGD(LOG_TAG, "HTTP_EVENT_ON_HEADER, key=%s, value=%s", evt->header_key,
              evt->header_value);
     break;
-  case HTTP_EVENT_ON_DATA: {
+  case HTTP_EVENT_ON_DATA:
     ESP_LOGD(LOG_TAG, "HTTP_EVENT_ON_DATA, len=%d", evt->data_len);
-    if (esp_http_client_is_chunked_response(evt->client)) {
-      ESP_LOGE(LOG_TAG, "Chunked HTTP response not supported");
-#ifndef LINUX_BUILD
-      esp_restart();
-#endif
+    if (response != NULL) {
+      oai_http_response_append(response, (const char *)evt->data,
+                               evt->data_len);
     }
-
-    if (output_len == 0 && evt->user_data) {
-      memset(evt->user_data, 0, SDP_BUFFER_SIZE);
-    }
-
-    // If user_data buffer is configured, copy the response into the buffer
-    int copy_len = 0;
-    if (evt->user_data) {
-      // The last byte in evt->user_data is kept for the NULL character in
-      // case of out-of-bound access.
-      copy_len = MIN(evt->data_len, (SDP_BUFFER_SIZE - output_len));
-      if (copy_len) {
-        memcpy(((char *)evt->user_data) + output_len, evt->data, copy_len);
-      }
-    }
-    output_len += copy_len;
-
     break;
-  }
   case HTTP_EVENT_ON_FINISH:
     ESP_LOGD(LOG_TAG, "HTTP_EVENT_ON_FINISH");
-    output_len = 0;
     break;
   case HTTP_EVENT_DISCONNECTED:
     ESP_LOGI(LOG_TAG, "HTTP_EVENT_DISCONNECTED");
-    output_len = 0;
     break;
   }
   return ESP_OK;
 }
 
-void oai_http_request(const char *offer, char *answer) {
+static esp_http_client_handle_t oai_http_client() {
   esp_http_client_config_t config;
   memset(&config, 0, sizeof(esp_http_client_config_t));
 
   config.url = CONFIG_OPENAI_REALTIME_API_URL;
   config.event_handler = oai_http_event_handler;
   config.crt_bundle_attach = esp_crt_bundle_attach;
-  config.user_data = answer;
+  config.save_client_session = true;
+  config.keep_alive_enable = true;
+  config.keep_alive_idle = KEEP_ALIVE_IDLE_S;
+  config.keep_alive_interval = KEEP_ALIVE_INTERVAL_S;
+  config.keep_alive_count = KEEP_ALIVE_COUNT;
+
+  auto client = esp_http_client_init(&config);
+  assert(client != nullptr);
+  esp_http_client_set_header(client, "Authorization", authorization);
+  return client;
+}
+
+// Blocks until a client is free. Lower clients are preferred, so the one
+// the warmup connected serves requests that don't overlap.
+static oai_http_client_t *oai_http_acquire() {
+  xSemaphoreTake(clients_free, portMAX_DELAY);
+  xSemaphoreTake(clients_mutex, portMAX_DELAY);
+  oai_http_client_t *client = NULL;
+  for (size_t i = 0; i < HTTP_CLIENTS; i++) {
+    if (!clients[i].busy) {
+      client = &clients[i];
+      client->busy = true;
+      break;
+    }
+  }
+  xSemaphoreGive(clients_mutex);
+  assert(client != nullptr);
+  return client;
+}
+
+static void oai_http_release(oai_http_client_t *client) {
+  xSemaphoreTake(clients_mutex, portMAX_DELAY);
+  client->busy = false;
+  xSemaphoreGive(clients_mutex);
+  xSemaphoreGive(clients_free);
+}
+
+// Runs one request on an acquired client and logs where the time went. A
+// kept connection the server has since closed fails on first use, so that
+// gets one retry on a fresh connection.
+static esp_err_t oai_http_perform(oai_http_client_t *client, const char *name,
+                                  oai_http_response_t *response) {
+  esp_http_client_set_user_data(client->handle, response);
+
+  esp_err_t err = ESP_FAIL;
+  for (int attempt = 0; attempt < 2; attempt++) {
+    // Whether a reconnect actually resumed the TLS session isn't exposed
+    // by esp_http_client or mbedTLS, only that it had a ticket to offer
+    auto reconnect = client->have_session;
+    oai_http_response_reset(response);
+    auto start_us = esp_timer_get_time();
+    err = esp_http_client_perform(client->handle);
+    auto end_us = esp_timer_get_time();
+
+    auto connected_us = response->connected_us;
+    if (connected_us != 0) {
+      client->have_session = true;
+      ESP_LOGI(LOG_TAG,
+               "%s: %s connection, handshake %" PRIu32 "ms, request %" PRIu32
+               "ms",
+               name, reconnect ? "reconnect" : "first",
+               (uint32_t)((connected_us - start_us) / 1000),
+               (uint32_t)((end_us - connected_us) / 1000));
+      return err;
+    }
+
+    if (err == ESP_OK) {
+      ESP_LOGI(LOG_TAG, "%s: reused connection, request %" PRIu32 "ms", name,
+               (uint32_t)((end_us - start_us) / 1000));
+      return err;
+    }
+
+    esp_http_client_close(client->handle);
+  }
+  return err;
+}
+
+// Opens the signaling connection (TCP, TLS and all) as soon as there is an
+// IP, while the offer is still being put together, so the SDP exchange
+// itself only pays for the request
+static void oai_http_warmup_task(void *) {
+  reflect_boot_wait(REFLECT_BOOT_NETWORK_READY);
+
+  auto client = oai_http_acquire();
+  esp_http_client_set_method(client->handle, HTTP_METHOD_HEAD);
+  esp_http_client_set_post_field(client->handle, NULL, 0);
+  oai_http_response_t response = {};
+  auto err = oai_http_perform(client, "warmup", &response);
+  if (err != ESP_OK) {
+    ESP_LOGW(LOG_TAG, "Warmup failed %s", esp_err_to_name(err));
+  }
+  oai_http_release(client);
+  free(response.body);
+
+  vTaskDelete(NULL);
+}
+
+void oai_http_warmup() {
+  clients_mutex = xSemaphoreCreateMutex();
+  assert(clients_mutex != nullptr);
+  clients_free = xSemaphoreCreateCounting(HTTP_CLIENTS, HTTP_CLIENTS);
+  assert(clients_free != nullptr);
+
+  snprintf(authorization, sizeof(authorization), "Bearer %s",
+           CONFIG_OPENAI_API_KEY);
+  for (size_t i = 0; i < HTTP_CLIENTS; i++) {
+    clients[i].handle = oai_http_client();
+  }
+
+  xTaskCreate(oai_http_warmup_task, "http_warmup", WARMUP_TASK_STACK_SIZE,
+              NULL, WARMUP_TASK_PRIORITY, NULL);
+}
 
-  snprintf(answer, SDP_BUFFER_SIZE, "Bearer %s", CONFIG_OPENAI_API_KEY);
+// Posts the offer and returns the answer SDP (to be freed by the caller), or
+// NULL if there is none. Safe to call from several tasks at once.
+char *oai_http_request(const char *offer) {
+  auto client = oai_http_acquire();
+  esp_http_client_set_method(client->handle, HTTP_METHOD_POST);
+  esp_http_client_set_header(client->handle, "Content-Type",
+                             "application/sdp");
+  esp_http_client_set_post_field(client->handle, offer, strlen(offer));
 
-  esp_http_client_handle_t client = esp_http_client_init(&config);
-  esp_http_client_set_method(client, HTTP_METHOD_POST);
-  esp_http_client_set_header(client, "Content-Type", "application/sdp");
-  esp_http_client_set_header(client, "Authorization", answer);
-  esp_http_client_set_post_field(client, offer, strlen(offer));
+  oai_http_response_t response = {};
+  esp_err_t err = oai_http_perform(client, "offer", &response);
+  auto status = esp_http_client_get_status_code(client->handle);
+  oai_http_release(client);
 
-  esp_err_t err = esp_http_client_perform(client);
-  if (err != ESP_OK || esp_http_client_get_status_code(client) != 201) {
-    ESP_LOGE(LOG_TAG, "Error perform http request %s", esp_err_to_name(err));
+  if (err != ESP_OK || status != 201 || response.truncated ||
+      response.length == 0) {
+    ESP_LOGE(LOG_TAG, "Error perform http request %s (status %d)",
+             esp_err_to_name(err), status);
+    free(response.body);
+    return NULL;
   }
 
-  esp_http_client_cleanup(client);
+  ESP_LOGI(LOG_TAG, "Answer %d bytes", (int)response.length);
+  return response.body;
 }
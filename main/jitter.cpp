@@ -0,0 +1,342 @@
+#include <atomic>
+#include <cinttypes>
+#include <cstring>
+#include <esp_timer.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+#include <freertos/task.h>
+
+#include "reflect.hpp"
+
+#define LOG_TAG "jitter"
+
+// Power of two so sequence numbers map straight onto slots
+#define JITTER_SLOTS 32
+#define JITTER_MAX_PACKET_SIZE 1276
+#define JITTER_FRAME_US 20000
+
+// Frames allowed above the target before the oldest one is dropped to pull
+// latency back down
+#define JITTER_TRIM_SLACK 2
+
+// Received vs. lost frames are counted over this many frames before the loss
+// rate is handed to the uplink encoder
+#define LOSS_WINDOW_FRAMES 250
+
+// Opus always uses a 48kHz RTP clock, independent of the decoded rate
+#define RTP_CLOCK_RATE 48000
+#define RTP_HEADER_SIZE 12
+
+#define PLAYOUT_TASK_STACK_SIZE 16384
+#define PLAYOUT_TASK_PRIORITY 8
+#define PLAYOUT_TASK_CORE 1
+
+typedef struct {
+  bool filled;
+  uint16_t seq;
+  uint16_t size;
+  uint8_t data[JITTER_MAX_PACKET_SIZE];
+} jitter_slot_t;
+
+typedef enum {
+  JITTER_FRAME,
+  JITTER_RECOVERED,
+  JITTER_LOST,
+  JITTER_EMPTY,
+} jitter_result_t;
+
+static jitter_slot_t *slots = NULL;
+static SemaphoreHandle_t jitter_mutex = NULL;
+
+// ICE and DTLS don't wait for audio bring-up, so media can show up before
+// there is anywhere to put it
+static std::atomic<bool> jitter_ready{false};
+
+static bool have_next_seq = false;
+static uint16_t next_seq = 0;
+static uint16_t fallback_seq = 0;
+static size_t buffered = 0;
+static bool buffering = true;
+
+// RFC 3550 interarrival jitter, in RTP timestamp units
+static bool have_transit = false;
+static int32_t last_transit = 0;
+static float jitter = 0;
+static uint32_t target_frames = 1;
+
+static uint32_t late_drops = 0;
+static uint32_t underruns = 0;
+static uint32_t trimmed = 0;
+static uint32_t trimmed_holes = 0;
+static uint32_t recovered = 0;
+static uint32_t concealed = 0;
+
+static uint32_t window_frames = 0;
+static uint32_t window_lost = 0;
+
+// libpeer's RTP decoder hands us the payload that directly follows the fixed
+// 12 byte RTP header in its receive buffer. Peek at that header to get the
+// sequence number and timestamp, and refuse anything that doesn't look like a
+// plain RTPv2 header (no CSRCs, no extension).
+static bool rtp_header(const uint8_t *payload, uint16_t *seq,
+                       uint32_t *timestamp) {
+  auto header = payload - RTP_HEADER_SIZE;
+  if ((header[0] >> 6) != 2 || (header[0] & 0x1F) != 0) {
+    return false;
+  }
+
+  *seq = (header[2] << 8) | header[3];
+  *timestamp = ((uint32_t)header[4] << 24) | ((uint32_t)header[5] << 16) |
+               ((uint32_t)header[6] << 8) | header[7];
+  return true;
+}
+
+static void update_target(uint32_t timestamp) {
+  auto arrival = (uint32_t)(esp_timer_get_time() * RTP_CLOCK_RATE / 1000000);
+  auto transit = (int32_t)(arrival - timestamp);
+
+  if (have_transit) {
+    auto d = transit - last_transit;
+    jitter += ((float)(d < 0 ? -d : d) - jitter) / 16.0f;
+  }
+  last_transit = transit;
+  have_transit = true;
+
+  auto jitter_us = jitter * 1000000.0f / RTP_CLOCK_RATE;
+  auto delay_us = JITTER_FRAME_US + (uint32_t)(4.0f * jitter_us);
+  if (delay_us < CONFIG_REFLECT_JITTER_MIN_DELAY_MS * 1000) {
+    delay_us = CONFIG_REFLECT_JITTER_MIN_DELAY_MS * 1000;
+  }
+  if (delay_us > CONFIG_REFLECT_JITTER_MAX_DELAY_MS * 1000) {
+    delay_us = CONFIG_REFLECT_JITTER_MAX_DELAY_MS * 1000;
+  }
+
+  target_frames = (delay_us + JITTER_FRAME_US - 1) / JITTER_FRAME_US;
+  if (target_frames >= JITTER_SLOTS) {
+    target_frames = JITTER_SLOTS - 1;
+  }
+}
+
+static void jitter_reset(uint16_t seq) {
+  for (size_t i = 0; i < JITTER_SLOTS; i++) {
+    slots[i].filled = false;
+  }
+  buffered = 0;
+  buffering = true;
+  next_seq = seq;
+  have_next_seq = true;
+}
+
+// Consume the slot for next_seq (if any) and move on to the next sequence
+// Returns whether a buffered frame was dropped, rather than a hole skipped
+static bool jitter_advance() {
+  auto slot = &slots[next_seq % JITTER_SLOTS];
+  auto dropped = slot->filled && slot->seq == next_seq;
+  if (dropped) {
+    slot->filled = false;
+    buffered--;
+  }
+  next_seq++;
+  return dropped;
+}
+
+void reflect_jitter_push(const uint8_t *data, size_t size) {
+  if (!jitter_ready || size == 0 || size > JITTER_MAX_PACKET_SIZE) {
+    return;
+  }
+
+  uint16_t seq = 0;
+  uint32_t timestamp = 0;
+  bool has_header = rtp_header(data, &seq, &timestamp);
+
+  xSemaphoreTake(jitter_mutex, portMAX_DELAY);
+  if (!has_header) {
+    seq = fallback_seq;
+  }
+  fallback_seq = seq + 1;
+
+  if (has_header) {
+    update_target(timestamp);
+  }
+
+  if (!have_next_seq) {
+    jitter_reset(seq);
+  }
+
+  auto ahead = (int16_t)(seq - next_seq);
+  if (ahead < 0) {
+    late_drops++;
+  } else {
+    if (ahead >= JITTER_SLOTS) {
+      ESP_LOGW(LOG_TAG, "Sequence jumped by %d, resyncing", ahead);
+      jitter_reset(seq);
+    }
+
+    auto slot = &slots[seq % JITTER_SLOTS];
+    if (!slot->filled) {
+      slot->filled = true;
+      slot->seq = seq;
+      slot->size = size;
+      memcpy(slot->data, data, size);
+      buffered++;
+    }
+  }
+  xSemaphoreGive(jitter_mutex);
+}
+
+// A new session starts its RTP sequence anywhere, so forget the old one
+void reflect_jitter_flush() {
+  if (!jitter_ready) {
+    return;
+  }
+
+  xSemaphoreTake(jitter_mutex, portMAX_DELAY);
+  for (size_t i = 0; i < JITTER_SLOTS; i++) {
+    slots[i].filled = false;
+  }
+  buffered = 0;
+  buffering = true;
+  have_next_seq = false;
+  have_transit = false;
+  xSemaphoreGive(jitter_mutex);
+}
+
+static jitter_result_t jitter_pop(uint8_t *out, size_t *size) {
+  auto result = JITTER_EMPTY;
+
+  xSemaphoreTake(jitter_mutex, portMAX_DELAY);
+  if (buffering && buffered >= target_frames) {
+    buffering = false;
+  }
+
+  if (!buffering) {
+    if (buffered == 0) {
+      // Either the network stalled or the far end stopped talking; refill up
+      // to the target before playing again
+      underruns++;
+      buffering = true;
+    } else {
+      while (buffered > target_frames + JITTER_TRIM_SLACK) {
+        if (jitter_advance()) {
+          trimmed++;
+        } else {
+          trimmed_holes++;
+        }
+      }
+
+      auto slot = &slots[next_seq % JITTER_SLOTS];
+      if (slot->filled && slot->seq == next_seq) {
+        memcpy(out, slot->data, slot->size);
+        *size = slot->size;
+        result = JITTER_FRAME;
+      } else {
+        // The packet after a missing one carries its in-band FEC copy
+        auto fec_seq = (uint16_t)(next_seq + 1);
+        auto fec_slot = &slots[fec_seq % JITTER_SLOTS];
+        if (fec_slot->filled && fec_slot->seq == fec_seq) {
+          memcpy(out, fec_slot->data, fec_slot->size);
+          *size = fec_slot->size;
+          result = JITTER_RECOVERED;
+          recovered++;
+        } else {
+          result = JITTER_LOST;
+          concealed++;
+        }
+        window_lost++;
+      }
+      jitter_advance();
+      window_frames++;
+    }
+  }
+
+  int loss_perc = -1;
+  if (window_frames >= LOSS_WINDOW_FRAMES) {
+    loss_perc = (window_lost * 100) / window_frames;
+    window_frames = 0;
+    window_lost = 0;
+  }
+  xSemaphoreGive(jitter_mutex);
+
+  // libpeer doesn't surface RTCP receiver reports, so the loss we see on the
+  // downlink stands in for the uplink's
+  if (loss_perc >= 0) {
+    reflect_set_packet_loss(loss_perc);
+  }
+
+  return result;
+}
+
+void reflect_jitter_stats(reflect_jitter_stats_t *stats) {
+  xSemaphoreTake(jitter_mutex, portMAX_DELAY);
+  stats->depth = buffered;
+  stats->target_depth = target_frames;
+  stats->late_drops = late_drops;
+  stats->underruns = underruns;
+  stats->trimmed = trimmed;
+  stats->trimmed_holes = trimmed_holes;
+  stats->recovered = recovered;
+  stats->concealed = concealed;
+  stats->jitter_us = (uint32_t)(jitter * 1000000.0f / RTP_CLOCK_RATE);
+  xSemaphoreGive(jitter_mutex);
+}
+
+static void log_jitter_stats() {
+  reflect_jitter_stats_t stats;
+  reflect_jitter_stats(&stats);
+  ESP_LOGI(LOG_TAG,
+           "depth(%" PRIu32 ") target(%" PRIu32 ") jitter_us(%" PRIu32
+           ") late_drops(%" PRIu32 ") underruns(%" PRIu32 ") trimmed(%" PRIu32
+           ") trimmed_holes(%" PRIu32 ") recovered(%" PRIu32
+           ") concealed(%" PRIu32 ")",
+           stats.depth, stats.target_depth, stats.jitter_us, stats.late_drops,
+           stats.underruns, stats.trimmed, stats.trimmed_holes, stats.recovered,
+           stats.concealed);
+}
+
+// Pulls one 20ms frame per iteration. Playback is paced by
+// esp_codec_dev_write blocking on the I2S DMA, so the codec clock (not the
+// network) decides when the next frame is needed.
+static void reflect_playout_task(void *) {
+  auto frame = (uint8_t *)malloc(JITTER_MAX_PACKET_SIZE);
+  assert(frame != nullptr);
+
+  int64_t last_stats_us = esp_timer_get_time();
+  while (true) {
+    size_t size = 0;
+    switch (jitter_pop(frame, &size)) {
+    case JITTER_FRAME:
+      reflect_play_audio(frame, size);
+      break;
+    case JITTER_RECOVERED:
+      reflect_conceal_audio(frame, size);
+      break;
+    case JITTER_LOST:
+      reflect_conceal_audio(nullptr, 0);
+      break;
+    case JITTER_EMPTY:
+      reflect_play_silence();
+      break;
+    }
+
+    auto now_us = esp_timer_get_time();
+    if (CONFIG_REFLECT_STATS_INTERVAL > 0 &&
+        now_us - last_stats_us >= CONFIG_REFLECT_STATS_INTERVAL * 1000000LL) {
+      log_jitter_stats();
+      last_stats_us = now_us;
+    }
+  }
+}
+
+void reflect_jitter_buffer() {
+  slots = (jitter_slot_t *)heap_caps_calloc(JITTER_SLOTS, sizeof(jitter_slot_t),
+                                            MALLOC_CAP_SPIRAM);
+  assert(slots != nullptr);
+
+  jitter_mutex = xSemaphoreCreateMutex();
+  assert(jitter_mutex != nullptr);
+  jitter_ready = true;
+
+  xTaskCreatePinnedToCore(reflect_playout_task, "audio_playout",
+                          PLAYOUT_TASK_STACK_SIZE, NULL, PLAYOUT_TASK_PRIORITY,
+                          NULL, PLAYOUT_TASK_CORE);
+}
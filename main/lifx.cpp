@@ -1,13 +1,67 @@
 #include <arpa/inet.h>
+#include <atomic>
+#include <esp_log.h>
+#include <esp_random.h>
+#include <esp_timer.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+#include <freertos/task.h>
+#include <inttypes.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <string.h>
+#include <sys/select.h>
+#include <sys/time.h>
 #include <sys/socket.h>
 #include <unistd.h>
 
+#include "reflect.hpp"
+
+#define LOG_TAG "lifx"
+
 #define BROADCAST_IP "255.255.255.255"
 #define LIFX_PORT 56700
 
+#define LIFX_GET_SERVICE 2
+#define LIFX_STATE_SERVICE 3
+#define LIFX_ACKNOWLEDGEMENT 45
+#define LIFX_GET_GROUP 51
+#define LIFX_STATE_GROUP 53
+#define LIFX_GET 101
+#define LIFX_SET_COLOR 102
+#define LIFX_SET_WAVEFORM 103
+#define LIFX_LIGHT_STATE 107
+#define LIFX_SET_WAVEFORM_OPTIONAL 119
+#define LIFX_SET_LIGHT_POWER 117
+
+#define LIFX_SERVICE_UDP 1
+#define LIFX_PACKET_MAX_SIZE 128
+#define LIFX_MAX_BULBS 16
+
+#define LIFX_TASK_STACK_SIZE 4096
+#define LIFX_TASK_PRIORITY 4
+
+// Longest the task blocks for replies before checking whether discovery
+// is due
+#define LIFX_RECEIVE_TIMEOUT_MS 1000
+
+// Commands awaiting an acknowledgement, at most
+#define LIFX_INFLIGHT_MAX 16
+
+// Commands waiting to go to one bulb. A new command replaces a queued one
+// of the same type, so this only needs a slot per command type.
+#define LIFX_QUEUE_DEPTH 4
+#define LIFX_COMMAND_MAX_SIZE 64
+
+#define LIFX_SCHEDULER_TASK_STACK_SIZE 4096
+#define LIFX_SCHEDULER_TASK_PRIORITY 6
+
+// Wall clock readings before this are taken to mean it was never set
+#define LIFX_CLOCK_VALID_S 1700000000
+
+// Bulbs that miss this many discovery rounds are forgotten
+#define LIFX_STALE_ROUNDS 3
+
 #pragma pack(push, 1)
 typedef struct {
   uint16_t size;
@@ -59,30 +113,559 @@ typedef struct {
   uint8_t waveform;
 } lifx_set_waveform_t;
 
+typedef struct {
+  lifx_set_waveform_t waveform;
+  uint8_t set_hue;
+  uint8_t set_saturation;
+  uint8_t set_brightness;
+  uint8_t set_kelvin;
+} lifx_set_waveform_optional_t;
+
+typedef struct {
+  uint8_t service;
+  uint32_t port;
+} lifx_state_service_t;
+
+typedef struct {
+  uint8_t group[16];
+  char label[32];
+  uint64_t updated_at;
+} lifx_state_group_t;
+
+typedef struct {
+  uint16_t hue;
+  uint16_t saturation;
+  uint16_t brightness;
+  uint16_t kelvin;
+  uint16_t reserved;
+  uint16_t power;
+  char label[32];
+  uint64_t reserved2;
+} lifx_light_state_t;
+
 #pragma pack(pop)
 
+typedef struct {
+  uint8_t packet[LIFX_COMMAND_MAX_SIZE];
+  int size;
+  // Commands sent to several bulbs at once share a batch, and go out
+  // together
+  uint32_t batch;
+  uint32_t batch_size;
+} lifx_command_t;
+
+// A bulb found by discovery, where to reach it and what is waiting to be
+// sent to it
+typedef struct {
+  reflect_lifx_bulb_t state;
+  struct sockaddr_in addr;
+  int64_t seen_us;
+  lifx_command_t queue[LIFX_QUEUE_DEPTH];
+  size_t queued;
+  int64_t next_send_us;
+} lifx_bulb_t;
+
+// A command sent with ack_required, kept until the bulb acknowledges it
+// or the retries run out
+typedef struct {
+  bool used;
+  uint8_t mac[6];
+  struct sockaddr_in addr;
+  uint8_t packet[LIFX_PACKET_MAX_SIZE];
+  int size;
+  int64_t sent_us;
+  int64_t retried_us;
+  int retries;
+} lifx_inflight_t;
+
 int lifx_socket = 0;
 struct sockaddr_in lifx_addr;
 
-void send_lifx_pkt(void *pkt, int size) {
-  sendto(lifx_socket, pkt, size, 0, (struct sockaddr *)&lifx_addr,
-         sizeof(lifx_addr));
+// Replies carry our source back, which tells them apart from traffic meant
+// for other controllers on the network. Acks are matched on the sequence,
+// which packets take from several tasks, some without bulbs_mutex held.
+static uint32_t source = 0;
+static std::atomic<uint8_t> sequence = 0;
+
+static SemaphoreHandle_t bulbs_mutex = NULL;
+static lifx_bulb_t bulbs[LIFX_MAX_BULBS];
+static size_t bulb_count = 0;
+
+static lifx_inflight_t inflight[LIFX_INFLIGHT_MAX];
+static uint32_t sent = 0;
+static uint32_t acked = 0;
+static uint32_t retransmits = 0;
+static uint32_t lost = 0;
+static uint32_t superseded = 0;
+static int64_t ack_latency_total_us = 0;
+static uint32_t ack_latency_max_us = 0;
+
+// Stream updates carry ack_required now and then, only to time the round
+// trip to the bulb
+static uint8_t probe_mac[6];
+static uint8_t probe_sequence = 0;
+static int64_t probe_sent_us = 0;
+static int64_t probe_acked_sent_us = 0;
+static int64_t probe_received_us = 0;
+static uint32_t stream_sent = 0;
+static uint32_t stream_rtt_us = 0;
+
+static TaskHandle_t scheduler_task = NULL;
+static uint32_t batches = 0;
+static uint32_t queue_max = 0;
+static uint32_t coalesced = 0;
+static uint32_t queue_full = 0;
+
+static void lifx_header_init(lifx_header_t *header, uint16_t size,
+                             uint16_t type) {
+  memset(header, 0, sizeof(*header));
+  header->size = size;
+  header->protocol = 1024;
+  header->addressable = 1;
+  header->source = source;
+  header->type = type;
 }
 
-void send_lifx_set_color(uint16_t hue, uint16_t saturation, uint16_t brightness,
-                         uint16_t kelvin, uint32_t duration) {
+static bool lifx_sendto(void *pkt, int size, const struct sockaddr_in *addr) {
+  return sendto(lifx_socket, pkt, size, 0, (struct sockaddr *)addr,
+                sizeof(*addr)) == size;
+}
+
+static bool lifx_broadcast(void *pkt, int size) {
+  auto header = (lifx_header_t *)pkt;
+  header->tagged = 1;
+  memset(header->target, 0, sizeof(header->target));
+  header->sequence = sequence.fetch_add(1);
+  return lifx_sendto(pkt, size, &lifx_addr);
+}
+
+static bool lifx_unicast(lifx_bulb_t *bulb, void *pkt, int size) {
+  auto header = (lifx_header_t *)pkt;
+  header->tagged = 0;
+  memset(header->target, 0, sizeof(header->target));
+  memcpy(header->target, bulb->state.mac, sizeof(bulb->state.mac));
+  header->sequence = sequence.fetch_add(1);
+  return lifx_sendto(pkt, size, &bulb->addr);
+}
+
+// Sends with ack_required and keeps a copy to retransmit until the bulb
+// acknowledges it. A command still in flight when another of the same type
+// goes to the same bulb is given up on, so a late retry can't undo the
+// newer one.
+static bool lifx_send_reliable(lifx_bulb_t *bulb, void *pkt, int size) {
+  auto header = (lifx_header_t *)pkt;
+  header->ack_required = 1;
+  if (size > LIFX_PACKET_MAX_SIZE || !lifx_unicast(bulb, pkt, size)) {
+    return false;
+  }
+  sent++;
+
+  lifx_inflight_t *slot = NULL;
+  for (auto &entry : inflight) {
+    auto other = (lifx_header_t *)entry.packet;
+    if (entry.used && other->type == header->type &&
+        memcmp(entry.mac, bulb->state.mac, sizeof(entry.mac)) == 0) {
+      entry.used = false;
+      superseded++;
+    }
+    if (!entry.used && slot == NULL) {
+      slot = &entry;
+    }
+  }
+
+  // With the table full, the oldest command is given up on
+  if (slot == NULL) {
+    slot = &inflight[0];
+    for (auto &entry : inflight) {
+      if (entry.sent_us < slot->sent_us) {
+        slot = &entry;
+      }
+    }
+    lost++;
+  }
+
+  auto now_us = esp_timer_get_time();
+  slot->used = true;
+  memcpy(slot->mac, bulb->state.mac, sizeof(slot->mac));
+  slot->addr = bulb->addr;
+  memcpy(slot->packet, pkt, size);
+  slot->size = size;
+  slot->sent_us = now_us;
+  slot->retried_us = now_us;
+  slot->retries = 0;
+  return true;
+}
+
+static void lifx_handle_ack(const lifx_header_t *header) {
+  if (probe_sent_us != 0 && header->sequence == probe_sequence &&
+      memcmp(probe_mac, header->target, sizeof(probe_mac)) == 0) {
+    auto now_us = esp_timer_get_time();
+    auto rtt_us = (uint32_t)(now_us - probe_sent_us);
+    stream_rtt_us = stream_rtt_us == 0 ? rtt_us
+                                       : (stream_rtt_us * 7 + rtt_us) / 8;
+    probe_acked_sent_us = probe_sent_us;
+    probe_received_us = now_us - rtt_us / 2;
+    probe_sent_us = 0;
+    return;
+  }
+
+  for (auto &entry : inflight) {
+    auto sent_header = (lifx_header_t *)entry.packet;
+    if (!entry.used || sent_header->sequence != header->sequence ||
+        memcmp(entry.mac, header->target, sizeof(entry.mac)) != 0) {
+      continue;
+    }
+
+    entry.used = false;
+    auto latency_us = (uint32_t)(esp_timer_get_time() - entry.sent_us);
+    acked++;
+    ack_latency_total_us += latency_us;
+    if (latency_us > ack_latency_max_us) {
+      ack_latency_max_us = latency_us;
+    }
+    return;
+  }
+}
+
+// Resends whatever has gone unacknowledged for too long, and returns how
+// long until the next retry is due
+static int64_t lifx_retransmit(int64_t now_us) {
+  int64_t next_us = LIFX_RECEIVE_TIMEOUT_MS * 1000LL;
+  xSemaphoreTake(bulbs_mutex, portMAX_DELAY);
+  for (auto &entry : inflight) {
+    if (!entry.used) {
+      continue;
+    }
+
+    auto due_us = entry.retried_us + CONFIG_REFLECT_LIFX_RETRY_MS * 1000LL;
+    if (now_us >= due_us) {
+      if (entry.retries == CONFIG_REFLECT_LIFX_RETRIES) {
+        ESP_LOGW(LOG_TAG, "No acknowledgement after %d retries",
+                 entry.retries);
+        entry.used = false;
+        lost++;
+        continue;
+      }
+      lifx_sendto(entry.packet, entry.size, &entry.addr);
+      entry.retries++;
+      entry.retried_us = now_us;
+      retransmits++;
+      due_us = now_us + CONFIG_REFLECT_LIFX_RETRY_MS * 1000LL;
+    }
+    if (due_us - now_us < next_us) {
+      next_us = due_us - now_us;
+    }
+  }
+  xSemaphoreGive(bulbs_mutex);
+  return next_us;
+}
+
+// Whether commands are meant for this bulb
+static bool lifx_targeted(const lifx_bulb_t *bulb) {
+  return strlen(CONFIG_REFLECT_LIFX_GROUP) == 0 ||
+         strcmp(bulb->state.group, CONFIG_REFLECT_LIFX_GROUP) == 0;
+}
+
+static size_t lifx_queued() {
+  size_t queued = 0;
+  for (size_t i = 0; i < bulb_count; i++) {
+    queued += bulbs[i].queued;
+  }
+  return queued;
+}
+
+// Queues a command for a bulb behind everything already queued. A queued
+// command of the same type is superseded: it is taken out rather than
+// overwritten, so commands still go out in the order they were made and
+// batches stay in order along the queue.
+static bool lifx_enqueue(lifx_bulb_t *bulb, void *pkt, int size,
+                         uint32_t batch, uint32_t batch_size) {
+  auto type = ((lifx_header_t *)pkt)->type;
+  for (size_t i = 0; i < bulb->queued; i++) {
+    if (((lifx_header_t *)bulb->queue[i].packet)->type == type) {
+      bulb->queued--;
+      memmove(&bulb->queue[i], &bulb->queue[i + 1],
+              (bulb->queued - i) * sizeof(lifx_command_t));
+      coalesced++;
+      break;
+    }
+  }
+
+  if (bulb->queued == LIFX_QUEUE_DEPTH) {
+    queue_full++;
+    return false;
+  }
+  auto command = &bulb->queue[bulb->queued++];
+
+  memcpy(command->packet, pkt, size);
+  command->size = size;
+  command->batch = batch;
+  command->batch_size = batch_size;
+
+  auto queued = lifx_queued();
+  if (queued > queue_max) {
+    queue_max = queued;
+  }
+  return true;
+}
+
+// Queues a command for every targeted bulb, or broadcasts it while no bulb
+// at all has been discovered yet. Once there are bulbs a broadcast would
+// also reach the ones outside CONFIG_REFLECT_LIFX_GROUP, so a command none
+// of them is targeted by fails instead. The bulbs' cached state is updated
+// right away; the scheduler task does the sending.
+static bool send_lifx_pkt(void *pkt, int size,
+                          void (*update)(reflect_lifx_bulb_t *, void *)) {
+  if (size > LIFX_COMMAND_MAX_SIZE) {
+    return false;
+  }
+
+  xSemaphoreTake(bulbs_mutex, portMAX_DELAY);
+  auto discovered = bulb_count;
+  uint32_t targeted = 0;
+  for (size_t i = 0; i < bulb_count; i++) {
+    targeted += lifx_targeted(&bulbs[i]);
+  }
+
+  bool queued = false;
+  auto batch = ++batches;
+  for (size_t i = 0; i < bulb_count; i++) {
+    if (lifx_targeted(&bulbs[i]) &&
+        lifx_enqueue(&bulbs[i], pkt, size, batch, targeted)) {
+      queued = true;
+      update(&bulbs[i].state, pkt);
+    }
+  }
+  xSemaphoreGive(bulbs_mutex);
+
+  if (discovered == 0) {
+    return lifx_broadcast(pkt, size);
+  }
+  if (targeted == 0) {
+    ESP_LOGW(LOG_TAG, "No bulb in group %s", CONFIG_REFLECT_LIFX_GROUP);
+    return false;
+  }
+  if (queued && scheduler_task != NULL) {
+    xTaskNotifyGive(scheduler_task);
+  }
+  return queued;
+}
+
+// When a batch can go out: once every bulb it waits at the head of is
+// allowed to send again. Bulbs that have it further back don't hold it up.
+static int64_t lifx_batch_ready_us(uint32_t batch) {
+  int64_t ready_us = 0;
+  for (size_t i = 0; i < bulb_count; i++) {
+    if (bulbs[i].queued > 0 && bulbs[i].queue[0].batch == batch &&
+        bulbs[i].next_send_us > ready_us) {
+      ready_us = bulbs[i].next_send_us;
+    }
+  }
+  return ready_us;
+}
+
+// Stamps changes going to several bulbs with a common time to apply them.
+// That needs a wall clock, so without one at_time stays 0 (now).
+static uint64_t lifx_at_time(const lifx_command_t *command) {
+  struct timeval now;
+  gettimeofday(&now, NULL);
+  if (command->batch_size < 2 || CONFIG_REFLECT_LIFX_SYNC_MS == 0 ||
+      now.tv_sec < LIFX_CLOCK_VALID_S) {
+    return 0;
+  }
+  return ((uint64_t)now.tv_sec * 1000000 + now.tv_usec +
+          CONFIG_REFLECT_LIFX_SYNC_MS * 1000ULL) *
+         1000;
+}
+
+// Sends every queued command whose bulb is within its rate limit, and
+// returns how long until the next one may go (-1 when nothing is queued)
+static int64_t lifx_schedule(int64_t now_us) {
+  int64_t wait_us = -1;
+  xSemaphoreTake(bulbs_mutex, portMAX_DELAY);
+  for (size_t i = 0; i < bulb_count; i++) {
+    auto bulb = &bulbs[i];
+    if (bulb->queued == 0) {
+      continue;
+    }
+
+    auto command = &bulb->queue[0];
+    auto ready_us = lifx_batch_ready_us(command->batch);
+    if (ready_us > now_us) {
+      if (wait_us < 0 || ready_us - now_us < wait_us) {
+        wait_us = ready_us - now_us;
+      }
+      continue;
+    }
+
+    ((lifx_header_t *)command->packet)->at_time = lifx_at_time(command);
+#if CONFIG_REFLECT_LIFX_RELIABLE
+    lifx_send_reliable(bulb, command->packet, command->size);
+#else
+    lifx_unicast(bulb, command->packet, command->size);
+#endif
+    bulb->next_send_us = now_us + 1000000 / CONFIG_REFLECT_LIFX_RATE_LIMIT;
+    bulb->queued--;
+    memmove(&bulb->queue[0], &bulb->queue[1],
+            bulb->queued * sizeof(lifx_command_t));
+    if (bulb->queued > 0) {
+      auto next_us = bulb->next_send_us - now_us;
+      if (wait_us < 0 || next_us < wait_us) {
+        wait_us = next_us;
+      }
+    }
+  }
+  xSemaphoreGive(bulbs_mutex);
+  return wait_us;
+}
+
+static void lifx_scheduler_task(void *) {
+  while (true) {
+    auto wait_us = lifx_schedule(esp_timer_get_time());
+    auto wait_ticks = wait_us < 0 ? portMAX_DELAY
+                                  : pdMS_TO_TICKS((wait_us + 999) / 1000);
+    ulTaskNotifyTake(pdTRUE, wait_ticks > 0 ? wait_ticks : 1);
+  }
+}
+
+// Sends every targeted bulb that is on and within its rate limit its cached
+// color, with the brightness scaled (65535 is unchanged) and the hue
+// shifted, ahead of anything queued. Meant for updates that are stale as
+// soon as the next one is due, so nothing is retried, queued or broadcast,
+// and the cached state stays as it was. With probe set, the first bulb is
+// asked to acknowledge so the round trip can be timed.
+bool send_lifx_stream(uint16_t brightness_scale, int16_t hue_shift,
+                      uint32_t duration, bool probe) {
   lifx_set_color_t pkt;
   memset(&pkt, 0, sizeof(pkt));
+  lifx_header_init(&pkt.header, sizeof(pkt), LIFX_SET_COLOR);
+  pkt.duration = duration;
 
-  pkt.header.size = sizeof(pkt);
-  pkt.header.protocol = 1024;
-  pkt.header.addressable = 1;
-  pkt.header.tagged = 0;
-  pkt.header.origin = 0;
-  pkt.header.source = 0x12345678;
-  memset(pkt.header.target, 0, sizeof(pkt.header.target)); // use MAC if known
-  pkt.header.sequence = 1;
-  pkt.header.type = 102;
+  auto now_us = esp_timer_get_time();
+  bool sent_any = false;
+  xSemaphoreTake(bulbs_mutex, portMAX_DELAY);
+  // A probe that was never answered is given up on after a second
+  if (probe_sent_us != 0 && now_us - probe_sent_us > 1000000) {
+    probe_sent_us = 0;
+  }
+  for (size_t i = 0; i < bulb_count; i++) {
+    auto bulb = &bulbs[i];
+    if (!lifx_targeted(bulb) || !bulb->state.power ||
+        bulb->next_send_us > now_us) {
+      continue;
+    }
+
+    pkt.hue = (uint16_t)(bulb->state.hue + hue_shift);
+    pkt.saturation = bulb->state.saturation;
+    pkt.brightness =
+        (uint16_t)((uint32_t)bulb->state.brightness * brightness_scale / 65535);
+    pkt.kelvin = bulb->state.kelvin;
+    auto probing = probe && !sent_any && probe_sent_us == 0;
+    pkt.header.ack_required = probing;
+    if (!lifx_unicast(bulb, &pkt, sizeof(pkt))) {
+      continue;
+    }
+    if (probing) {
+      memcpy(probe_mac, bulb->state.mac, sizeof(probe_mac));
+      probe_sequence = pkt.header.sequence;
+      probe_sent_us = now_us;
+    }
+    bulb->next_send_us = now_us + 1000000 / CONFIG_REFLECT_LIFX_RATE_LIMIT;
+    stream_sent++;
+    sent_any = true;
+  }
+  xSemaphoreGive(bulbs_mutex);
+  return sent_any;
+}
+
+// When the last acknowledged stream probe was sent, and when the bulb got
+// it (half its round trip before the ack). False until one is acknowledged.
+bool reflect_lifx_stream_probe(int64_t *sent_us, int64_t *received_us) {
+  xSemaphoreTake(bulbs_mutex, portMAX_DELAY);
+  *sent_us = probe_acked_sent_us;
+  *received_us = probe_received_us;
+  xSemaphoreGive(bulbs_mutex);
+  return *sent_us != 0;
+}
+
+// Queues every targeted bulb's cached color, to undo stream updates
+bool send_lifx_restore(uint32_t duration) {
+  lifx_set_color_t pkt;
+  memset(&pkt, 0, sizeof(pkt));
+  lifx_header_init(&pkt.header, sizeof(pkt), LIFX_SET_COLOR);
+  pkt.duration = duration;
+
+  xSemaphoreTake(bulbs_mutex, portMAX_DELAY);
+  bool queued = false;
+  for (size_t i = 0; i < bulb_count; i++) {
+    auto bulb = &bulbs[i];
+    if (!lifx_targeted(bulb)) {
+      continue;
+    }
+    pkt.hue = bulb->state.hue;
+    pkt.saturation = bulb->state.saturation;
+    pkt.brightness = bulb->state.brightness;
+    pkt.kelvin = bulb->state.kelvin;
+    // Colors differ per bulb, so each is a batch of its own and goes out
+    // without waiting for the others
+    queued |= lifx_enqueue(bulb, &pkt, sizeof(pkt), ++batches, 1);
+  }
+  xSemaphoreGive(bulbs_mutex);
+
+  if (queued && scheduler_task != NULL) {
+    xTaskNotifyGive(scheduler_task);
+  }
+  return queued;
+}
+
+static void update_color(reflect_lifx_bulb_t *state, void *pkt) {
+  auto color = (lifx_set_color_t *)pkt;
+  state->hue = color->hue;
+  state->saturation = color->saturation;
+  state->brightness = color->brightness;
+  state->kelvin = color->kelvin;
+}
+
+static void update_power(reflect_lifx_bulb_t *state, void *pkt) {
+  state->power = ((lifx_set_power_t *)pkt)->level != 0;
+}
+
+// A waveform ends on its original color unless it isn't transient
+static void update_waveform(reflect_lifx_bulb_t *state, void *pkt) {
+  auto waveform = (lifx_set_waveform_t *)pkt;
+  if (!waveform->transient) {
+    state->hue = waveform->hue;
+    state->saturation = waveform->saturation;
+    state->brightness = waveform->brightness;
+    state->kelvin = waveform->kelvin;
+  }
+}
+
+static void update_waveform_optional(reflect_lifx_bulb_t *state, void *pkt) {
+  auto optional = (lifx_set_waveform_optional_t *)pkt;
+  auto waveform = &optional->waveform;
+  if (waveform->transient) {
+    return;
+  }
+  if (optional->set_hue) {
+    state->hue = waveform->hue;
+  }
+  if (optional->set_saturation) {
+    state->saturation = waveform->saturation;
+  }
+  if (optional->set_brightness) {
+    state->brightness = waveform->brightness;
+  }
+  if (optional->set_kelvin) {
+    state->kelvin = waveform->kelvin;
+  }
+}
+
+bool send_lifx_set_color(uint16_t hue, uint16_t saturation, uint16_t brightness,
+                         uint16_t kelvin, uint32_t duration) {
+  lifx_set_color_t pkt;
+  memset(&pkt, 0, sizeof(pkt));
+  lifx_header_init(&pkt.header, sizeof(pkt), LIFX_SET_COLOR);
 
   pkt.reserved = 0;
   pkt.hue = hue;
@@ -91,28 +674,16 @@ void send_lifx_set_color(uint16_t hue, uint16_t saturation, uint16_t brightness,
   pkt.kelvin = kelvin;
   pkt.duration = duration;
 
-  send_lifx_pkt(&pkt, sizeof(pkt));
+  return send_lifx_pkt(&pkt, sizeof(pkt), update_color);
 }
 
-void send_lifx_set_waveform(bool transient, uint16_t hue, uint16_t saturation,
+bool send_lifx_set_waveform(bool transient, uint16_t hue, uint16_t saturation,
                             uint16_t brightness, uint16_t kelvin,
                             uint32_t period, float cycles, int16_t skew_ratio,
                             uint8_t waveform) {
   lifx_set_waveform_t pkt;
   memset(&pkt, 0, sizeof(pkt));
-
-  pkt.header.size = sizeof(pkt);
-  pkt.header.protocol = 1024;
-  pkt.header.addressable = 1;
-  pkt.header.tagged = 0;
-  pkt.header.origin = 0;
-  pkt.header.source = 0x12345678;
-  memset(pkt.header.target, 0, sizeof(pkt.header.target));
-  pkt.header.res_required = 0;
-  pkt.header.ack_required = 0;
-  pkt.header.sequence = 1;
-  pkt.header.at_time = 0;
-  pkt.header.type = 103;
+  lifx_header_init(&pkt.header, sizeof(pkt), LIFX_SET_WAVEFORM);
 
   pkt.reserved6 = 0;
   pkt.transient = transient;
@@ -125,32 +696,371 @@ void send_lifx_set_waveform(bool transient, uint16_t hue, uint16_t saturation,
   pkt.skew_ratio = skew_ratio;
   pkt.waveform = waveform;
 
-  send_lifx_pkt(&pkt, sizeof(pkt));
+  return send_lifx_pkt(&pkt, sizeof(pkt), update_waveform);
 }
 
-void send_lifx_set_power(int on, uint32_t duration) {
-  lifx_set_power_t pkt;
+// Like SetWaveform, but only the components whose bit is set in components
+// (REFLECT_LIFX_HUE and so on) change; the rest keep the bulb's own values
+bool send_lifx_set_waveform_optional(bool transient, uint16_t hue,
+                                     uint16_t saturation, uint16_t brightness,
+                                     uint16_t kelvin, uint32_t period,
+                                     float cycles, int16_t skew_ratio,
+                                     uint8_t waveform, uint8_t components) {
+  lifx_set_waveform_optional_t pkt;
   memset(&pkt, 0, sizeof(pkt));
+  lifx_header_init(&pkt.waveform.header, sizeof(pkt),
+                   LIFX_SET_WAVEFORM_OPTIONAL);
 
-  pkt.header.size = sizeof(pkt);
-  pkt.header.protocol = 1024;
-  pkt.header.addressable = 1;
-  pkt.header.tagged = 0;
-  pkt.header.origin = 0;
-  pkt.header.source = 0x12345678;
-  memset(pkt.header.target, 0, sizeof(pkt.header.target));
-  pkt.header.res_required = 0;
-  pkt.header.ack_required = 0;
-  pkt.header.sequence = 1;
-  pkt.header.at_time = 0;
-  pkt.header.type = 21;
+  pkt.waveform.transient = transient;
+  pkt.waveform.hue = hue;
+  pkt.waveform.saturation = saturation;
+  pkt.waveform.brightness = brightness;
+  pkt.waveform.kelvin = kelvin;
+  pkt.waveform.period = period;
+  pkt.waveform.cycles = cycles;
+  pkt.waveform.skew_ratio = skew_ratio;
+  pkt.waveform.waveform = waveform;
+  pkt.set_hue = (components & REFLECT_LIFX_HUE) != 0;
+  pkt.set_saturation = (components & REFLECT_LIFX_SATURATION) != 0;
+  pkt.set_brightness = (components & REFLECT_LIFX_BRIGHTNESS) != 0;
+  pkt.set_kelvin = (components & REFLECT_LIFX_KELVIN) != 0;
+
+  return send_lifx_pkt(&pkt, sizeof(pkt), update_waveform_optional);
+}
+
+bool send_lifx_set_power(int on, uint32_t duration) {
+  lifx_set_power_t pkt;
+  memset(&pkt, 0, sizeof(pkt));
+  lifx_header_init(&pkt.header, sizeof(pkt), LIFX_SET_LIGHT_POWER);
   pkt.level = on ? 65535 : 0;
   pkt.duration = duration;
 
-  send_lifx_pkt(&pkt, sizeof(pkt));
+  return send_lifx_pkt(&pkt, sizeof(pkt), update_power);
+}
+
+// Copies a label the bulb reports, keeping it safe to drop into JSON
+static void copy_label(char *out, const char *label) {
+  size_t i = 0;
+  for (; i < REFLECT_LIFX_LABEL_SIZE - 1 && label[i] != '\0'; i++) {
+    auto c = label[i];
+    out[i] = c < 0x20 || c == '"' || c == '\\' ? '?' : c;
+  }
+  out[i] = '\0';
+}
+
+static void lifx_query(lifx_bulb_t *bulb, uint16_t type) {
+  lifx_header_t header;
+  lifx_header_init(&header, sizeof(header), type);
+  header.res_required = 1;
+  lifx_unicast(bulb, &header, sizeof(header));
+}
+
+static lifx_bulb_t *lifx_find(const uint8_t *target) {
+  for (size_t i = 0; i < bulb_count; i++) {
+    if (memcmp(bulbs[i].state.mac, target, sizeof(bulbs[i].state.mac)) == 0) {
+      return &bulbs[i];
+    }
+  }
+  return NULL;
+}
+
+static void lifx_handle_service(const lifx_header_t *header,
+                                const lifx_state_service_t *service,
+                                const struct sockaddr_in *from) {
+  if (service->service != LIFX_SERVICE_UDP) {
+    return;
+  }
+
+  auto bulb = lifx_find(header->target);
+  if (bulb == NULL) {
+    if (bulb_count == LIFX_MAX_BULBS) {
+      return;
+    }
+    bulb = &bulbs[bulb_count++];
+    memset(bulb, 0, sizeof(*bulb));
+    memcpy(bulb->state.mac, header->target, sizeof(bulb->state.mac));
+    ESP_LOGI(LOG_TAG, "Found bulb %02x:%02x:%02x:%02x:%02x:%02x at %s",
+             bulb->state.mac[0], bulb->state.mac[1], bulb->state.mac[2],
+             bulb->state.mac[3], bulb->state.mac[4], bulb->state.mac[5],
+             inet_ntoa(from->sin_addr));
+  }
+
+  bulb->addr = *from;
+  bulb->addr.sin_port = htons(service->port);
+  bulb->seen_us = esp_timer_get_time();
+
+  // Label, color and power come in one reply, the group in another
+  lifx_query(bulb, LIFX_GET);
+  lifx_query(bulb, LIFX_GET_GROUP);
+}
+
+static void lifx_handle(const uint8_t *packet, size_t size,
+                        const struct sockaddr_in *from) {
+  auto header = (const lifx_header_t *)packet;
+  auto payload = packet + sizeof(lifx_header_t);
+  auto payload_size = size - sizeof(lifx_header_t);
+  if (header->source != source || header->size != size) {
+    return;
+  }
+
+  xSemaphoreTake(bulbs_mutex, portMAX_DELAY);
+  if (header->type == LIFX_STATE_SERVICE &&
+      payload_size >= sizeof(lifx_state_service_t)) {
+    lifx_handle_service(header, (const lifx_state_service_t *)payload, from);
+    xSemaphoreGive(bulbs_mutex);
+    return;
+  }
+
+  if (header->type == LIFX_ACKNOWLEDGEMENT) {
+    lifx_handle_ack(header);
+  }
+
+  auto bulb = lifx_find(header->target);
+  if (bulb == NULL) {
+    xSemaphoreGive(bulbs_mutex);
+    return;
+  }
+
+  auto now_us = esp_timer_get_time();
+  bulb->seen_us = now_us;
+  if (header->type == LIFX_LIGHT_STATE &&
+      payload_size >= sizeof(lifx_light_state_t)) {
+    auto light = (const lifx_light_state_t *)payload;
+    bulb->state.hue = light->hue;
+    bulb->state.saturation = light->saturation;
+    bulb->state.brightness = light->brightness;
+    bulb->state.kelvin = light->kelvin;
+    bulb->state.power = light->power != 0;
+    bulb->state.reported_us = now_us;
+    char label[sizeof(light->label) + 1] = {};
+    memcpy(label, light->label, sizeof(light->label));
+    copy_label(bulb->state.label, label);
+  } else if (header->type == LIFX_STATE_GROUP &&
+             payload_size >= sizeof(lifx_state_group_t)) {
+    auto group = (const lifx_state_group_t *)payload;
+    char label[sizeof(group->label) + 1] = {};
+    memcpy(label, group->label, sizeof(group->label));
+    copy_label(bulb->state.group, label);
+  }
+  xSemaphoreGive(bulbs_mutex);
+}
+
+// Asks every bulb on the network to announce itself, and forgets those that
+// have stopped answering
+static void lifx_discover() {
+  lifx_header_t header;
+  lifx_header_init(&header, sizeof(header), LIFX_GET_SERVICE);
+  header.res_required = 1;
+  lifx_broadcast(&header, sizeof(header));
+#if CONFIG_REFLECT_LIFX_LOOPBACK_BULB
+  // Broadcasts don't loop back, so the stand-in is asked directly
+  struct sockaddr_in loopback = lifx_addr;
+  loopback.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  lifx_sendto(&header, sizeof(header), &loopback);
+#endif
+
+  auto stale_us = esp_timer_get_time() -
+                  LIFX_STALE_ROUNDS * CONFIG_REFLECT_LIFX_DISCOVERY_INTERVAL *
+                      1000000LL;
+  xSemaphoreTake(bulbs_mutex, portMAX_DELAY);
+  for (size_t i = 0; i < bulb_count;) {
+    if (bulbs[i].seen_us < stale_us) {
+      ESP_LOGI(LOG_TAG, "Lost bulb %s", bulbs[i].state.label);
+      bulbs[i] = bulbs[--bulb_count];
+    } else {
+      i++;
+    }
+  }
+  xSemaphoreGive(bulbs_mutex);
+}
+
+static void log_lifx_stats() {
+  reflect_lifx_stats_t stats;
+  reflect_lifx_stats(&stats);
+  ESP_LOGI(LOG_TAG,
+           "sent(%" PRIu32 ") acked(%" PRIu32 ") retransmits(%" PRIu32
+           ") lost(%" PRIu32 ") superseded(%" PRIu32 ") ack_avg_us(%" PRIu32
+           ") ack_max_us(%" PRIu32 ")",
+           stats.sent, stats.acked, stats.retransmits, stats.lost,
+           stats.superseded, stats.ack_latency_avg_us,
+           stats.ack_latency_max_us);
+  ESP_LOGI(LOG_TAG,
+           "queued(%" PRIu32 ") queue_max(%" PRIu32 ") coalesced(%" PRIu32
+           ") queue_full(%" PRIu32 ") stream_sent(%" PRIu32
+           ") stream_rtt_us(%" PRIu32 ")",
+           stats.queued, stats.queue_max, stats.coalesced, stats.queue_full,
+           stats.stream_sent, stats.stream_rtt_us);
+}
+
+static void lifx_task(void *) {
+  int64_t discovered_us = 0;
+  int64_t last_stats_us = esp_timer_get_time();
+  uint8_t packet[LIFX_PACKET_MAX_SIZE];
+
+  while (true) {
+    auto now_us = esp_timer_get_time();
+    if (discovered_us == 0 ||
+        now_us - discovered_us >=
+            CONFIG_REFLECT_LIFX_DISCOVERY_INTERVAL * 1000000LL) {
+      lifx_discover();
+      discovered_us = now_us;
+    }
+
+    auto timeout_us = lifx_retransmit(now_us);
+    struct timeval timeout = {
+        .tv_sec = (time_t)(timeout_us / 1000000),
+        .tv_usec = (suseconds_t)(timeout_us % 1000000),
+    };
+    fd_set readable;
+    FD_ZERO(&readable);
+    FD_SET(lifx_socket, &readable);
+    if (select(lifx_socket + 1, &readable, NULL, NULL, &timeout) > 0) {
+      struct sockaddr_in from;
+      socklen_t from_size = sizeof(from);
+      auto size = recvfrom(lifx_socket, packet, sizeof(packet), 0,
+                           (struct sockaddr *)&from, &from_size);
+      if (size >= (int)sizeof(lifx_header_t)) {
+        lifx_handle(packet, size, &from);
+      }
+    }
+
+    if (CONFIG_REFLECT_STATS_INTERVAL > 0 &&
+        now_us - last_stats_us >= CONFIG_REFLECT_STATS_INTERVAL * 1000000LL) {
+      log_lifx_stats();
+      last_stats_us = now_us;
+    }
+  }
+}
+
+void reflect_lifx_stats(reflect_lifx_stats_t *stats) {
+  xSemaphoreTake(bulbs_mutex, portMAX_DELAY);
+  stats->sent = sent;
+  stats->acked = acked;
+  stats->retransmits = retransmits;
+  stats->lost = lost;
+  stats->superseded = superseded;
+  stats->ack_latency_avg_us =
+      acked == 0 ? 0 : (uint32_t)(ack_latency_total_us / acked);
+  stats->ack_latency_max_us = ack_latency_max_us;
+  stats->queued = lifx_queued();
+  stats->queue_max = queue_max;
+  stats->coalesced = coalesced;
+  stats->queue_full = queue_full;
+  stats->stream_sent = stream_sent;
+  stats->stream_rtt_us = stream_rtt_us;
+  xSemaphoreGive(bulbs_mutex);
+}
+
+#if CONFIG_REFLECT_LIFX_LOOPBACK_BULB
+// A stand-in bulb on the loopback interface, for exercising discovery and
+// reliable delivery without hardware. It ignores a share of what it
+// receives so retransmits get exercised too.
+static const uint8_t kLoopbackMac[6] = {0xd0, 0x73, 0xd5, 0x00, 0x00, 0x01};
+static const char kLoopbackLabel[] = "Loopback";
+
+static void lifx_loopback_reply(int sock, const lifx_header_t *request,
+                                uint16_t type, const void *payload,
+                                size_t payload_size,
+                                const struct sockaddr_in *to) {
+  uint8_t packet[LIFX_PACKET_MAX_SIZE];
+  auto header = (lifx_header_t *)packet;
+  lifx_header_init(header, sizeof(lifx_header_t) + payload_size, type);
+  header->source = request->source;
+  header->sequence = request->sequence;
+  memcpy(header->target, kLoopbackMac, sizeof(kLoopbackMac));
+  if (payload_size > 0) {
+    memcpy(packet + sizeof(lifx_header_t), payload, payload_size);
+  }
+  sendto(sock, packet, header->size, 0, (struct sockaddr *)to, sizeof(*to));
+}
+
+static void lifx_loopback_task(void *) {
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(LIFX_PORT);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  auto sock = socket(AF_INET, SOCK_DGRAM, 0);
+  if (sock < 0 || bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+    ESP_LOGE(LOG_TAG, "Loopback bulb failed to bind");
+    vTaskDelete(NULL);
+    return;
+  }
+
+  lifx_light_state_t light;
+  memset(&light, 0, sizeof(light));
+  light.kelvin = 3500;
+  memcpy(light.label, kLoopbackLabel, sizeof(kLoopbackLabel));
+
+  uint8_t packet[LIFX_PACKET_MAX_SIZE];
+  while (true) {
+    struct sockaddr_in from;
+    socklen_t from_size = sizeof(from);
+    auto size = recvfrom(sock, packet, sizeof(packet), 0,
+                         (struct sockaddr *)&from, &from_size);
+    if (size < (int)sizeof(lifx_header_t) ||
+        esp_random() % 100 < CONFIG_REFLECT_LIFX_LOOPBACK_DROP_PERCENT) {
+      continue;
+    }
+
+    auto header = (const lifx_header_t *)packet;
+    if (header->type == LIFX_GET_SERVICE) {
+      lifx_state_service_t service = {LIFX_SERVICE_UDP, LIFX_PORT};
+      lifx_loopback_reply(sock, header, LIFX_STATE_SERVICE, &service,
+                          sizeof(service), &from);
+    } else if (header->type == LIFX_GET) {
+      lifx_loopback_reply(sock, header, LIFX_LIGHT_STATE, &light,
+                          sizeof(light), &from);
+    } else if (header->type == LIFX_GET_GROUP) {
+      lifx_state_group_t group;
+      memset(&group, 0, sizeof(group));
+      memcpy(group.label, kLoopbackLabel, sizeof(kLoopbackLabel));
+      lifx_loopback_reply(sock, header, LIFX_STATE_GROUP, &group,
+                          sizeof(group), &from);
+    } else if (header->type == LIFX_SET_COLOR &&
+               size >= (int)sizeof(lifx_set_color_t)) {
+      auto color = (const lifx_set_color_t *)packet;
+      light.hue = color->hue;
+      light.saturation = color->saturation;
+      light.brightness = color->brightness;
+      light.kelvin = color->kelvin;
+    } else if (header->type == LIFX_SET_LIGHT_POWER &&
+               size >= (int)sizeof(lifx_set_power_t)) {
+      light.power = ((const lifx_set_power_t *)packet)->level;
+    }
+
+    if (header->ack_required) {
+      lifx_loopback_reply(sock, header, LIFX_ACKNOWLEDGEMENT, NULL, 0, &from);
+    }
+  }
+}
+#endif
+
+// Copies out the cached state of the targeted bulbs, returning how many
+// there are
+size_t reflect_lifx_bulbs(reflect_lifx_bulb_t *out, size_t count) {
+  size_t found = 0;
+  xSemaphoreTake(bulbs_mutex, portMAX_DELAY);
+  for (size_t i = 0; i < bulb_count; i++) {
+    if (!lifx_targeted(&bulbs[i])) {
+      continue;
+    }
+    if (found < count) {
+      out[found] = bulbs[i].state;
+    }
+    found++;
+  }
+  xSemaphoreGive(bulbs_mutex);
+  return found;
 }
 
 void reflect_lifx() {
+  bulbs_mutex = xSemaphoreCreateMutex();
+  assert(bulbs_mutex != nullptr);
+  do {
+    source = esp_random();
+  } while (source <= 1);
+
   lifx_addr.sin_family = AF_INET;
   lifx_addr.sin_port = htons(LIFX_PORT);
   lifx_socket = socket(AF_INET, SOCK_DGRAM, 0);
@@ -166,4 +1076,14 @@ void reflect_lifx() {
 
   inet_pton(AF_INET, BROADCAST_IP, &lifx_addr.sin_addr);
   send_lifx_set_power(false, 5000);
+
+#if CONFIG_REFLECT_LIFX_LOOPBACK_BULB
+  xTaskCreate(lifx_loopback_task, "lifx_loopback", LIFX_TASK_STACK_SIZE, NULL,
+              LIFX_TASK_PRIORITY, NULL);
+#endif
+  xTaskCreate(lifx_task, "lifx", LIFX_TASK_STACK_SIZE, NULL,
+              LIFX_TASK_PRIORITY, NULL);
+  xTaskCreate(lifx_scheduler_task, "lifx_scheduler",
+              LIFX_SCHEDULER_TASK_STACK_SIZE, NULL,
+              LIFX_SCHEDULER_TASK_PRIORITY, &scheduler_task);
 }
@@ -0,0 +1,190 @@
+#include <atomic>
+#include <cinttypes>
+#include <esp_timer.h>
+#include <esp_vfs_eventfd.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <lwip/sockets.h>
+
+#include "reflect.hpp"
+
+#define LOG_TAG "peer_loop"
+
+#define POLL_INTERVAL_MS 1
+
+static std::atomic<bool> connected{false};
+static int wake_fd = -1;
+
+static uint32_t wakeups = 0;
+static uint32_t socket_wakeups = 0;
+static uint32_t send_wakeups = 0;
+static uint32_t timer_wakeups = 0;
+static uint32_t select_errors = 0;
+
+#if CONFIG_REFLECT_PEER_LOOP_EVENT
+static std::atomic<bool> rescan{false};
+
+// libpeer keeps its ICE/DTLS sockets to itself. They are found by scanning
+// lwIP's socket table for UDP sockets that didn't exist before the
+// PeerConnection did (the LIFX socket, for one).
+static fd_set foreign_sockets;
+static fd_set peer_sockets;
+static int max_peer_socket = -1;
+
+static bool is_udp_socket(int fd) {
+  int type = 0;
+  socklen_t length = sizeof(type);
+  return getsockopt(fd, SOL_SOCKET, SO_TYPE, &type, &length) == 0 &&
+         type == SOCK_DGRAM;
+}
+
+static void find_peer_sockets() {
+  FD_ZERO(&peer_sockets);
+  max_peer_socket = -1;
+
+  for (int fd = LWIP_SOCKET_OFFSET;
+       fd < LWIP_SOCKET_OFFSET + CONFIG_LWIP_MAX_SOCKETS; fd++) {
+    if (!FD_ISSET(fd, &foreign_sockets) && is_udp_socket(fd)) {
+      FD_SET(fd, &peer_sockets);
+      max_peer_socket = fd;
+    }
+  }
+
+  if (max_peer_socket < 0) {
+    ESP_LOGW(LOG_TAG, "No PeerConnection sockets, waking on timer only");
+  }
+}
+
+static void wait_for_activity() {
+  if (rescan.exchange(false)) {
+    find_peer_sockets();
+  }
+
+  fd_set readable = peer_sockets;
+  FD_SET(wake_fd, &readable);
+  auto max_fd = max_peer_socket > wake_fd ? max_peer_socket : wake_fd;
+
+  struct timeval timeout = {
+      .tv_sec = CONFIG_REFLECT_PEER_LOOP_IDLE_MS / 1000,
+      .tv_usec = (CONFIG_REFLECT_PEER_LOOP_IDLE_MS % 1000) * 1000,
+  };
+  auto ready = select(max_fd + 1, &readable, NULL, NULL, &timeout);
+  if (ready < 0) {
+    // A socket went away under us; look again and poll in the meantime
+    select_errors++;
+    rescan = true;
+    vTaskDelay(pdMS_TO_TICKS(POLL_INTERVAL_MS));
+    return;
+  }
+
+  if (ready == 0) {
+    timer_wakeups++;
+    return;
+  }
+
+  if (FD_ISSET(wake_fd, &readable)) {
+    uint64_t count = 0;
+    read(wake_fd, &count, sizeof(count));
+    send_wakeups++;
+    ready--;
+  }
+  if (ready > 0) {
+    socket_wakeups++;
+  }
+}
+#endif
+
+void reflect_peer_loop_init() {
+#if CONFIG_REFLECT_PEER_LOOP_EVENT
+  FD_ZERO(&foreign_sockets);
+  for (int fd = LWIP_SOCKET_OFFSET;
+       fd < LWIP_SOCKET_OFFSET + CONFIG_LWIP_MAX_SOCKETS; fd++) {
+    if (is_udp_socket(fd)) {
+      FD_SET(fd, &foreign_sockets);
+    }
+  }
+
+  esp_vfs_eventfd_config_t config = ESP_VFS_EVENTD_CONFIG_DEFAULT();
+  ESP_ERROR_CHECK(esp_vfs_eventfd_register(&config));
+  wake_fd = eventfd(0, 0);
+  assert(wake_fd >= 0);
+#endif
+}
+
+// Sockets only exist once ICE has picked a pair, and the loop only has timer
+// driven work left (keepalives) once DTLS is done. Until then it polls.
+void reflect_peer_loop_connected(bool is_connected) {
+#if CONFIG_REFLECT_PEER_LOOP_EVENT
+  if (is_connected) {
+    rescan = true;
+  }
+#endif
+  connected = is_connected;
+}
+
+// libpeer queues outgoing audio and data channel messages for
+// peer_connection_loop to send, so queuing one has to wake the loop
+void reflect_peer_loop_wake() {
+  if (wake_fd >= 0) {
+    uint64_t count = 1;
+    write(wake_fd, &count, sizeof(count));
+  }
+}
+
+void reflect_peer_loop_stats(reflect_peer_loop_stats_t *stats) {
+  stats->wakeups = wakeups;
+  stats->socket_wakeups = socket_wakeups;
+  stats->send_wakeups = send_wakeups;
+  stats->timer_wakeups = timer_wakeups;
+  stats->select_errors = select_errors;
+}
+
+static void log_peer_loop_stats(int64_t elapsed_us) {
+  static uint32_t last_wakeups = 0;
+  reflect_peer_loop_stats_t stats;
+  reflect_peer_loop_stats(&stats);
+
+  auto per_second =
+      (uint32_t)((stats.wakeups - last_wakeups) * 1000000LL / elapsed_us);
+  last_wakeups = stats.wakeups;
+
+  ESP_LOGI(LOG_TAG,
+           "mode(%s) wakeups_per_sec(%" PRIu32 ") socket(%" PRIu32
+           ") send(%" PRIu32 ") timer(%" PRIu32 ") select_errors(%" PRIu32 ")",
+           connected && wake_fd >= 0 ? "event" : "poll", per_second,
+           stats.socket_wakeups, stats.send_wakeups, stats.timer_wakeups,
+           stats.select_errors);
+
+#if CONFIG_FREERTOS_GENERATE_RUN_TIME_STATS
+  // The run time counter ticks in esp_timer microseconds
+  static uint32_t last_idle[CONFIG_FREERTOS_NUMBER_OF_CORES] = {};
+  for (int core = 0; core < CONFIG_FREERTOS_NUMBER_OF_CORES; core++) {
+    auto idle = ulTaskGetRunTimeCounter(xTaskGetIdleTaskHandleForCore(core));
+    auto percent = (uint32_t)((idle - last_idle[core]) * 100LL / elapsed_us);
+    last_idle[core] = idle;
+    ESP_LOGI(LOG_TAG, "core(%d) idle_percent(%" PRIu32 ")", core, percent);
+  }
+#endif
+}
+
+// Called after every peer_connection_loop, returns once there may be work
+void reflect_peer_loop_wait() {
+#if CONFIG_REFLECT_PEER_LOOP_EVENT
+  if (connected) {
+    wait_for_activity();
+  } else {
+    vTaskDelay(pdMS_TO_TICKS(POLL_INTERVAL_MS));
+  }
+#else
+  vTaskDelay(pdMS_TO_TICKS(POLL_INTERVAL_MS));
+#endif
+  wakeups++;
+
+  static int64_t last_stats_us = esp_timer_get_time();
+  auto now_us = esp_timer_get_time();
+  if (CONFIG_REFLECT_STATS_INTERVAL > 0 &&
+      now_us - last_stats_us >= CONFIG_REFLECT_STATS_INTERVAL * 1000000LL) {
+    log_peer_loop_stats(now_us - last_stats_us);
+    last_stats_us = now_us;
+  }
+}
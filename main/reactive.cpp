@@ -0,0 +1,259 @@
+#include <atomic>
+#include <cinttypes>
+#include <cmath>
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+
+#include "reflect.hpp"
+#include "ring.hpp"
+
+#if CONFIG_REFLECT_REACTIVE
+
+#define LOG_TAG "reactive"
+
+#define REACTIVE_TASK_STACK_SIZE 4096
+#define REACTIVE_TASK_PRIORITY 6
+
+// Downlink frames are always 20ms
+#define FRAME_MS 20
+
+#define ENVELOPE_ATTACK_MS 30
+#define ENVELOPE_RELEASE_MS 200
+
+// Envelope levels from the playback threshold up this far span the
+// brightness range
+#define ENVELOPE_RANGE_DB 30.0f
+
+// Brightness at the bottom of the range, as a share of the bulb's own
+#define BRIGHTNESS_FLOOR 0.4f
+
+// Envelope points waiting to be shown, about 320ms worth, which covers
+// any audio delay the compensation can use
+#define PENDING_POINTS 16
+
+// Playback quiet for this long ends the mode and puts the bulbs back
+#define IDLE_MS 500
+
+// How often the round trip to the bulb is measured
+#define PROBE_INTERVAL_US 1000000
+
+// Every update fades over the interval until the next, so the bulb moves
+// smoothly instead of stepping
+#define SEND_INTERVAL_US (1000000 / CONFIG_REFLECT_LIFX_RATE_LIMIT)
+
+// A point of the envelope, when the audio it was measured on is heard and
+// when the light has to be sent to show it then
+typedef struct {
+  int64_t audible_us;
+  int64_t due_us;
+  float level;
+} envelope_point_t;
+
+static SpscRing<PENDING_POINTS> pending;
+static envelope_point_t pending_storage[PENDING_POINTS];
+static TaskHandle_t reactive_task = NULL;
+
+// Playout side
+static float envelope_db = 0;
+static float attack = 0;
+static float release = 0;
+
+// How long an update takes from being sent to showing on the bulb, half
+// the measured round trip plus half its fade
+static std::atomic<uint32_t> light_latency_us{SEND_INTERVAL_US / 2};
+
+static bool active = false;
+static int64_t last_loud_us = 0;
+static int64_t next_send_us = 0;
+static int64_t probe_us = 0;
+// When the sound the last probed update follows is heard, until the bulb's
+// ack for it is in
+static int64_t probe_audible_us = 0;
+static bool probe_measuring = false;
+static envelope_point_t latest;
+static bool latest_pending = false;
+
+static uint32_t frames = 0;
+static uint32_t dropped = 0;
+static uint32_t sent = 0;
+static uint32_t restores = 0;
+static float audio_to_light_us = 0;
+static int32_t audio_to_light_max_us = 0;
+
+// Called from playout right after a decoded frame was handed to the
+// speaker, with its level. Only follows the envelope and hands it on.
+void reflect_reactive_level(float level_db) {
+  if (reactive_task == NULL) {
+    return;
+  }
+  auto rate = level_db > envelope_db ? attack : release;
+  envelope_db += rate * (level_db - envelope_db);
+
+  auto level = (envelope_db - CONFIG_REFLECT_PLAYBACK_THRESHOLD_DB) /
+               ENVELOPE_RANGE_DB;
+  level = level < 0 ? 0 : level > 1 ? 1 : level;
+
+  frames++;
+  auto point = (envelope_point_t *)pending.acquire();
+  if (point == nullptr) {
+    dropped++;
+    return;
+  }
+  point->audible_us =
+      esp_timer_get_time() + CONFIG_REFLECT_REACTIVE_AUDIO_DELAY_MS * 1000LL;
+  point->due_us = point->audible_us - light_latency_us;
+  point->level = level;
+  pending.commit();
+  xTaskNotifyGive(reactive_task);
+}
+
+static void reactive_send(int64_t now_us) {
+  auto scale = BRIGHTNESS_FLOOR + (1 - BRIGHTNESS_FLOOR) * latest.level;
+  auto probe = now_us - probe_us >= PROBE_INTERVAL_US;
+  if (probe) {
+    // Compensation follows the round trip measured by the last probe
+    reflect_lifx_stats_t lifx;
+    reflect_lifx_stats(&lifx);
+    light_latency_us = lifx.stream_rtt_us / 2 + SEND_INTERVAL_US / 2;
+  }
+  if (!send_lifx_stream(
+          (uint16_t)(scale * 65535),
+          (int16_t)(latest.level * CONFIG_REFLECT_REACTIVE_HUE_SWING),
+          SEND_INTERVAL_US / 1000, probe)) {
+    return;
+  }
+  if (probe) {
+    probe_us = now_us;
+    probe_audible_us = latest.audible_us;
+    probe_measuring = true;
+  }
+  next_send_us = now_us + SEND_INTERVAL_US;
+  sent++;
+}
+
+// Once the bulb has acknowledged the last probe, compares when the update it
+// carried showed against when the sound it follows was heard. The update
+// counts as showing halfway through its fade after the bulb got it.
+static void reactive_measure_probe() {
+  int64_t sent_us, received_us;
+  if (!probe_measuring ||
+      !reflect_lifx_stream_probe(&sent_us, &received_us) ||
+      sent_us < probe_us) {
+    return;
+  }
+  probe_measuring = false;
+
+  // Positive when the light lags the sound it follows
+  auto offset_us =
+      (int32_t)(received_us + SEND_INTERVAL_US / 2 - probe_audible_us);
+  audio_to_light_us += (offset_us - audio_to_light_us) / 4;
+  auto magnitude_us = offset_us < 0 ? -offset_us : offset_us;
+  if (magnitude_us > audio_to_light_max_us) {
+    audio_to_light_max_us = magnitude_us;
+  }
+}
+
+void reflect_reactive_stats(reflect_reactive_stats_t *stats) {
+  stats->frames = frames;
+  stats->dropped = dropped;
+  stats->sent = sent;
+  stats->restores = restores;
+  stats->light_latency_us = light_latency_us;
+  stats->audio_to_light_us = (int32_t)audio_to_light_us;
+  stats->audio_to_light_max_us = audio_to_light_max_us;
+}
+
+static void log_reactive_stats() {
+  reflect_reactive_stats_t stats;
+  reflect_reactive_stats(&stats);
+  ESP_LOGI(LOG_TAG,
+           "frames(%" PRIu32 ") dropped(%" PRIu32 ") sent(%" PRIu32
+           ") restores(%" PRIu32 ") light_latency_us(%" PRIu32
+           ") audio_to_light_us(%" PRId32 ") audio_to_light_max_us(%" PRId32
+           ")",
+           stats.frames, stats.dropped, stats.sent, stats.restores,
+           stats.light_latency_us, stats.audio_to_light_us,
+           stats.audio_to_light_max_us);
+  audio_to_light_max_us = 0;
+}
+
+// Shows the newest envelope point that is due, ends the mode once playback
+// has gone quiet, and returns how long until there is more to do
+static int64_t reactive_run(int64_t now_us) {
+  reactive_measure_probe();
+
+  envelope_point_t *point;
+  while ((point = (envelope_point_t *)pending.peek()) != nullptr &&
+         point->due_us <= now_us) {
+    latest = *point;
+    latest_pending = true;
+    pending.release();
+    if (latest.level > 0) {
+      last_loud_us = latest.audible_us;
+    }
+  }
+
+  // Silence doesn't start the mode, and effects own the bulbs while they
+  // run
+  if (latest.level == 0 && !active) {
+    latest_pending = false;
+  }
+  if (reflect_effect_running()) {
+    latest_pending = false;
+    active = false;
+  }
+
+  if (latest_pending && now_us >= next_send_us) {
+    latest_pending = false;
+    active = true;
+    reactive_send(now_us);
+  }
+
+  if (active && now_us - last_loud_us >= IDLE_MS * 1000LL) {
+    active = false;
+    latest_pending = false;
+    send_lifx_restore(SEND_INTERVAL_US / 1000);
+    restores++;
+  }
+
+  int64_t wait_us = IDLE_MS * 1000LL;
+  if (point != nullptr && point->due_us - now_us < wait_us) {
+    wait_us = point->due_us - now_us;
+  }
+  if (latest_pending && next_send_us - now_us < wait_us) {
+    wait_us = next_send_us - now_us;
+  }
+  return wait_us;
+}
+
+static void reflect_reactive_task(void *) {
+  int64_t last_stats_us = esp_timer_get_time();
+  while (true) {
+    auto now_us = esp_timer_get_time();
+    auto wait_us = reactive_run(now_us);
+
+    if (CONFIG_REFLECT_STATS_INTERVAL > 0 &&
+        now_us - last_stats_us >= CONFIG_REFLECT_STATS_INTERVAL * 1000000LL) {
+      log_reactive_stats();
+      last_stats_us = now_us;
+    }
+
+    auto wait_ticks = pdMS_TO_TICKS((wait_us + 999) / 1000);
+    ulTaskNotifyTake(pdTRUE, wait_ticks > 0 ? wait_ticks : 1);
+  }
+}
+
+void reflect_reactive() {
+  pending.init((uint8_t *)pending_storage, sizeof(envelope_point_t));
+  envelope_db = CONFIG_REFLECT_PLAYBACK_THRESHOLD_DB;
+  attack = 1 - expf(-(float)FRAME_MS / ENVELOPE_ATTACK_MS);
+  release = 1 - expf(-(float)FRAME_MS / ENVELOPE_RELEASE_MS);
+
+  xTaskCreate(reflect_reactive_task, "reactive", REACTIVE_TASK_STACK_SIZE,
+              NULL, REACTIVE_TASK_PRIORITY, &reactive_task);
+  assert(reactive_task != NULL);
+}
+
+#endif
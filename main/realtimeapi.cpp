@@ -1,6 +1,9 @@
 #include "cJSON.h"
-#include <string>
-#include <vector>
+#include <cinttypes>
+#include <cstddef>
+#include <cstring>
+#include <esp_random.h>
+#include <esp_timer.h>
 
 #include "reflect.hpp"
 
@@ -68,200 +71,1004 @@ English only. Warm, confident, succinct. Three sentence maximum. No internal rea
 
 )";
 
-void set_required_parameters(cJSON *parameters,
-                             std::vector<std::string> params) {
-  cJSON *required = cJSON_AddArrayToObject(parameters, "required");
-  assert(required != nullptr);
+// Every tool is declared once, as a table of its parameters mapped onto a
+// plain argument struct. The session.update schema is generated from that
+// table at compile time, and the same table decodes the model's arguments
+// into the struct without touching the heap.
+typedef enum {
+  TOOL_PARAMETER_NUMBER,
+  TOOL_PARAMETER_BOOLEAN,
+  // One of a list of strings, decoded to its index
+  TOOL_PARAMETER_ENUM,
+} tool_parameter_type_t;
 
-  for (auto param : params) {
-    auto val = cJSON_CreateString(param.c_str());
-    assert(val != nullptr);
+typedef struct {
+  const char *name;
+  tool_parameter_type_t type;
+  const char *description;
+  int64_t minimum;
+  int64_t maximum;
+  int64_t default_value;
+  bool required;
+  size_t offset;
+  size_t size;
+  const char *const *choices;
+} tool_parameter_t;
 
-    assert(cJSON_AddItemToArray(required, val));
+typedef struct {
+  const char *name;
+  const char *description;
+  const tool_parameter_t *parameters;
+  size_t parameter_count;
+  size_t arguments_size;
+  // Writes the result reported back to the model as a JSON object and
+  // returns whether the call succeeded
+  bool (*handler)(const void *arguments, char *output, size_t output_size);
+} tool_t;
+
+#define TOOL_NUMBER(args, field, description, minimum, maximum)               \
+  {#field,                                                                     \
+   TOOL_PARAMETER_NUMBER,                                                      \
+   description,                                                                \
+   minimum,                                                                    \
+   maximum,                                                                    \
+   0,                                                                          \
+   true,                                                                       \
+   offsetof(args, field),                                                      \
+   sizeof(((args *)0)->field),                                                 \
+   nullptr}
+
+#define TOOL_OPTIONAL_NUMBER(args, field, description, minimum, maximum,      \
+                             default_value)                                    \
+  {#field,                                                                     \
+   TOOL_PARAMETER_NUMBER,                                                      \
+   description,                                                                \
+   minimum,                                                                    \
+   maximum,                                                                    \
+   default_value,                                                              \
+   false,                                                                      \
+   offsetof(args, field),                                                      \
+   sizeof(((args *)0)->field),                                                 \
+   nullptr}
+
+#define TOOL_ENUM(args, field, description, choices)                           \
+  {#field,                                                                     \
+   TOOL_PARAMETER_ENUM,                                                        \
+   description,                                                                \
+   0,                                                                          \
+   sizeof(choices) / sizeof(choices[0]) - 1,                                   \
+   0,                                                                          \
+   true,                                                                       \
+   offsetof(args, field),                                                      \
+   sizeof(((args *)0)->field),                                                 \
+   choices}
+
+#define TOOL_BOOLEAN(args, field, description)                                 \
+  {#field,                                                                     \
+   TOOL_PARAMETER_BOOLEAN,                                                     \
+   description,                                                                \
+   0,                                                                          \
+   1,                                                                          \
+   0,                                                                          \
+   true,                                                                       \
+   offsetof(args, field),                                                      \
+   sizeof(((args *)0)->field),                                                 \
+   nullptr}
+
+#define TOOL(name, description, parameters, args, handler)                     \
+  {name,                                                                       \
+   description,                                                                \
+   parameters,                                                                 \
+   sizeof(parameters) / sizeof(parameters[0]),                                 \
+   sizeof(args),                                                               \
+   handler}
+
+#define TOOL_WITHOUT_PARAMETERS(name, description, handler)                    \
+  {name, description, nullptr, 0, 0, handler}
+
+// Writes JSON into out, or only counts its size when out is NULL, so the
+// same code sizes and then fills the compile-time buffer
+struct JsonWriter {
+  char *out;
+  size_t size;
+
+  constexpr void put(char c) {
+    if (out != nullptr) {
+      out[size] = c;
+    }
+    size++;
+  }
+
+  constexpr void raw(const char *s) {
+    for (; *s != '\0'; s++) {
+      put(*s);
+    }
   }
+
+  // UTF-8 passes through untouched
+  constexpr void string(const char *s) {
+    constexpr char hex[] = "0123456789abcdef";
+    put('"');
+    for (; *s != '\0'; s++) {
+      auto c = (unsigned char)*s;
+      if (c == '"' || c == '\\') {
+        put('\\');
+        put((char)c);
+      } else if (c == '\n') {
+        raw("\\n");
+      } else if (c == '\r') {
+        raw("\\r");
+      } else if (c == '\t') {
+        raw("\\t");
+      } else if (c < 0x20) {
+        raw("\\u00");
+        put(hex[c >> 4]);
+        put(hex[c & 0xf]);
+      } else {
+        put((char)c);
+      }
+    }
+    put('"');
+  }
+
+  constexpr void number(int64_t value) {
+    if (value < 0) {
+      put('-');
+      value = -value;
+    }
+    char digits[20] = {};
+    size_t count = 0;
+    do {
+      digits[count++] = (char)('0' + value % 10);
+      value /= 10;
+    } while (value > 0);
+    while (count > 0) {
+      put(digits[--count]);
+    }
+  }
+
+  constexpr void tool(const tool_t &tool) {
+    raw("{\"type\":\"function\",\"name\":");
+    string(tool.name);
+    raw(",\"description\":");
+    string(tool.description);
+    raw(",\"parameters\":{\"type\":\"object\",\"properties\":{");
+    for (size_t i = 0; i < tool.parameter_count; i++) {
+      auto &parameter = tool.parameters[i];
+      if (i > 0) {
+        put(',');
+      }
+      string(parameter.name);
+      raw(":{\"type\":");
+      if (parameter.type == TOOL_PARAMETER_NUMBER) {
+        raw("\"number\"");
+      } else if (parameter.type == TOOL_PARAMETER_BOOLEAN) {
+        raw("\"boolean\"");
+      } else {
+        raw("\"string\",\"enum\":[");
+        for (int64_t j = 0; j <= parameter.maximum; j++) {
+          if (j > 0) {
+            put(',');
+          }
+          string(parameter.choices[j]);
+        }
+        put(']');
+      }
+      raw(",\"description\":");
+      string(parameter.description);
+      if (parameter.type == TOOL_PARAMETER_NUMBER) {
+        raw(",\"default\":");
+        number(parameter.default_value);
+        raw(",\"minimum\":");
+        number(parameter.minimum);
+        raw(",\"maximum\":");
+        number(parameter.maximum);
+      }
+      put('}');
+    }
+    raw("},\"required\":[");
+    bool first = true;
+    for (size_t i = 0; i < tool.parameter_count; i++) {
+      if (tool.parameters[i].required) {
+        if (!first) {
+          put(',');
+        }
+        first = false;
+        string(tool.parameters[i].name);
+      }
+    }
+    raw("]}}");
+  }
+};
+
+// Largest argument struct any tool may declare, and most parameters
+#define TOOL_ARGUMENTS_MAX_SIZE 64
+#define TOOL_PARAMETERS_MAX 32
+
+// Room for a tool's result, checked against the largest get_light_state
+#define TOOL_OUTPUT_SIZE 1024
+
+static bool tool_error(char *output, size_t output_size, const char *message) {
+  snprintf(output, output_size, "{\"status\":\"error\",\"message\":\"%s\"}",
+           message);
+  return false;
 }
 
-void add_number_parameter(cJSON *properties, std::string name,
-                          std::string description, int defaultValue,
-                          int minimum, int maximum) {
-  cJSON *duration = cJSON_AddObjectToObject(properties, name.c_str());
-  assert(duration != nullptr);
-
-  assert(cJSON_AddStringToObject(duration, "type", "number") != nullptr);
-  assert(cJSON_AddStringToObject(duration, "description",
-                                 description.c_str()) != nullptr);
-  assert(cJSON_AddNumberToObject(duration, "default", defaultValue) != nullptr);
-  assert(cJSON_AddNumberToObject(duration, "minimum", minimum) != nullptr);
-  assert(cJSON_AddNumberToObject(duration, "default", maximum) != nullptr);
+typedef struct {
+  bool on;
+  uint32_t duration;
+} set_light_power_args_t;
+
+// Light commands only get as far as lifx.cpp's queue here, which keeps
+// retransmitting them until the bulb acknowledges. Waiting for that would
+// hold up the peer task, so the result says queued rather than done.
+static bool set_light_power(const void *arguments, char *output,
+                            size_t output_size) {
+  auto args = (const set_light_power_args_t *)arguments;
+  ESP_LOGI(LOG_TAG, "set_light_power on(%d) duration(%" PRIu32 ")", args->on,
+           args->duration);
+  reflect_effect_stop();
+  if (!send_lifx_set_power(args->on, args->duration)) {
+    return tool_error(output, output_size, "bulb unreachable");
+  }
+
+  snprintf(output, output_size,
+           "{\"status\":\"queued\",\"on\":%s,\"duration\":%" PRIu32 "}",
+           args->on ? "true" : "false", args->duration);
+  return true;
 }
 
-void add_set_light_power(cJSON *tools) {
-  auto tool = cJSON_CreateObject();
-  assert(tool != nullptr);
-
-  assert(cJSON_AddStringToObject(tool, "type", "function") != nullptr);
-  assert(cJSON_AddStringToObject(tool, "name", "set_light_power") != nullptr);
-  assert(cJSON_AddStringToObject(
-             tool, "description",
-             "LAN SetLightPower (117). Turn on/off with optional fade.") !=
-         nullptr);
-
-  auto parameters = cJSON_CreateObject();
-  assert(parameters != nullptr);
-  assert(cJSON_AddItemToObject(tool, "parameters", parameters));
-  assert(cJSON_AddStringToObject(parameters, "type", "object") != nullptr);
-
-  auto properties = cJSON_AddObjectToObject(parameters, "properties");
-  assert(properties != nullptr);
-
-  auto on = cJSON_AddObjectToObject(properties, "on");
-  assert(on != nullptr);
-  assert(cJSON_AddStringToObject(on, "type", "boolean") != nullptr);
-  assert(cJSON_AddStringToObject(on, "description", "true=on, false=off") !=
-         nullptr);
-
-  add_number_parameter(properties, "duration",
-                       "duration of transition in milliseconds", 0, 0, 1000);
-
-  set_required_parameters(parameters,
-                          std::vector<std::string>{"on", "duration"});
-  assert(cJSON_AddItemToArray(tools, tool));
+static constexpr tool_parameter_t kSetLightPowerParameters[] = {
+    TOOL_BOOLEAN(set_light_power_args_t, on, "true=on, false=off"),
+    TOOL_NUMBER(set_light_power_args_t, duration,
+                "duration of transition in milliseconds", 0, 1000),
+};
+
+static constexpr tool_t kSetLightPowerTool =
+    TOOL("set_light_power",
+         "LAN SetLightPower (117). Turn on/off with optional fade.",
+         kSetLightPowerParameters, set_light_power_args_t, set_light_power);
+
+typedef struct {
+  uint16_t hue;
+  uint16_t saturation;
+  uint16_t brightness;
+  uint16_t kelvin;
+  uint32_t duration;
+} set_color_args_t;
+
+static bool set_color(const void *arguments, char *output,
+                      size_t output_size) {
+  auto args = (const set_color_args_t *)arguments;
+  ESP_LOGI(LOG_TAG,
+           "set_color hue(%d) saturation(%d) brightness(%d) kelvin(%d) "
+           "duration(%" PRIu32 ")",
+           args->hue, args->saturation, args->brightness, args->kelvin,
+           args->duration);
+  reflect_effect_stop();
+  if (!send_lifx_set_color(args->hue, args->saturation, args->brightness,
+                           args->kelvin, args->duration)) {
+    return tool_error(output, output_size, "bulb unreachable");
+  }
+
+  snprintf(output, output_size,
+           "{\"status\":\"queued\",\"hue\":%d,\"saturation\":%d,"
+           "\"brightness\":%d,\"kelvin\":%d,\"duration\":%" PRIu32 "}",
+           args->hue, args->saturation, args->brightness, args->kelvin,
+           args->duration);
+  return true;
 }
 
-void add_set_color(cJSON *tools) {
-  auto tool = cJSON_CreateObject();
-  assert(tool != nullptr);
-
-  assert(cJSON_AddStringToObject(tool, "type", "function") != nullptr);
-  assert(cJSON_AddStringToObject(tool, "name", "set_color") != nullptr);
-  assert(cJSON_AddStringToObject(
-             tool, "description",
-             "LAN SetColor (102). Set HSBK for whole device.") != nullptr);
-
-  auto parameters = cJSON_CreateObject();
-  assert(parameters != nullptr);
-  assert(cJSON_AddItemToObject(tool, "parameters", parameters));
-  assert(cJSON_AddStringToObject(parameters, "type", "object") != nullptr);
-
-  auto properties = cJSON_AddObjectToObject(parameters, "properties");
-  assert(properties != nullptr);
-
-  add_number_parameter(properties, "hue", "", 0, 0, 65535);
-  add_number_parameter(properties, "saturation", "", 0, 0, 65535);
-  add_number_parameter(properties, "brightness", "", 0, 0, 65535);
-  add_number_parameter(properties, "kelvin", "", 0, 0, 65535);
-  add_number_parameter(properties, "duration", "", 0, 0, 4294967295);
-
-  set_required_parameters(
-      parameters, std::vector<std::string>{"hue", "saturation", "brightness",
-                                           "kelvin", "duration"});
-  assert(cJSON_AddItemToArray(tools, tool));
+static constexpr tool_parameter_t kSetColorParameters[] = {
+    TOOL_NUMBER(set_color_args_t, hue, "", 0, 65535),
+    TOOL_NUMBER(set_color_args_t, saturation, "", 0, 65535),
+    TOOL_NUMBER(set_color_args_t, brightness, "", 0, 65535),
+    TOOL_NUMBER(set_color_args_t, kelvin, "", 0, 65535),
+    TOOL_NUMBER(set_color_args_t, duration, "", 0, 4294967295),
+};
+
+static constexpr tool_t kSetColorTool =
+    TOOL("set_color", "LAN SetColor (102). Set HSBK for whole device.",
+         kSetColorParameters, set_color_args_t, set_color);
+
+// Most bulbs reported by get_light_state
+#define LIGHT_STATE_MAX_BULBS 4
+
+static constexpr void write_light_state(JsonWriter &writer,
+                                        const reflect_lifx_bulb_t *bulbs,
+                                        size_t count, int64_t now_us) {
+  writer.raw("{\"status\":\"ok\",\"bulbs\":[");
+  for (size_t i = 0; i < count; i++) {
+    auto &bulb = bulbs[i];
+    if (i > 0) {
+      writer.put(',');
+    }
+    writer.raw("{\"label\":");
+    writer.string(bulb.label);
+    writer.raw(",\"group\":");
+    writer.string(bulb.group);
+    writer.raw(",\"on\":");
+    writer.raw(bulb.power ? "true" : "false");
+    writer.raw(",\"hue\":");
+    writer.number(bulb.hue);
+    writer.raw(",\"saturation\":");
+    writer.number(bulb.saturation);
+    writer.raw(",\"brightness\":");
+    writer.number(bulb.brightness);
+    writer.raw(",\"kelvin\":");
+    writer.number(bulb.kelvin);
+    writer.raw(",\"reported_s_ago\":");
+    writer.number(bulb.reported_us == 0
+                      ? -1
+                      : (now_us - bulb.reported_us) / 1000000);
+    writer.put('}');
+  }
+  writer.raw("]}");
 }
 
-void send_session_update(PeerConnection *peer_connection) {
-  auto root = cJSON_CreateObject();
-  assert(root != nullptr);
+// Every bulb with full-length labels and the widest values
+static constexpr size_t light_state_worst_size() {
+  reflect_lifx_bulb_t bulbs[LIGHT_STATE_MAX_BULBS] = {};
+  for (auto &bulb : bulbs) {
+    for (size_t i = 0; i < REFLECT_LIFX_LABEL_SIZE - 1; i++) {
+      bulb.label[i] = 'x';
+      bulb.group[i] = 'x';
+    }
+    bulb.hue = bulb.saturation = bulb.brightness = bulb.kelvin = 65535;
+    bulb.reported_us = 1;
+  }
+  JsonWriter writer{nullptr, 0};
+  write_light_state(writer, bulbs, LIGHT_STATE_MAX_BULBS, INT64_MAX);
+  return writer.size;
+}
+
+static_assert(light_state_worst_size() < TOOL_OUTPUT_SIZE,
+              "get_light_state can outgrow TOOL_OUTPUT_SIZE");
+
+// Answers from what the bulbs last reported plus what has been sent to them
+// since, so there is no network round trip. Labels arrive from lifx.cpp
+// already cut to size and stripped of anything JSON would need escaped.
+static bool get_light_state(const void *, char *output, size_t output_size) {
+  reflect_lifx_bulb_t bulbs[LIGHT_STATE_MAX_BULBS];
+  auto count = reflect_lifx_bulbs(bulbs, LIGHT_STATE_MAX_BULBS);
+  if (count == 0) {
+    return tool_error(output, output_size, "no bulbs found");
+  }
+  if (count > LIGHT_STATE_MAX_BULBS) {
+    count = LIGHT_STATE_MAX_BULBS;
+  }
+
+  auto now_us = esp_timer_get_time();
+  JsonWriter measure{nullptr, 0};
+  write_light_state(measure, bulbs, count, now_us);
+  if (measure.size >= output_size) {
+    return tool_error(output, output_size, "state too large");
+  }
 
-  assert(cJSON_AddStringToObject(root, "type", "session.update") != nullptr);
+  JsonWriter writer{output, 0};
+  write_light_state(writer, bulbs, count, now_us);
+  output[writer.size] = '\0';
+  return true;
+}
 
-  auto session = cJSON_CreateObject();
-  assert(session != nullptr);
+static constexpr tool_t kGetLightStateTool = TOOL_WITHOUT_PARAMETERS(
+    "get_light_state",
+    "Current power and HSBK of the lights. Use it to answer questions about "
+    "how the lights are set right now.",
+    get_light_state);
 
-  assert(cJSON_AddStringToObject(session, "instructions", kLunaInstructions) !=
-         nullptr);
-  assert(cJSON_AddStringToObject(session, "type", "realtime") != nullptr);
+static bool run_effect(const void *arguments, char *output,
+                       size_t output_size) {
+  auto effect = (const reflect_effect_t *)arguments;
+  reflect_effect_start(effect);
+  snprintf(output, output_size, "{\"status\":\"%s\",\"effect\":\"%s\"}",
+           effect->kind == REFLECT_EFFECT_STOP ? "stopped" : "running",
+           reflect_effect_names[effect->kind]);
+  return true;
+}
 
-  auto tools = cJSON_AddArrayToObject(session, "tools");
-  assert(tools != nullptr);
+static constexpr tool_parameter_t kRunEffectParameters[] = {
+    TOOL_ENUM(reflect_effect_t, kind,
+              "breathe and pulse cycle between the current color and the "
+              "given one, candle flickers around the given brightness, "
+              "sunrise fades from dim red to daylight over the duration, "
+              "stop ends whatever is running",
+              reflect_effect_names),
+    TOOL_OPTIONAL_NUMBER(reflect_effect_t, hue, "", 0, 65535, 0),
+    TOOL_OPTIONAL_NUMBER(reflect_effect_t, saturation, "", 0, 65535, 0),
+    TOOL_OPTIONAL_NUMBER(reflect_effect_t, brightness, "", 0, 65535, 32768),
+    TOOL_OPTIONAL_NUMBER(reflect_effect_t, kelvin, "", 1500, 9000, 2700),
+    TOOL_OPTIONAL_NUMBER(reflect_effect_t, period,
+                         "milliseconds per cycle of breathe and pulse", 200,
+                         60000, 4000),
+    TOOL_OPTIONAL_NUMBER(reflect_effect_t, duration,
+                         "seconds to run, 0 runs until stopped (sunrise "
+                         "defaults to 20 minutes)",
+                         0, 86400, 0),
+};
 
-  add_set_light_power(tools);
-  add_set_color(tools);
+static constexpr tool_t kRunEffectTool = TOOL(
+    "run_effect",
+    "Start a lighting effect that runs on its own until its duration is up, "
+    "another effect starts or the light is set.",
+    kRunEffectParameters, reflect_effect_t, run_effect);
 
-  assert(cJSON_AddItemToObject(root, "session", session));
+template <size_t Size> struct JsonPayload {
+  char data[Size + 1];
+  static constexpr size_t size = Size;
+};
 
-  auto serialized = cJSON_PrintUnformatted(root);
-  assert(serialized != nullptr);
+// The tools offered to the model, and the table calls are dispatched from.
+// A different set is just a different list.
+template <const tool_t &... Tools> struct ToolSet {
+  static_assert(((Tools.arguments_size <= TOOL_ARGUMENTS_MAX_SIZE) && ...),
+                "tool arguments too large");
+  static_assert(((Tools.parameter_count <= TOOL_PARAMETERS_MAX) && ...),
+                "too many tool parameters");
 
-  peer_connection_datachannel_send(peer_connection, serialized,
-                                   strlen(serialized));
-  cJSON_free(serialized);
-  cJSON_Delete(root);
+  static constexpr const tool_t *table[] = {&Tools...};
+  static constexpr size_t count = sizeof...(Tools);
+
+  static constexpr void write(JsonWriter &writer) {
+    for (size_t i = 0; i < count; i++) {
+      if (i > 0) {
+        writer.put(',');
+      }
+      writer.tool(*table[i]);
+    }
+  }
+};
+
+// The session.update message, assembled and escaped by the compiler so the
+// data channel sends it straight out of flash
+template <const char *Instructions, typename Tools> struct SessionUpdate {
+  static constexpr void write(JsonWriter &writer) {
+    writer.raw("{\"type\":\"session.update\",\"session\":{\"type\":"
+               "\"realtime\",\"instructions\":");
+    writer.string(Instructions);
+    writer.raw(",\"tools\":[");
+    Tools::write(writer);
+    writer.raw("]}}");
+  }
+
+  static constexpr size_t measure() {
+    JsonWriter writer{nullptr, 0};
+    write(writer);
+    return writer.size;
+  }
+
+  static constexpr size_t size = measure();
+
+  static constexpr JsonPayload<size> build() {
+    JsonPayload<size> payload{};
+    JsonWriter writer{payload.data, 0};
+    write(writer);
+    payload.data[writer.size] = '\0';
+    return payload;
+  }
+
+  static constexpr JsonPayload<size> payload = build();
+};
+
+using LunaTools = ToolSet<kSetLightPowerTool, kSetColorTool,
+                          kGetLightStateTool, kRunEffectTool>;
+using LunaSessionUpdate = SessionUpdate<kLunaInstructions, LunaTools>;
+
+// Tool results handed back since the last response.create. A new session
+// starts with none.
+static uint32_t tool_outputs_pending = 0;
+
+void send_session_update(PeerConnection *peer_connection) {
+  tool_outputs_pending = 0;
+  auto &payload = LunaSessionUpdate::payload;
+  peer_connection_datachannel_send(peer_connection,
+                                   const_cast<char *>(payload.data),
+                                   payload.size);
+  reflect_peer_loop_wake();
 }
 
-void realtimeapi_parse_incoming(char *msg) {
-  // Large inbound messages get chunked (and fail to parse)
-  auto root = cJSON_Parse(msg);
-  if (root == nullptr) {
-    return;
+static const char *json_skip_space(const char *json) {
+  while (*json == ' ' || *json == '\t' || *json == '\n' || *json == '\r') {
+    json++;
   }
+  return json;
+}
 
-  auto type_item = cJSON_GetObjectItem(root, "type");
-  if (type_item == nullptr) {
-    return;
+// Returns what follows the string opening at json, or NULL if it never
+// closes
+static const char *json_skip_string(const char *json) {
+  for (json++; *json != '\0'; json++) {
+    if (*json == '\\') {
+      if (*++json == '\0') {
+        return NULL;
+      }
+    } else if (*json == '"') {
+      return json + 1;
+    }
   }
+  return NULL;
+}
 
-  if (strcmp(type_item->valuestring, "response.function_call_arguments.done") !=
-      0) {
-    return;
+// Skips a value no tool parameter takes, nested containers included.
+// Returns what follows it, or NULL if it is cut short.
+static const char *json_skip_value(const char *json) {
+  if (*json == '"') {
+    return json_skip_string(json);
+  }
+
+  if (*json != '{' && *json != '[') {
+    auto start = json;
+    while (*json != '\0' && *json != ',' && *json != '}' && *json != ']' &&
+           *json != ' ' && *json != '\t' && *json != '\n' && *json != '\r') {
+      json++;
+    }
+    return json == start ? NULL : json;
+  }
+
+  int level = 0;
+  while (*json != '\0') {
+    if (*json == '"') {
+      json = json_skip_string(json);
+      if (json == NULL) {
+        return NULL;
+      }
+      continue;
+    }
+    if (*json == '{' || *json == '[') {
+      level++;
+    } else if ((*json == '}' || *json == ']') && --level == 0) {
+      return json + 1;
+    }
+    json++;
+  }
+  return NULL;
+}
+
+// Reads an integer, rounding any fraction. Exponents aren't accepted.
+static const char *json_number(const char *json, int64_t *value) {
+  bool negative = *json == '-';
+  if (negative) {
+    json++;
+  }
+  if (*json < '0' || *json > '9') {
+    return NULL;
+  }
+
+  int64_t result = 0;
+  int digits = 0;
+  for (; *json >= '0' && *json <= '9'; json++) {
+    if (++digits > 18) {
+      return NULL;
+    }
+    result = result * 10 + (*json - '0');
+  }
+  if (*json == '.') {
+    json++;
+    if (*json < '0' || *json > '9') {
+      return NULL;
+    }
+    if (*json >= '5') {
+      result++;
+    }
+    while (*json >= '0' && *json <= '9') {
+      json++;
+    }
+  }
+  if (*json == 'e' || *json == 'E') {
+    return NULL;
+  }
+
+  *value = negative ? -result : result;
+  return json;
+}
+
+// Reads a string that has to be one of the parameter's choices, and gives
+// its index
+static const char *json_choice(const tool_parameter_t *parameter,
+                               const char *json, int64_t *value) {
+  if (*json != '"') {
+    return NULL;
+  }
+  auto end = json_skip_string(json);
+  if (end == NULL) {
+    return NULL;
   }
 
-  auto argsString = cJSON_GetObjectItem(root, "arguments");
-  assert(cJSON_IsString(argsString));
+  auto size = (size_t)(end - json - 2);
+  for (int64_t i = 0; i <= parameter->maximum; i++) {
+    auto choice = parameter->choices[i];
+    if (strlen(choice) == size && memcmp(choice, json + 1, size) == 0) {
+      *value = i;
+      return end;
+    }
+  }
+  return NULL;
+}
+
+static void store_argument(const tool_parameter_t *parameter, void *arguments,
+                           int64_t value) {
+  if (value < parameter->minimum) {
+    value = parameter->minimum;
+  } else if (value > parameter->maximum) {
+    value = parameter->maximum;
+  }
 
-  auto args = cJSON_Parse(argsString->valuestring);
-  assert(cJSON_IsObject(args));
+  auto field = (uint8_t *)arguments + parameter->offset;
+  if (parameter->type == TOOL_PARAMETER_BOOLEAN) {
+    *(bool *)field = value != 0;
+  } else if (parameter->size == sizeof(uint8_t)) {
+    *field = (uint8_t)value;
+  } else if (parameter->size == sizeof(uint16_t)) {
+    *(uint16_t *)field = (uint16_t)value;
+  } else {
+    *(uint32_t *)field = (uint32_t)value;
+  }
+}
 
-  uint16_t hue = 0;
-  uint16_t saturation = 0;
-  uint16_t brightness = 0;
-  uint16_t kelvin = 0;
-  uint32_t duration = 0;
-  bool on = false;
+// Decodes one member of the arguments object, returning what follows it
+static const char *tool_decode_member(const tool_t *tool, const char *json,
+                                      void *arguments, uint32_t *seen) {
+  if (*json != '"') {
+    return NULL;
+  }
+  auto key = json + 1;
+  json = json_skip_string(json);
+  if (json == NULL) {
+    return NULL;
+  }
+  auto key_size = (size_t)(json - 1 - key);
 
-  auto hueObj = cJSON_GetObjectItem(args, "hue");
-  if (hueObj != nullptr) {
-    hue = hueObj->valueint;
+  json = json_skip_space(json);
+  if (*json != ':') {
+    return NULL;
   }
+  json = json_skip_space(json + 1);
+
+  for (size_t i = 0; i < tool->parameter_count; i++) {
+    auto parameter = &tool->parameters[i];
+    if (strlen(parameter->name) != key_size ||
+        memcmp(parameter->name, key, key_size) != 0) {
+      continue;
+    }
 
-  auto saturationObj = cJSON_GetObjectItem(args, "saturation");
-  if (saturationObj != nullptr) {
-    saturation = saturationObj->valueint;
+    int64_t value = 0;
+    if (parameter->type == TOOL_PARAMETER_NUMBER) {
+      json = json_number(json, &value);
+    } else if (parameter->type == TOOL_PARAMETER_ENUM) {
+      json = json_choice(parameter, json, &value);
+    } else if (strncmp(json, "true", 4) == 0) {
+      value = 1;
+      json += 4;
+    } else if (strncmp(json, "false", 5) == 0) {
+      json += 5;
+    } else {
+      json = NULL;
+    }
+
+    if (json != NULL) {
+      store_argument(parameter, arguments, value);
+      *seen |= 1u << i;
+    }
+    return json;
   }
 
-  auto brightnessObj = cJSON_GetObjectItem(args, "brightness");
-  if (brightnessObj != nullptr) {
-    brightness = brightnessObj->valueint;
+  return json_skip_value(json);
+}
+
+// Decodes a call's arguments object into the tool's struct. Anything
+// malformed, mistyped or missing a required parameter is rejected;
+// out-of-range numbers are clamped to the declared range.
+static bool tool_decode(const tool_t *tool, const char *json,
+                        void *arguments) {
+  memset(arguments, 0, tool->arguments_size);
+  for (size_t i = 0; i < tool->parameter_count; i++) {
+    store_argument(&tool->parameters[i], arguments,
+                   tool->parameters[i].default_value);
   }
 
-  auto kelvinObj = cJSON_GetObjectItem(args, "kelvin");
-  if (kelvinObj != nullptr) {
-    kelvin = kelvinObj->valueint;
+  json = json_skip_space(json);
+  if (*json != '{') {
+    return false;
   }
+  json = json_skip_space(json + 1);
 
-  auto durationObj = cJSON_GetObjectItem(args, "duration");
-  if (durationObj != nullptr) {
-    duration = durationObj->valueint;
+  uint32_t seen = 0;
+  if (*json == '}') {
+    json++;
+  } else {
+    while (true) {
+      json = tool_decode_member(tool, json, arguments, &seen);
+      if (json == NULL) {
+        return false;
+      }
+      json = json_skip_space(json);
+      if (*json == '}') {
+        json++;
+        break;
+      }
+      if (*json != ',') {
+        return false;
+      }
+      json = json_skip_space(json + 1);
+    }
   }
 
-  auto onObj = cJSON_GetObjectItem(args, "on");
-  if (onObj != nullptr) {
-    on = onObj->type == cJSON_True;
+  if (*json_skip_space(json) != '\0') {
+    return false;
   }
 
-  auto output_name_item = cJSON_GetObjectItem(root, "name");
-  assert(cJSON_IsString(output_name_item));
+  for (size_t i = 0; i < tool->parameter_count; i++) {
+    if (tool->parameters[i].required && (seen & (1u << i)) == 0) {
+      return false;
+    }
+  }
+  return true;
+}
 
-  if (strcmp(output_name_item->valuestring, "set_color") == 0) {
-    ESP_LOGI(LOG_TAG,
-             "set_color hue(%d) saturation(%d) brightness(%d) kelvin(%d) "
-             "duration(%d)",
-             hue, saturation, brightness, kelvin, duration);
-    send_lifx_set_color(hue, saturation, brightness, kelvin, duration);
-  } else if (strcmp(output_name_item->valuestring, "set_light_power") == 0) {
-    ESP_LOGI(LOG_TAG, "set_light_power on(%d) duration(%d)", on, duration);
-    send_lifx_set_power(on, duration);
+static const tool_t *tool_find(const char *name) {
+  for (auto tool : LunaTools::table) {
+    if (strcmp(tool->name, name) == 0) {
+      return tool;
+    }
   }
+  return NULL;
+}
+
+#if CONFIG_REFLECT_TOOLS_BENCHMARK
+#define BENCHMARK_ITERATIONS 1000
+#define BENCHMARK_MUTATIONS 10000
+
+static const char kBenchmarkArguments[] =
+    "{\"hue\":43690,\"saturation\":65535,\"brightness\":32768,"
+    "\"kelvin\":3500,\"duration\":2000}";
 
+static uint32_t cjson_allocations = 0;
+
+static void *counting_malloc(size_t size) {
+  cjson_allocations++;
+  return malloc(size);
+}
+
+// The dispatch this replaced: a full parse and a lookup per parameter
+static void decode_with_cjson(const char *arguments) {
+  auto args = cJSON_Parse(arguments);
+  for (auto &parameter : kSetColorParameters) {
+    cJSON_GetObjectItem(args, parameter.name);
+  }
   cJSON_Delete(args);
+}
+
+// Feeds every truncation of a valid call and a run of random single-byte
+// mutations through the decoder. Handlers are never called.
+static void fuzz_tool_decode() {
+  static const char alphabet[] = "{}[]\",:\\ -.0123456789eEtrufalsn";
+  char input[sizeof(kBenchmarkArguments) + 1];
+  alignas(8) uint8_t decoded[TOOL_ARGUMENTS_MAX_SIZE];
+  uint32_t inputs = 0;
+  uint32_t accepted = 0;
+
+  for (size_t i = 0; i < sizeof(kBenchmarkArguments) - 1; i++) {
+    memcpy(input, kBenchmarkArguments, i);
+    input[i] = '\0';
+    accepted += tool_decode(&kSetColorTool, input, decoded);
+    inputs++;
+  }
+
+  for (size_t i = 0; i < BENCHMARK_MUTATIONS; i++) {
+    memcpy(input, kBenchmarkArguments, sizeof(kBenchmarkArguments));
+    auto position = esp_random() % (sizeof(kBenchmarkArguments) - 1);
+    input[position] = alphabet[esp_random() % (sizeof(alphabet) - 1)];
+    accepted += tool_decode(&kSetColorTool, input, decoded);
+    inputs++;
+  }
+
+  ESP_LOGI(LOG_TAG,
+           "Fuzzed %" PRIu32 " mutated arguments, %" PRIu32
+           " accepted, %" PRIu32 " rejected",
+           inputs, accepted, inputs - accepted);
+}
+
+void realtimeapi_tools_benchmark() {
+  cJSON_Hooks hooks = {.malloc_fn = counting_malloc, .free_fn = free};
+  cJSON_InitHooks(&hooks);
+  auto start_us = esp_timer_get_time();
+  for (size_t i = 0; i < BENCHMARK_ITERATIONS; i++) {
+    decode_with_cjson(kBenchmarkArguments);
+  }
+  auto cjson_us = esp_timer_get_time() - start_us;
+  cJSON_InitHooks(NULL);
+
+  alignas(8) uint8_t decoded[TOOL_ARGUMENTS_MAX_SIZE];
+  start_us = esp_timer_get_time();
+  for (size_t i = 0; i < BENCHMARK_ITERATIONS; i++) {
+    auto tool = tool_find("set_color");
+    tool_decode(tool, kBenchmarkArguments, decoded);
+  }
+  auto registry_us = esp_timer_get_time() - start_us;
+
+  ESP_LOGI(LOG_TAG,
+           "Tool dispatch x%d: cJSON %" PRIu32 "ns/call, %" PRIu32
+           " allocations; registry %" PRIu32 "ns/call, 0 allocations",
+           BENCHMARK_ITERATIONS,
+           (uint32_t)(cjson_us * 1000 / BENCHMARK_ITERATIONS),
+           cjson_allocations,
+           (uint32_t)(registry_us * 1000 / BENCHMARK_ITERATIONS));
+
+  fuzz_tool_decode();
+}
+#endif
+
+#define FUNCTION_CALL_DONE "response.function_call_arguments.done"
+#define RESPONSE_DONE "response.done"
+#define FUNCTION_NAME_SIZE 64
+#define FUNCTION_CALL_ID_SIZE 64
+#define FUNCTION_ARGUMENTS_SIZE 512
+// The result is escaped into the message, which at most doubles it as tools
+// write no control characters
+#define FUNCTION_CALL_OUTPUT_SIZE                                              \
+  (2 * TOOL_OUTPUT_SIZE + 2 * FUNCTION_CALL_ID_SIZE + 128)
+
+static const char kResponseCreate[] = "{\"type\":\"response.create\"}";
+
+static constexpr void write_function_call_output(JsonWriter &writer,
+                                                 const char *call_id,
+                                                 const char *output) {
+  writer.raw("{\"type\":\"conversation.item.create\",\"item\":{\"type\":"
+             "\"function_call_output\",\"call_id\":");
+  writer.string(call_id);
+  writer.raw(",\"output\":");
+  writer.string(output);
+  writer.raw("}}");
+}
+
+// A result and call id made of nothing but characters that need escaping
+static constexpr size_t function_call_output_worst_size() {
+  char call_id[FUNCTION_CALL_ID_SIZE] = {};
+  char output[TOOL_OUTPUT_SIZE] = {};
+  for (size_t i = 0; i < sizeof(call_id) - 1; i++) {
+    call_id[i] = '"';
+  }
+  for (size_t i = 0; i < sizeof(output) - 1; i++) {
+    output[i] = '"';
+  }
+  JsonWriter writer{nullptr, 0};
+  write_function_call_output(writer, call_id, output);
+  return writer.size;
+}
+
+static_assert(function_call_output_worst_size() < FUNCTION_CALL_OUTPUT_SIZE,
+              "tool results can outgrow FUNCTION_CALL_OUTPUT_SIZE");
+
+// Hands the tool's result back to the model, returning whether it went out.
+// With CONFIG_REFLECT_TOOL_RESPONSE_CREATE the model is also asked to carry
+// on from there once the response that made the call is done, but only for
+// results it actually got.
+static bool send_function_call_output(const char *call_id,
+                                      const char *output) {
+  JsonWriter measure{nullptr, 0};
+  write_function_call_output(measure, call_id, output);
+  char message[FUNCTION_CALL_OUTPUT_SIZE];
+  if (measure.size >= sizeof(message)) {
+    ESP_LOGW(LOG_TAG, "Function call output too large (%d bytes)",
+             (int)measure.size);
+    return false;
+  }
+
+  JsonWriter writer{message, 0};
+  write_function_call_output(writer, call_id, output);
+  message[writer.size] = '\0';
+  if (!reflect_datachannel_send(message, writer.size)) {
+    return false;
+  }
+
+#if CONFIG_REFLECT_TOOL_RESPONSE_CREATE
+  tool_outputs_pending++;
+#endif
+  return true;
+}
+
+// Calls arrive while their response is still active, and the API refuses a
+// response.create until it is done, so all of a response's results are
+// answered with one response.create at its response.done
+static void handle_response_done() {
+  if (tool_outputs_pending == 0) {
+    return;
+  }
+  ESP_LOGI(LOG_TAG, "Asking for a response to %" PRIu32 " tool results",
+           tool_outputs_pending);
+  tool_outputs_pending = 0;
+  reflect_datachannel_send(kResponseCreate, sizeof(kResponseCreate) - 1);
+}
+
+bool realtimeapi_wants_event(const char *type) {
+  return strcmp(type, FUNCTION_CALL_DONE) == 0 || strcmp(type, "error") == 0 ||
+         strcmp(type, "rate_limits.updated") == 0 ||
+         (tool_outputs_pending > 0 && strcmp(type, RESPONSE_DONE) == 0);
+}
+
+static void handle_function_call(const char *json, size_t size) {
+  auto start_us = esp_timer_get_time();
+  char name[FUNCTION_NAME_SIZE];
+  char call_id[FUNCTION_CALL_ID_SIZE];
+  char arguments[FUNCTION_ARGUMENTS_SIZE];
+  if (!reflect_json_string(json, size, "call_id", call_id, sizeof(call_id))) {
+    ESP_LOGW(LOG_TAG, "Function call without call_id");
+    return;
+  }
+
+  char output[TOOL_OUTPUT_SIZE];
+  const tool_t *tool = NULL;
+  alignas(8) uint8_t decoded[TOOL_ARGUMENTS_MAX_SIZE];
+  if (!reflect_json_string(json, size, "name", name, sizeof(name)) ||
+      !reflect_json_string(json, size, "arguments", arguments,
+                           sizeof(arguments))) {
+    ESP_LOGW(LOG_TAG, "Function call without name or arguments");
+    tool_error(output, sizeof(output), "missing name or arguments");
+  } else if ((tool = tool_find(name)) == NULL) {
+    ESP_LOGW(LOG_TAG, "Function call to unknown tool %s", name);
+    tool_error(output, sizeof(output), "unknown tool");
+  } else if (!tool_decode(tool, arguments, decoded)) {
+    ESP_LOGW(LOG_TAG, "Function call %s with bad arguments %s", name,
+             arguments);
+    tool_error(output, sizeof(output), "invalid arguments");
+  } else {
+    tool->handler(decoded, output, sizeof(output));
+  }
+
+  if (!send_function_call_output(call_id, output)) {
+    ESP_LOGW(LOG_TAG, "Function call result not sent: %s", output);
+    return;
+  }
+  ESP_LOGI(LOG_TAG, "Function call result sent in %" PRIu32 "us: %s",
+           (uint32_t)(esp_timer_get_time() - start_us), output);
+}
+
+// Errors and rate limits are rare and small, so they get a full parse
+static void handle_error(const char *json, size_t size) {
+  auto root = cJSON_ParseWithLength(json, size);
+  auto error = cJSON_GetObjectItem(root, "error");
+  auto message = cJSON_GetObjectItem(error, "message");
+  auto code = cJSON_GetObjectItem(error, "code");
+  ESP_LOGE(LOG_TAG, "Realtime API error %s: %s",
+           cJSON_IsString(code) ? code->valuestring : "",
+           cJSON_IsString(message) ? message->valuestring : "");
   cJSON_Delete(root);
 }
+
+static void handle_rate_limits(const char *json, size_t size) {
+  auto root = cJSON_ParseWithLength(json, size);
+  cJSON *limit = NULL;
+  cJSON_ArrayForEach(limit, cJSON_GetObjectItem(root, "rate_limits")) {
+    auto name = cJSON_GetObjectItem(limit, "name");
+    auto remaining = cJSON_GetObjectItem(limit, "remaining");
+    auto total = cJSON_GetObjectItem(limit, "limit");
+    if (cJSON_IsString(name) && cJSON_IsNumber(remaining) &&
+        cJSON_IsNumber(total)) {
+      ESP_LOGI(LOG_TAG, "Rate limit %s: %.0f of %.0f remaining",
+               name->valuestring, remaining->valuedouble, total->valuedouble);
+    }
+  }
+  cJSON_Delete(root);
+}
+
+void realtimeapi_handle_event(const char *type, const char *json,
+                              size_t size) {
+  if (strcmp(type, FUNCTION_CALL_DONE) == 0) {
+    handle_function_call(json, size);
+  } else if (strcmp(type, "error") == 0) {
+    handle_error(json, size);
+  } else if (strcmp(type, "rate_limits.updated") == 0) {
+    handle_rate_limits(json, size);
+  } else if (strcmp(type, RESPONSE_DONE) == 0) {
+    handle_response_done();
+  }
+}
+
+// A wanted event that was too large to keep. A response.done carries the
+// whole output and transcript and can get there, but the response.create
+// it is kept for doesn't need any of it.
+void realtimeapi_handle_dropped_event(const char *type) {
+  if (strcmp(type, RESPONSE_DONE) == 0) {
+    handle_response_done();
+  }
+}
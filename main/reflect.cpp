@@ -1,20 +1,50 @@
 #include <esp_err.h>
 #include <esp_event.h>
 #include <esp_netif.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
 #include <nvs_flash.h>
 
 #include "reflect.hpp"
 
 #define TAG "reflect"
 
+#define MEDIA_INIT_TASK_STACK_SIZE 16384
+#define MEDIA_INIT_TASK_PRIORITY 5
+
+// Display and codec bring-up share the I2C bus, so they stay sequential in
+// here, but overlap with WiFi association and signaling on the main task
+static void reflect_media_init_task(void *) {
+  reflect_display();
+  reflect_touch();
+  reflect_boot_mark(REFLECT_BOOT_DISPLAY);
+
+  reflect_audio();
+  reflect_jitter_buffer();
+  reflect_boot_mark(REFLECT_BOOT_AUDIO);
+
+  reflect_boot_set(REFLECT_BOOT_MEDIA_READY);
+  vTaskDelete(NULL);
+}
+
 extern "C" void app_main(void) {
   ESP_ERROR_CHECK(nvs_flash_init());
   ESP_ERROR_CHECK(esp_netif_init());
   ESP_ERROR_CHECK(esp_event_loop_create_default());
+  reflect_boot();
 
-  reflect_display();
-  reflect_audio();
+  // Association and DHCP take longest, so they go first
   reflect_wifi();
+  oai_http_warmup();
+  xTaskCreate(reflect_media_init_task, "media_init",
+              MEDIA_INIT_TASK_STACK_SIZE, NULL, MEDIA_INIT_TASK_PRIORITY,
+              NULL);
+
+  reflect_boot_wait(REFLECT_BOOT_NETWORK_READY);
   reflect_lifx();
+  reflect_effects();
+#if CONFIG_REFLECT_REACTIVE
+  reflect_reactive();
+#endif
   reflect_peer_connection_loop();
 }
@@ -3,25 +3,289 @@
 #include <esp_log.h>
 #include <peer.h>
 
-#define SDP_BUFFER_SIZE 4096
+// Startup stages other stages wait on (reflect_boot_wait). NETWORK_READY is
+// also cleared again whenever the IP is lost.
+#define REFLECT_BOOT_NETWORK_READY (1 << 0)
+#define REFLECT_BOOT_MEDIA_READY (1 << 1)
 
-bool reflect_display_pressed(void);
+typedef enum {
+  REFLECT_BOOT_DISPLAY,
+  REFLECT_BOOT_AUDIO,
+  REFLECT_BOOT_IP,
+  REFLECT_BOOT_OFFER,
+  REFLECT_BOOT_ANSWER,
+  REFLECT_BOOT_CONNECTED,
+  REFLECT_BOOT_COMPLETED,
+  REFLECT_BOOT_FIRST_UPLINK,
+  REFLECT_BOOT_FIRST_DOWNLINK,
+  REFLECT_BOOT_PHASES,
+} reflect_boot_phase_t;
+
+// reflect_level_t.energy is the frame's sum of squares shifted down by this
+#define REFLECT_LEVEL_ENERGY_SHIFT 8
+
+typedef struct {
+  uint32_t energy;
+  int16_t peak;
+} reflect_level_t;
+
+typedef struct {
+  uint32_t wakeups;
+  uint32_t socket_wakeups;
+  uint32_t send_wakeups;
+  uint32_t timer_wakeups;
+  uint32_t select_errors;
+} reflect_peer_loop_stats_t;
+
+#define REFLECT_LIFX_LABEL_SIZE 33
+
+// What is known about a bulb: what it last reported, updated with every
+// command sent to it since
+typedef struct {
+  uint8_t mac[6];
+  char label[REFLECT_LIFX_LABEL_SIZE];
+  char group[REFLECT_LIFX_LABEL_SIZE];
+  bool power;
+  uint16_t hue;
+  uint16_t saturation;
+  uint16_t brightness;
+  uint16_t kelvin;
+  int64_t reported_us;
+} reflect_lifx_bulb_t;
+
+typedef struct {
+  uint32_t sent;
+  uint32_t acked;
+  uint32_t retransmits;
+  uint32_t lost;
+  uint32_t superseded;
+  uint32_t ack_latency_avg_us;
+  uint32_t ack_latency_max_us;
+  uint32_t queued;
+  uint32_t queue_max;
+  uint32_t coalesced;
+  uint32_t queue_full;
+  uint32_t stream_sent;
+  uint32_t stream_rtt_us;
+} reflect_lifx_stats_t;
+
+typedef struct {
+  uint32_t frames;
+  uint32_t dropped;
+  uint32_t sent;
+  uint32_t restores;
+  uint32_t light_latency_us;
+  int32_t audio_to_light_us;
+  int32_t audio_to_light_max_us;
+} reflect_reactive_stats_t;
+
+// Color components for send_lifx_set_waveform_optional
+#define REFLECT_LIFX_HUE 1
+#define REFLECT_LIFX_SATURATION 2
+#define REFLECT_LIFX_BRIGHTNESS 4
+#define REFLECT_LIFX_KELVIN 8
+
+// Waveforms of SetWaveform
+#define REFLECT_LIFX_SAW 0
+#define REFLECT_LIFX_SINE 1
+#define REFLECT_LIFX_HALF_SINE 2
+#define REFLECT_LIFX_TRIANGLE 3
+#define REFLECT_LIFX_PULSE 4
+
+typedef enum {
+  REFLECT_EFFECT_STOP,
+  REFLECT_EFFECT_BREATHE,
+  REFLECT_EFFECT_PULSE,
+  REFLECT_EFFECT_CANDLE,
+  REFLECT_EFFECT_SUNRISE,
+  REFLECT_EFFECT_COUNT,
+} reflect_effect_kind_t;
+
+inline constexpr const char *reflect_effect_names[REFLECT_EFFECT_COUNT] = {
+    "stop", "breathe", "pulse", "candle", "sunrise"};
+
+// An effect to run on the bulbs: period is in milliseconds, duration in
+// seconds (0 runs until stopped)
+typedef struct {
+  uint8_t kind;
+  uint16_t hue;
+  uint16_t saturation;
+  uint16_t brightness;
+  uint16_t kelvin;
+  uint32_t period;
+  uint32_t duration;
+} reflect_effect_t;
+
+typedef struct {
+  uint32_t messages;
+  uint32_t fragments;
+  uint32_t handled;
+  uint32_t skipped;
+  uint32_t dropped;
+  uint32_t bytes;
+  uint32_t buffer_grows;
+} reflect_events_stats_t;
+
+typedef struct {
+  uint32_t delay_ms;
+  uint32_t delay_changes;
+  float erle_db;
+  uint32_t frame_us;
+  uint32_t frame_max_us;
+  uint32_t double_talk_frames;
+} reflect_aec_stats_t;
+
+typedef struct {
+  bool active;
+  bool onset;
+  float level_db;
+} reflect_vad_t;
+
+typedef struct {
+  uint32_t depth;
+  uint32_t target_depth;
+  uint32_t jitter_us;
+  uint32_t late_drops;
+  uint32_t underruns;
+  // Frames dropped to bring the depth back to the target, and missing
+  // frames skipped over while doing so (which are loss, not trimming)
+  uint32_t trimmed;
+  uint32_t trimmed_holes;
+  uint32_t recovered;
+  uint32_t concealed;
+} reflect_jitter_stats_t;
+
+typedef enum {
+  REFLECT_TOUCH_TAP,
+  REFLECT_TOUCH_LONG_PRESS,
+  REFLECT_TOUCH_SWIPE_LEFT,
+  REFLECT_TOUCH_SWIPE_RIGHT,
+  REFLECT_TOUCH_SWIPE_UP,
+  REFLECT_TOUCH_SWIPE_DOWN,
+  REFLECT_TOUCH_GESTURE_COUNT,
+} reflect_touch_gesture_t;
+
+inline constexpr const char
+    *reflect_touch_gesture_names[REFLECT_TOUCH_GESTURE_COUNT] = {
+        "tap",         "long_press", "swipe_left",
+        "swipe_right", "swipe_up",   "swipe_down"};
+
+// Where a gesture ended (a long press: where it is held)
+typedef struct {
+  uint8_t gesture;
+  uint16_t x;
+  uint16_t y;
+} reflect_touch_event_t;
+
+typedef struct {
+  uint32_t reads;
+  uint32_t read_avg_us;
+  uint32_t read_max_us;
+  uint32_t gestures;
+  uint32_t dropped;
+} reflect_touch_stats_t;
+
+typedef struct {
+  uint32_t frames;
+  uint32_t render_us;
+  uint32_t task_us;
+  uint32_t redrawn_pixels;
+} reflect_display_stats_t;
+
+typedef struct {
+  uint32_t captured;
+  uint32_t overruns;
+  uint32_t ring_depth;
+  uint32_t ring_high_water;
+  uint32_t packets_sent;
+  uint32_t send_jitter_us;
+  uint32_t send_interval_max_us;
+  bool vad_active;
+  uint32_t vad_latency_us;
+  uint32_t speech_frames;
+  uint32_t speech_bytes;
+  uint32_t silence_frames;
+  uint32_t silence_bytes;
+} reflect_audio_stats_t;
+
+void reflect_display_stats(reflect_display_stats_t *);
 void reflect_set_mic_color(bool);
+void reflect_aec();
+float reflect_aec_erle_db();
+void reflect_aec_far(const int16_t *, size_t);
+uint32_t reflect_aec_far_position();
+void reflect_aec_process(int16_t *, size_t, uint32_t);
+void reflect_aec_stats(reflect_aec_stats_t *);
 void reflect_audio();
+void reflect_boot();
+void reflect_boot_clear(uint32_t);
+void reflect_boot_mark(reflect_boot_phase_t);
+void reflect_boot_set(uint32_t);
+void reflect_boot_wait(uint32_t);
+void reflect_audio_stats(reflect_audio_stats_t *);
+bool reflect_datachannel_send(const char *, size_t);
 void reflect_display();
+void reflect_dsp_benchmark(int16_t);
+void reflect_events_benchmark();
+void reflect_events_push(const char *, size_t);
+void reflect_events_reset();
+void reflect_events_stats(reflect_events_stats_t *);
+void reflect_gain_and_measure(int16_t *, size_t, int16_t, reflect_level_t *);
+void reflect_measure(const int16_t *, size_t, reflect_level_t *);
+float reflect_level_db(const reflect_level_t *, size_t);
+void reflect_vad_process(const int16_t *, size_t, uint32_t, reflect_vad_t *);
+void reflect_effects();
+void reflect_effect_start(const reflect_effect_t *);
+void reflect_effect_stop();
+bool reflect_effect_running();
+void reflect_jitter_buffer();
+bool reflect_json_string(const char *, size_t, const char *, char *, size_t);
+void reflect_jitter_flush();
+void reflect_jitter_push(const uint8_t *, size_t);
+void reflect_jitter_stats(reflect_jitter_stats_t *);
 void reflect_lifx();
+size_t reflect_lifx_bulbs(reflect_lifx_bulb_t *, size_t);
+void reflect_lifx_stats(reflect_lifx_stats_t *);
+bool reflect_lifx_stream_probe(int64_t *, int64_t *);
 void reflect_peer_connection_loop();
+void reflect_peer_loop_connected(bool);
+void reflect_peer_loop_init();
+void reflect_peer_loop_stats(reflect_peer_loop_stats_t *);
+void reflect_peer_loop_wait();
+void reflect_peer_loop_wake();
 void reflect_play_audio(uint8_t *, size_t);
+void reflect_reactive();
+void reflect_reactive_level(float);
+void reflect_reactive_stats(reflect_reactive_stats_t *);
+void reflect_conceal_audio(uint8_t *, size_t);
+void reflect_play_silence();
+void reflect_set_packet_loss(int);
 void reflect_send_audio(PeerConnection *, bool);
+bool reflect_wait_audio(uint32_t);
 void reflect_set_spin(bool);
+void reflect_touch();
+void reflect_touch_benchmark_read();
+bool reflect_touch_event(reflect_touch_event_t *);
+void reflect_touch_stats(reflect_touch_stats_t *);
 void reflect_wifi();
+bool reflect_wifi_connected();
+int64_t reflect_wifi_lost_us();
 
-void send_lifx_set_color(uint16_t, uint16_t, uint16_t, uint16_t, uint32_t);
-void send_lifx_set_power(int, uint32_t);
-void send_lifx_set_waveform(bool, uint16_t, uint16_t, uint16_t, uint16_t,
+bool send_lifx_set_color(uint16_t, uint16_t, uint16_t, uint16_t, uint32_t);
+bool send_lifx_set_power(int, uint32_t);
+bool send_lifx_set_waveform(bool, uint16_t, uint16_t, uint16_t, uint16_t,
                             uint32_t, float, int16_t, uint8_t);
+bool send_lifx_set_waveform_optional(bool, uint16_t, uint16_t, uint16_t,
+                                     uint16_t, uint32_t, float, int16_t,
+                                     uint8_t, uint8_t);
+bool send_lifx_stream(uint16_t, int16_t, uint32_t, bool);
+bool send_lifx_restore(uint32_t);
 
-void oai_http_request(const char *offer, char *answer);
+char *oai_http_request(const char *offer);
+void oai_http_warmup();
 
-void realtimeapi_parse_incoming(char *);
+void realtimeapi_tools_benchmark();
+bool realtimeapi_wants_event(const char *);
+void realtimeapi_handle_event(const char *, const char *, size_t);
+void realtimeapi_handle_dropped_event(const char *);
 void send_session_update(PeerConnection *peer_connection);
@@ -0,0 +1,65 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+// Lock-free single-producer/single-consumer ring of fixed size frames.
+//
+// The producer fills the slot returned by acquire() in place and publishes it
+// with commit(). The consumer works on the slot returned by peek() in place
+// and hands it back with release(), so frames are never copied.
+template <size_t Frames> class SpscRing {
+  static_assert((Frames & (Frames - 1)) == 0, "Frames must be a power of two");
+
+public:
+  void init(uint8_t *storage, size_t frame_size) {
+    storage_ = storage;
+    frame_size_ = frame_size;
+    head_ = 0;
+    tail_ = 0;
+  }
+
+  // Producer side, nullptr when the ring is full
+  uint8_t *acquire() {
+    auto head = head_.load(std::memory_order_relaxed);
+    if (head - tail_.load(std::memory_order_acquire) == Frames) {
+      return nullptr;
+    }
+    return slot(head);
+  }
+
+  void commit() {
+    head_.store(head_.load(std::memory_order_relaxed) + 1,
+                std::memory_order_release);
+  }
+
+  // Consumer side, nullptr when the ring is empty
+  uint8_t *peek() {
+    auto tail = tail_.load(std::memory_order_relaxed);
+    if (head_.load(std::memory_order_acquire) == tail) {
+      return nullptr;
+    }
+    return slot(tail);
+  }
+
+  void release() {
+    tail_.store(tail_.load(std::memory_order_relaxed) + 1,
+                std::memory_order_release);
+  }
+
+  size_t depth() const {
+    return head_.load(std::memory_order_acquire) -
+           tail_.load(std::memory_order_acquire);
+  }
+
+private:
+  uint8_t *slot(size_t index) {
+    return storage_ + (index & (Frames - 1)) * frame_size_;
+  }
+
+  uint8_t *storage_ = nullptr;
+  size_t frame_size_ = 0;
+  std::atomic<size_t> head_{0};
+  std::atomic<size_t> tail_{0};
+};
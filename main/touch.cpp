@@ -0,0 +1,229 @@
+#include <cinttypes>
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/queue.h>
+#include <freertos/task.h>
+
+#include "bsp/esp-bsp.h"
+#include "bsp/touch.h"
+#include "esp_lcd_touch.h"
+
+#include "reflect.hpp"
+
+#define LOG_TAG "touch"
+
+#define TOUCH_TASK_STACK_SIZE 4096
+#define TOUCH_TASK_PRIORITY 2
+#define TOUCH_QUEUE_DEPTH 8
+
+// While a finger is down the controller is read this often, to follow
+// holds and swipes
+#define TOUCH_TRACK_MS 20
+
+// Without an interrupt line, how often an idle controller is checked. That
+// is the CoreS3: its controller's INT goes through the IO expander, the BSP
+// leaves int_gpio_num unset, and so the board always polls.
+#define TOUCH_IDLE_POLL_MS 50
+
+// A touch has to be seen on this many reads in a row before it counts,
+// and missed on this many before it is over
+#define TOUCH_PRESS_READS 2
+#define TOUCH_RELEASE_READS 2
+
+#define TOUCH_LONG_PRESS_MS 600
+#define TOUCH_SWIPE_MIN_PX 40
+
+static esp_lcd_touch_handle_t tp = NULL;
+static TaskHandle_t touch_task = NULL;
+static QueueHandle_t touch_queue = NULL;
+static bool interrupt_driven = false;
+
+static uint32_t reads = 0;
+static int64_t read_total_us = 0;
+static uint32_t read_max_us = 0;
+static uint32_t gestures = 0;
+static uint32_t dropped = 0;
+
+// Where a touch started and last was, and what it has amounted to so far
+typedef struct {
+  uint32_t seen;
+  uint32_t missed;
+  int64_t down_us;
+  uint16_t start_x;
+  uint16_t start_y;
+  uint16_t x;
+  uint16_t y;
+  bool long_press_sent;
+} touch_track_t;
+
+static void IRAM_ATTR on_touch_interrupt(esp_lcd_touch_handle_t) {
+  if (touch_task == NULL) {
+    return;
+  }
+  BaseType_t woken = pdFALSE;
+  vTaskNotifyGiveFromISR(touch_task, &woken);
+  portYIELD_FROM_ISR(woken);
+}
+
+static bool touch_read(uint16_t *x, uint16_t *y) {
+  uint16_t strength;
+  uint8_t count = 0;
+  auto start_us = esp_timer_get_time();
+  esp_lcd_touch_read_data(tp);
+  auto pressed =
+      esp_lcd_touch_get_coordinates(tp, x, y, &strength, &count, 1) &&
+      count > 0;
+
+  auto read_us = (uint32_t)(esp_timer_get_time() - start_us);
+  reads++;
+  read_total_us += read_us;
+  if (read_us > read_max_us) {
+    read_max_us = read_us;
+  }
+  return pressed;
+}
+
+static void touch_send(reflect_touch_gesture_t gesture,
+                       const touch_track_t *track) {
+  reflect_touch_event_t event = {(uint8_t)gesture, track->x, track->y};
+  if (xQueueSend(touch_queue, &event, 0) != pdTRUE) {
+    dropped++;
+    return;
+  }
+  gestures++;
+  ESP_LOGI(LOG_TAG, "%s at %d,%d", reflect_touch_gesture_names[gesture],
+           track->x, track->y);
+}
+
+// A released touch is a tap, unless it was held long enough to already be
+// a long press or moved far enough to be a swipe
+static void touch_released(const touch_track_t *track) {
+  auto dx = track->x - track->start_x;
+  auto dy = track->y - track->start_y;
+  auto adx = dx < 0 ? -dx : dx;
+  auto ady = dy < 0 ? -dy : dy;
+
+  if (adx >= TOUCH_SWIPE_MIN_PX || ady >= TOUCH_SWIPE_MIN_PX) {
+    if (adx >= ady) {
+      touch_send(dx > 0 ? REFLECT_TOUCH_SWIPE_RIGHT : REFLECT_TOUCH_SWIPE_LEFT,
+                 track);
+    } else {
+      touch_send(dy > 0 ? REFLECT_TOUCH_SWIPE_DOWN : REFLECT_TOUCH_SWIPE_UP,
+                 track);
+    }
+  } else if (!track->long_press_sent) {
+    touch_send(REFLECT_TOUCH_TAP, track);
+  }
+}
+
+// Follows one touch from the first read that sees it until it is over
+static void touch_follow() {
+  touch_track_t track = {};
+  while (true) {
+    uint16_t x, y;
+    auto now_us = esp_timer_get_time();
+    if (touch_read(&x, &y)) {
+      if (track.seen == 0) {
+        track.down_us = now_us;
+        track.start_x = x;
+        track.start_y = y;
+      }
+      track.seen++;
+      track.missed = 0;
+      track.x = x;
+      track.y = y;
+    } else if (track.seen == 0 || ++track.missed == TOUCH_RELEASE_READS) {
+      if (track.seen >= TOUCH_PRESS_READS) {
+        touch_released(&track);
+      }
+      return;
+    }
+
+    auto dx = track.x - track.start_x;
+    auto dy = track.y - track.start_y;
+    if (!track.long_press_sent && track.seen >= TOUCH_PRESS_READS &&
+        now_us - track.down_us >= TOUCH_LONG_PRESS_MS * 1000LL &&
+        dx * dx + dy * dy < TOUCH_SWIPE_MIN_PX * TOUCH_SWIPE_MIN_PX) {
+      touch_send(REFLECT_TOUCH_LONG_PRESS, &track);
+      track.long_press_sent = true;
+    }
+
+    vTaskDelay(pdMS_TO_TICKS(TOUCH_TRACK_MS));
+  }
+}
+
+void reflect_touch_stats(reflect_touch_stats_t *stats) {
+  stats->reads = reads;
+  stats->read_avg_us = reads == 0 ? 0 : (uint32_t)(read_total_us / reads);
+  stats->read_max_us = read_max_us;
+  stats->gestures = gestures;
+  stats->dropped = dropped;
+}
+
+static void log_touch_stats() {
+  reflect_touch_stats_t stats;
+  reflect_touch_stats(&stats);
+  ESP_LOGI(LOG_TAG,
+           "mode(%s) reads(%" PRIu32 ") read_avg_us(%" PRIu32
+           ") read_max_us(%" PRIu32 ") gestures(%" PRIu32 ") dropped(%" PRIu32
+           ")",
+           interrupt_driven ? "interrupt" : "poll", stats.reads,
+           stats.read_avg_us, stats.read_max_us, stats.gestures,
+           stats.dropped);
+}
+
+static void reflect_touch_task(void *) {
+  int64_t last_stats_us = esp_timer_get_time();
+  while (true) {
+    if (interrupt_driven) {
+      // The timeout is only a fallback for an interrupt that went missing
+      ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(1000));
+    } else {
+      vTaskDelay(pdMS_TO_TICKS(TOUCH_IDLE_POLL_MS));
+    }
+    touch_follow();
+    // Interrupts raised while the touch was being followed are stale
+    ulTaskNotifyTake(pdTRUE, 0);
+
+    auto now_us = esp_timer_get_time();
+    if (CONFIG_REFLECT_STATS_INTERVAL > 0 &&
+        now_us - last_stats_us >= CONFIG_REFLECT_STATS_INTERVAL * 1000000LL) {
+      log_touch_stats();
+      last_stats_us = now_us;
+    }
+  }
+}
+
+#if CONFIG_REFLECT_TOUCH_BENCHMARK
+// The controller read the audio publisher used to make on every iteration.
+// Only the I2C transfer: the coordinates are left to the touch task.
+void reflect_touch_benchmark_read() {
+  if (tp != NULL) {
+    esp_lcd_touch_read_data(tp);
+  }
+}
+#endif
+
+// Gestures come out in the order they were made. Never blocks.
+bool reflect_touch_event(reflect_touch_event_t *event) {
+  return touch_queue != NULL && xQueueReceive(touch_queue, event, 0) == pdTRUE;
+}
+
+void reflect_touch() {
+  ESP_ERROR_CHECK(bsp_touch_new(NULL, &tp));
+  touch_queue = xQueueCreate(TOUCH_QUEUE_DEPTH, sizeof(reflect_touch_event_t));
+  assert(touch_queue != nullptr);
+
+  // Only wired up on boards that route the controller's INT pin to a GPIO.
+  // The CoreS3 doesn't, so there this fails and the task polls.
+  interrupt_driven =
+      esp_lcd_touch_register_interrupt_callback(tp, on_touch_interrupt) ==
+      ESP_OK;
+  ESP_LOGI(LOG_TAG, "Touch %s",
+           interrupt_driven ? "interrupt driven" : "polled");
+
+  xTaskCreate(reflect_touch_task, "touch", TOUCH_TASK_STACK_SIZE, NULL,
+              TOUCH_TASK_PRIORITY, &touch_task);
+  assert(touch_task != nullptr);
+}
@@ -0,0 +1,89 @@
+#include <cmath>
+
+#include "reflect.hpp"
+
+#define LOG_TAG "vad"
+
+// Nothing quieter than this is ever speech, whatever the noise floor says
+#define VAD_MIN_LEVEL_DB 35.0f
+#define VAD_INITIAL_FLOOR_DB 40.0f
+
+// Noise floor follows drops quickly and rises slowly, so speech doesn't pull
+// it up
+#define VAD_FLOOR_FALL 0.2f
+#define VAD_FLOOR_RISE 0.01f
+
+// While active the frames can't be trusted as noise, so the floor instead
+// rises to the quietest frame of each window this long. Speech leaves gaps
+// between words that reach down to the real floor; a steady noise that got
+// louder doesn't, and would otherwise hold the VAD open for good.
+#define VAD_ACTIVE_WINDOW_MS 2000
+
+// Voiced speech sits well below this zero-crossing rate. Above it (hiss,
+// fans, fricatives) a frame needs twice the usual margin to count as speech.
+#define VAD_MAX_VOICED_ZCR 0.35f
+
+static float noise_floor_db = VAD_INITIAL_FLOOR_DB;
+static bool active = false;
+static int32_t hangover_ms = 0;
+static float window_min_db = 0;
+static int32_t window_ms = 0;
+
+float reflect_level_db(const reflect_level_t *level, size_t count) {
+  auto mean_square = (float)level->energy * (1 << REFLECT_LEVEL_ENERGY_SHIFT) /
+                     (float)count;
+  return 10.0f * log10f(mean_square + 1.0f);
+}
+
+static float zero_crossing_rate(const int16_t *samples, size_t count) {
+  size_t crossings = 0;
+  for (size_t i = 1; i < count; i++) {
+    crossings += (samples[i - 1] < 0) != (samples[i] < 0);
+  }
+  return (float)crossings / (float)count;
+}
+
+void reflect_vad_process(const int16_t *samples, size_t count,
+                         uint32_t frame_ms, reflect_vad_t *vad) {
+  reflect_level_t level;
+  reflect_measure(samples, count, &level);
+
+  auto level_db = reflect_level_db(&level, count);
+  auto margin_db = level_db - noise_floor_db;
+  auto zcr = zero_crossing_rate(samples, count);
+
+  auto required_db = (float)CONFIG_REFLECT_VAD_THRESHOLD_DB;
+  if (zcr > VAD_MAX_VOICED_ZCR) {
+    required_db *= 2;
+  }
+  bool speech = level_db > VAD_MIN_LEVEL_DB && margin_db > required_db;
+
+  vad->onset = speech && !active;
+  if (speech) {
+    active = true;
+    hangover_ms = CONFIG_REFLECT_VAD_HANGOVER_MS;
+  } else if (active) {
+    hangover_ms -= frame_ms;
+    active = hangover_ms > 0;
+  }
+
+  if (!active) {
+    auto rate = level_db < noise_floor_db ? VAD_FLOOR_FALL : VAD_FLOOR_RISE;
+    noise_floor_db += (level_db - noise_floor_db) * rate;
+    window_ms = 0;
+  } else {
+    if (window_ms == 0 || level_db < window_min_db) {
+      window_min_db = level_db;
+    }
+    window_ms += frame_ms;
+    if (window_ms >= VAD_ACTIVE_WINDOW_MS) {
+      if (window_min_db > noise_floor_db) {
+        noise_floor_db = window_min_db;
+      }
+      window_ms = 0;
+    }
+  }
+
+  vad->active = active;
+  vad->level_db = level_db;
+}
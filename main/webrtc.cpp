@@ -2,52 +2,180 @@
 #include "freertos/FreeRTOS.h"
 #include "freertos/semphr.h"
 #include "freertos/task.h"
+#include <atomic>
+#include <cinttypes>
 #include <cstring>
 
 #include "reflect.hpp"
 
 #define LOG_TAG "webrtc"
-#define TICK_INTERVAL 15
+// Upper bound on how long the sender waits for a captured frame, so a
+// stalled mic doesn't also hold up taps below
+#define AUDIO_WAIT_TIMEOUT_MS 100
+
+// A session that hasn't finished ICE and DTLS this long after its offer was
+// created is abandoned, however much of that the signaling request took
+#define CONNECT_TIMEOUT_MS 15000
+
+// Delay before retrying a failed session, doubled per consecutive failure
+#define RECONNECT_BACKOFF_MIN_MS 500
+#define RECONNECT_BACKOFF_MAX_MS 30000
+
 PeerConnection *peer_connection = NULL;
 
-static void on_datachannel_message(char *msg, size_t, void *, uint16_t) {
-  realtimeapi_parse_incoming(msg);
+// The send task uses peer_connection from another core; this keeps it from
+// being destroyed mid-send
+static SemaphoreHandle_t peer_connection_mutex = NULL;
+static std::atomic<PeerConnectionState> connection_state{
+    PEER_CONNECTION_CLOSED};
+
+// Sessions attempted since the last one that came up, and when that one was
+// lost (0 before the first session)
+static uint32_t attempts = 0;
+static int64_t outage_us = 0;
+
+// Setup timeline of the current session
+static int64_t session_start_us = 0;
+static int64_t offer_us = 0;
+static int64_t answer_us = 0;
+static int64_t ice_connected_us = 0;
+
+static void on_datachannel_message(char *msg, size_t size, void *, uint16_t) {
+  reflect_events_push(msg, size);
 }
 
 static void on_datachannel_onopen(void *userdata) {
+  auto open_us = esp_timer_get_time();
   if (peer_connection_create_datachannel(peer_connection, DATA_CHANNEL_RELIABLE,
                                          0, 0, (char *)"oai-events",
                                          (char *)"") != -1) {
-    ESP_LOGI(LOG_TAG, "DataChannel Open");
     send_session_update(peer_connection);
+    ESP_LOGI(LOG_TAG, "DataChannel Open, session.update sent in %" PRIu32 "us",
+             (uint32_t)(esp_timer_get_time() - open_us));
   } else {
     ESP_LOGI(LOG_TAG, "DataChannel Failed");
   }
 }
 
+// Sends on the oai-events channel, returning whether it went out. Only
+// called from the peer task, which is also the one that destroys the
+// PeerConnection.
+bool reflect_datachannel_send(const char *message, size_t size) {
+  if (connection_state != PEER_CONNECTION_COMPLETED ||
+      peer_connection_datachannel_send(peer_connection, (char *)message,
+                                       size) < 0) {
+    return false;
+  }
+  reflect_peer_loop_wake();
+  return true;
+}
+
+#if CONFIG_REFLECT_TOUCH_BENCHMARK
+// Phases of this long alternate between reading the touch controller on
+// every publisher iteration, as before touch had its own task, and not
+#define TOUCH_BENCHMARK_PHASE_US (30 * 1000000LL)
+
+// Called each time the publisher wakes up for audio. Logs how far the
+// wakeups strayed from the frame period during the phase just over.
+static void touch_benchmark_step(int64_t now_us) {
+  static int64_t phase_start_us = 0;
+  static int64_t last_us = 0;
+  static bool reading = true;
+  static float jitter_us = 0;
+  static uint32_t interval_max_us = 0;
+
+  if (last_us != 0) {
+    auto interval_us = (uint32_t)(now_us - last_us);
+    auto deviation_us =
+        (int32_t)interval_us - CONFIG_REFLECT_AUDIO_FRAME_MS * 1000;
+    if (deviation_us < 0) {
+      deviation_us = -deviation_us;
+    }
+    jitter_us += ((float)deviation_us - jitter_us) / 16.0f;
+    if (interval_us > interval_max_us) {
+      interval_max_us = interval_us;
+    }
+  }
+  last_us = now_us;
+
+  if (phase_start_us == 0) {
+    phase_start_us = now_us;
+  } else if (now_us - phase_start_us >= TOUCH_BENCHMARK_PHASE_US) {
+    ESP_LOGI(LOG_TAG,
+             "Touch benchmark, %s: wake_jitter_us(%" PRIu32
+             ") wake_interval_max_us(%" PRIu32 ")",
+             reading ? "read in publisher" : "read on touch task",
+             (uint32_t)jitter_us, interval_max_us);
+    reading = !reading;
+    phase_start_us = now_us;
+    interval_max_us = 0;
+  }
+
+  if (reading) {
+    reflect_touch_benchmark_read();
+  }
+}
+#endif
+
 StaticTask_t send_audio_task_buffer;
 void reflect_send_audio_task(void *user_data) {
-  auto peer_connection = (PeerConnection *)user_data;
   bool is_muted = false;
+  reflect_boot_wait(REFLECT_BOOT_MEDIA_READY);
+
+  // The task only starts once the first session connects, and gestures are
+  // queued from boot. Taps from before then would toggle mute the moment
+  // audio starts flowing.
+  reflect_touch_event_t touch;
+  while (reflect_touch_event(&touch)) {
+  }
 
   while (1) {
-    if (reflect_display_pressed()) {
-      is_muted = !is_muted;
-      reflect_set_mic_color(is_muted);
+    while (reflect_touch_event(&touch)) {
+      if (touch.gesture == REFLECT_TOUCH_TAP) {
+        is_muted = !is_muted;
+        reflect_set_mic_color(is_muted);
+      }
     }
 
-    int64_t start_us = esp_timer_get_time();
-    reflect_send_audio(peer_connection, is_muted);
-
-    int64_t elapsed_us = esp_timer_get_time() - start_us;
-    int64_t ms_sleep = TICK_INTERVAL - (elapsed_us / 1000);
-
-    if (ms_sleep > 0) {
-      vTaskDelay(pdMS_TO_TICKS(ms_sleep));
+    if (reflect_wait_audio(AUDIO_WAIT_TIMEOUT_MS)) {
+#if CONFIG_REFLECT_TOUCH_BENCHMARK
+      touch_benchmark_step(esp_timer_get_time());
+#endif
+      xSemaphoreTake(peer_connection_mutex, portMAX_DELAY);
+      auto connected = connection_state == PEER_CONNECTION_COMPLETED;
+      reflect_send_audio(connected ? peer_connection : nullptr, is_muted);
+      xSemaphoreGive(peer_connection_mutex);
     }
   }
 }
 
+// Only ever started once; it outlives every PeerConnection
+static void start_send_audio_task() {
+  static bool started = false;
+  if (started) {
+    return;
+  }
+  started = true;
+
+  StackType_t *stack_memory = (StackType_t *)heap_caps_malloc(
+      30000 * sizeof(StackType_t), MALLOC_CAP_SPIRAM);
+  assert(stack_memory != nullptr);
+  xTaskCreateStaticPinnedToCore(reflect_send_audio_task, "audio_publisher",
+                                30000, NULL, 7, stack_memory,
+                                &send_audio_task_buffer, 0);
+}
+
+static void log_session_setup() {
+  auto now_us = esp_timer_get_time();
+  ESP_LOGI(LOG_TAG,
+           "Session setup offer(%" PRIu32 "ms) signaling(%" PRIu32
+           "ms) ice(%" PRIu32 "ms) dtls(%" PRIu32 "ms)",
+           (uint32_t)((offer_us - session_start_us) / 1000),
+           (uint32_t)((answer_us - offer_us) / 1000),
+           (uint32_t)((ice_connected_us - answer_us) / 1000),
+           (uint32_t)((now_us - ice_connected_us) / 1000));
+}
+
 void reflect_new_peer_connection() {
   PeerConfiguration peer_connection_config = {
       .ice_servers = {},
@@ -55,48 +183,179 @@ void reflect_new_peer_connection() {
       .video_codec = CODEC_NONE,
       .datachannel = DATA_CHANNEL_STRING,
       .onaudiotrack = [](uint8_t *data, size_t size, void *userdata) -> void {
-        reflect_play_audio(data, size);
+        reflect_jitter_push(data, size);
       },
       .onvideotrack = NULL,
       .on_request_keyframe = NULL,
       .user_data = NULL,
   };
 
+  // Without a STUN server the offer only carries host candidates and is
+  // ready at once; the server is public and finds our address through the
+  // connectivity checks (peer reflexive) anyway
+  if (strlen(CONFIG_REFLECT_STUN_SERVER) > 0) {
+    peer_connection_config.ice_servers[0].urls = CONFIG_REFLECT_STUN_SERVER;
+  }
+
   peer_connection = peer_connection_create(&peer_connection_config);
   assert(peer_connection != NULL);
 
   peer_connection_oniceconnectionstatechange(
       peer_connection, [](PeerConnectionState state, void *user_data) -> void {
+        ESP_LOGI(LOG_TAG, "PeerConnection state %d", state);
+        connection_state = state;
+        if (state == PEER_CONNECTION_CONNECTED) {
+          ice_connected_us = esp_timer_get_time();
+          reflect_boot_mark(REFLECT_BOOT_CONNECTED);
+        } else if (state == PEER_CONNECTION_COMPLETED) {
+          log_session_setup();
+          reflect_boot_mark(REFLECT_BOOT_COMPLETED);
+        }
+        reflect_peer_loop_connected(state == PEER_CONNECTION_COMPLETED);
         if (state == PEER_CONNECTION_CONNECTED) {
-          StackType_t *stack_memory = (StackType_t *)heap_caps_malloc(
-              30000 * sizeof(StackType_t), MALLOC_CAP_SPIRAM);
-          assert(stack_memory != nullptr);
-          xTaskCreateStaticPinnedToCore(
-              reflect_send_audio_task, "audio_publisher", 30000,
-              peer_connection, 7, stack_memory, &send_audio_task_buffer, 0);
+          start_send_audio_task();
         }
       });
   peer_connection_ondatachannel(peer_connection, on_datachannel_message,
                                 on_datachannel_onopen, NULL);
 }
 
-void reflect_peer_connection_loop() {
-  vTaskPrioritySet(xTaskGetCurrentTaskHandle(), 10);
-  peer_init();
+// Creates a PeerConnection and exchanges SDP with the Realtime API
+static bool start_session() {
+  session_start_us = esp_timer_get_time();
+  connection_state = PEER_CONNECTION_NEW;
   reflect_new_peer_connection();
 
   auto offer = peer_connection_create_offer(peer_connection);
-  auto answer = (char *)calloc(SDP_BUFFER_SIZE, sizeof(char));
+  offer_us = esp_timer_get_time();
+  reflect_boot_mark(REFLECT_BOOT_OFFER);
 
-  oai_http_request(offer, answer);
+  auto answer = oai_http_request(offer);
+  if (answer == NULL) {
+    return false;
+  }
+  answer_us = esp_timer_get_time();
+  reflect_boot_mark(REFLECT_BOOT_ANSWER);
+
+  // Connectivity checks start on the very next peer_connection_loop
   peer_connection_set_remote_description(peer_connection, answer,
                                          SDP_TYPE_ANSWER);
+  free(answer);
+  return true;
+}
+
+static void close_session() {
+  reflect_peer_loop_connected(false);
+
+  xSemaphoreTake(peer_connection_mutex, portMAX_DELAY);
+  connection_state = PEER_CONNECTION_CLOSED;
+  peer_connection_destroy(peer_connection);
+  peer_connection = NULL;
+  xSemaphoreGive(peer_connection_mutex);
+
+  reflect_jitter_flush();
+  reflect_events_reset();
+  reflect_set_spin(false);
+}
 
-  reflect_set_spin(true);
-  send_lifx_set_power(true, 5000);
+// Drives the PeerConnection until it is lost. Returns whether it ever got as
+// far as DTLS completing.
+static bool run_session(int64_t *completed_us) {
+  bool completed = false;
 
   while (true) {
     peer_connection_loop(peer_connection);
-    vTaskDelay(pdMS_TO_TICKS(1));
+
+    auto state = connection_state.load();
+    if (state == PEER_CONNECTION_COMPLETED && !completed) {
+      completed = true;
+      *completed_us = esp_timer_get_time();
+      if (outage_us != 0) {
+        ESP_LOGI(LOG_TAG,
+                 "Session recovered in %" PRIu32 "ms after %" PRIu32
+                 " attempts",
+                 (uint32_t)((*completed_us - outage_us) / 1000), attempts);
+      }
+      attempts = 0;
+    }
+
+    if (state == PEER_CONNECTION_FAILED ||
+        state == PEER_CONNECTION_DISCONNECTED ||
+        state == PEER_CONNECTION_CLOSED) {
+      ESP_LOGW(LOG_TAG, "PeerConnection lost (state %d)", state);
+      return completed;
+    }
+    if (!reflect_wifi_connected()) {
+      ESP_LOGW(LOG_TAG, "WiFi lost");
+      return completed;
+    }
+    if (!completed &&
+        esp_timer_get_time() - session_start_us >
+            CONNECT_TIMEOUT_MS * 1000LL) {
+      ESP_LOGW(LOG_TAG, "PeerConnection timed out (state %d)", state);
+      return completed;
+    }
+
+    reflect_peer_loop_wait();
+  }
+}
+
+// Keeps a session up for as long as the device runs: every lost or failed
+// session is torn down and a new one negotiated, backing off exponentially
+// while attempts keep failing
+void reflect_peer_connection_loop() {
+  vTaskPrioritySet(xTaskGetCurrentTaskHandle(), 10);
+  peer_init();
+  reflect_peer_loop_init();
+
+  peer_connection_mutex = xSemaphoreCreateMutex();
+  assert(peer_connection_mutex != nullptr);
+
+#if CONFIG_REFLECT_EVENTS_BENCHMARK
+  reflect_events_benchmark();
+#endif
+#if CONFIG_REFLECT_TOOLS_BENCHMARK
+  realtimeapi_tools_benchmark();
+#endif
+
+  bool first_session = true;
+  uint32_t backoff_ms = RECONNECT_BACKOFF_MIN_MS;
+
+  while (true) {
+    reflect_boot_wait(REFLECT_BOOT_NETWORK_READY);
+
+    attempts++;
+    int64_t completed_us = 0;
+    bool completed = false;
+    if (start_session()) {
+      reflect_set_spin(true);
+      if (first_session) {
+        send_lifx_set_power(true, 5000);
+        first_session = false;
+      }
+      completed = run_session(&completed_us);
+    }
+
+    if (completed) {
+      backoff_ms = RECONNECT_BACKOFF_MIN_MS;
+
+      // Count the outage from the WiFi drop if that's what ended it, as
+      // the PeerConnection only notices some time later
+      outage_us = esp_timer_get_time();
+      auto wifi_lost_us = reflect_wifi_lost_us();
+      if (wifi_lost_us > completed_us && wifi_lost_us < outage_us) {
+        outage_us = wifi_lost_us;
+      }
+    }
+
+    close_session();
+
+    if (!completed) {
+      ESP_LOGI(LOG_TAG, "Reconnecting in %" PRIu32 "ms", backoff_ms);
+      vTaskDelay(pdMS_TO_TICKS(backoff_ms));
+      backoff_ms = backoff_ms * 2 > RECONNECT_BACKOFF_MAX_MS
+                       ? RECONNECT_BACKOFF_MAX_MS
+                       : backoff_ms * 2;
+    }
   }
 }
@@ -1,36 +1,373 @@
 #include "esp_log.h"
+#include "esp_mac.h"
+#include "esp_timer.h"
 #include "esp_wifi.h"
+#include <atomic>
+#include <cinttypes>
 #include <cstring>
+#include <nvs.h>
+
+#if CONFIG_REFLECT_WIFI_ROAMING
+#include "esp_rrm.h"
+#include "esp_wnm.h"
+#endif
+
+#include "reflect.hpp"
 
 #define LOG_TAG "wifi"
 
-static bool g_wifi_connected = false;
+// The AP and lease of the last connection, kept so the next boot can skip
+// the scan (and with REFLECT_WIFI_STATIC_IP, DHCP)
+#define WIFI_NVS_NAMESPACE "wifi"
+#define WIFI_NVS_KEY "last"
+
+// Reconnects back off from the first to the longest delay, doubling, and
+// never give up
+#define RECONNECT_MIN_MS 250
+#define RECONNECT_MAX_MS 30000
+
+// Failed connects to a known AP before falling back to a full scan
+#define DIRECTED_ATTEMPTS 2
+
+// How long a weak signal is left alone after asking the AP where to roam
+#define ROAM_QUERY_INTERVAL_US 10000000
+
+// Neighbor report elements: ID, length, then BSSID, BSSID information,
+// operating class, channel and PHY type before any subelements
+#define NEIGHBOR_REPORT_EID 52
+#define NEIGHBOR_REPORT_MIN_LEN 13
+
+// Candidates passed on from a neighbor report to the transition query, each
+// as "neighbor=<bssid>,<info>,<class>,<channel>,<phy> "
+#define ROAM_CANDIDATES_MAX 8
+#define ROAM_CANDIDATE_SIZE 52
+
+typedef struct {
+  uint8_t ssid[32];
+  uint8_t bssid[6];
+  uint8_t channel;
+  uint32_t ip;
+  uint32_t netmask;
+  uint32_t gw;
+  uint32_t dns;
+} wifi_cache_t;
+
+static std::atomic<bool> g_wifi_connected = false;
+static std::atomic<int64_t> g_wifi_lost_us = 0;
+
+// Only touched on the event loop task, and by reflect_wifi before it
+// connects
+static esp_netif_t *sta_netif = NULL;
+static wifi_config_t wifi_config;
+static wifi_cache_t cache;
+static bool static_ip = false;
+static bool associated = false;
+static uint32_t directed_failures = 0;
+static uint32_t reconnect_ms = RECONNECT_MIN_MS;
+static uint32_t connects = 0;
+static int64_t connect_us = 0;
+static int64_t associated_us = 0;
+static esp_timer_handle_t reconnect_timer = NULL;
+
+#if CONFIG_REFLECT_WIFI_ROAMING
+static esp_timer_handle_t roam_timer = NULL;
+#endif
+
+static void wifi_cache_load() {
+  nvs_handle_t handle;
+  if (nvs_open(WIFI_NVS_NAMESPACE, NVS_READONLY, &handle) != ESP_OK) {
+    return;
+  }
+  size_t size = sizeof(cache);
+  if (nvs_get_blob(handle, WIFI_NVS_KEY, &cache, &size) != ESP_OK ||
+      size != sizeof(cache) ||
+      strncmp((char *)cache.ssid, CONFIG_WIFI_NAME, sizeof(cache.ssid)) != 0) {
+    memset(&cache, 0, sizeof(cache));
+  }
+  nvs_close(handle);
+}
+
+// Only writes when the AP or the lease changed, so flash isn't worn by
+// every reconnect
+static void wifi_cache_save(const wifi_cache_t *latest) {
+  if (memcmp(latest, &cache, sizeof(cache)) == 0) {
+    return;
+  }
+  cache = *latest;
+
+  nvs_handle_t handle;
+  if (nvs_open(WIFI_NVS_NAMESPACE, NVS_READWRITE, &handle) != ESP_OK) {
+    return;
+  }
+  if (nvs_set_blob(handle, WIFI_NVS_KEY, &cache, sizeof(cache)) != ESP_OK ||
+      nvs_commit(handle) != ESP_OK) {
+    ESP_LOGW(LOG_TAG, "Failed to save the AP and lease");
+  }
+  nvs_close(handle);
+}
+
+// Directs the next connect at one AP on one channel, which skips the scan,
+// or at any AP with the SSID, picking the strongest after scanning every
+// channel
+static void wifi_target(const uint8_t *bssid, uint8_t channel) {
+  if (bssid != NULL) {
+    memcpy(wifi_config.sta.bssid, bssid, sizeof(wifi_config.sta.bssid));
+    wifi_config.sta.bssid_set = true;
+    wifi_config.sta.channel = channel;
+    wifi_config.sta.scan_method = WIFI_FAST_SCAN;
+  } else {
+    memset(wifi_config.sta.bssid, 0, sizeof(wifi_config.sta.bssid));
+    wifi_config.sta.bssid_set = false;
+    wifi_config.sta.channel = 0;
+    wifi_config.sta.scan_method = WIFI_ALL_CHANNEL_SCAN;
+  }
+  wifi_config.sta.sort_method = WIFI_CONNECT_AP_BY_SIGNAL;
+  ESP_ERROR_CHECK(esp_wifi_set_config(
+      static_cast<wifi_interface_t>(ESP_IF_WIFI_STA), &wifi_config));
+}
+
+// Takes the cached lease instead of asking DHCP for it. Only used for the
+// first connect of a boot, and only to the AP the lease came from.
+static void wifi_static_ip_start() {
+  esp_netif_ip_info_t ip_info = {};
+  ip_info.ip.addr = cache.ip;
+  ip_info.netmask.addr = cache.netmask;
+  ip_info.gw.addr = cache.gw;
+  if (esp_netif_dhcpc_stop(sta_netif) != ESP_OK ||
+      esp_netif_set_ip_info(sta_netif, &ip_info) != ESP_OK) {
+    esp_netif_dhcpc_start(sta_netif);
+    return;
+  }
+  if (cache.dns != 0) {
+    esp_netif_dns_info_t dns = {};
+    dns.ip.type = ESP_IPADDR_TYPE_V4;
+    dns.ip.u_addr.ip4.addr = cache.dns;
+    esp_netif_set_dns_info(sta_netif, ESP_NETIF_DNS_MAIN, &dns);
+  }
+  static_ip = true;
+}
+
+static void wifi_static_ip_stop() {
+  if (static_ip) {
+    static_ip = false;
+    esp_netif_dhcpc_start(sta_netif);
+  }
+}
+
+static void wifi_connect() {
+  connects++;
+  connect_us = esp_timer_get_time();
+  auto err = esp_wifi_connect();
+  if (err != ESP_OK) {
+    // No disconnect event follows to schedule the next attempt
+    ESP_LOGW(LOG_TAG, "esp_wifi_connect failed: %s", esp_err_to_name(err));
+    esp_timer_start_once(reconnect_timer, RECONNECT_MAX_MS * 1000ULL);
+  }
+}
+
+static void on_reconnect_timer(void *) { wifi_connect(); }
+
+static void on_disconnected(const wifi_event_sta_disconnected_t *event) {
+  if (g_wifi_connected.exchange(false)) {
+    g_wifi_lost_us = esp_timer_get_time();
+  }
+  reflect_boot_clear(REFLECT_BOOT_NETWORK_READY);
+
+  // The supplicant leaves the old AP this way when it roams, and connects
+  // to the new one itself. Retargeting or a reconnect here would pull it
+  // back; if the roam fails, its own disconnect comes next.
+  if (event->reason == WIFI_REASON_BSS_TRANSITION_DISASSOC) {
+    ESP_LOGI(LOG_TAG, "Left " MACSTR " to roam", MAC2STR(event->bssid));
+    associated = false;
+    directed_failures = 0;
+    esp_timer_stop(reconnect_timer);
+    return;
+  }
+
+  // A dropped connection is first retried on the AP it was on, then on
+  // whichever is strongest
+  if (associated) {
+    associated = false;
+    directed_failures = 0;
+    wifi_target(event->bssid, wifi_config.sta.channel);
+  } else if (wifi_config.sta.bssid_set &&
+             ++directed_failures >= DIRECTED_ATTEMPTS) {
+    ESP_LOGI(LOG_TAG, "AP " MACSTR " unreachable, scanning",
+             MAC2STR(wifi_config.sta.bssid));
+    wifi_static_ip_stop();
+    wifi_target(NULL, 0);
+  }
+
+  ESP_LOGI(LOG_TAG, "Disconnected (reason %d), reconnecting in %" PRIu32 "ms",
+           event->reason, reconnect_ms);
+  esp_timer_stop(reconnect_timer);
+  ESP_ERROR_CHECK(
+      esp_timer_start_once(reconnect_timer, reconnect_ms * 1000ULL));
+  reconnect_ms *= 2;
+  if (reconnect_ms > RECONNECT_MAX_MS) {
+    reconnect_ms = RECONNECT_MAX_MS;
+  }
+}
+
+static void on_connected(const wifi_event_sta_connected_t *event) {
+  associated = true;
+  associated_us = esp_timer_get_time();
+  memcpy(wifi_config.sta.bssid, event->bssid, sizeof(wifi_config.sta.bssid));
+  wifi_config.sta.channel = event->channel;
+  ESP_LOGI(LOG_TAG,
+           "Associated with " MACSTR " on channel %d in %" PRIu32 "ms",
+           MAC2STR(event->bssid), event->channel,
+           (uint32_t)((associated_us - connect_us) / 1000));
+}
+
+static void on_got_ip(const ip_event_got_ip_t *event) {
+  auto now_us = esp_timer_get_time();
+  // Cold is a scan of every channel and a DHCP exchange, cached skips the
+  // scan and static skips both
+  auto path = "cold";
+  if (static_ip) {
+    path = "static";
+  } else if (wifi_config.sta.bssid_set) {
+    path = "cached";
+  }
+  ESP_LOGI(LOG_TAG,
+           "got ip:" IPSTR " path(%s) connect_to_ip_ms(%" PRIu32
+           ") association_to_ip_ms(%" PRIu32 ") connects(%" PRIu32 ")",
+           IP2STR(&event->ip_info.ip), path,
+           (uint32_t)((now_us - connect_us) / 1000),
+           (uint32_t)((now_us - associated_us) / 1000), connects);
+
+  esp_timer_stop(reconnect_timer);
+  reconnect_ms = RECONNECT_MIN_MS;
+  directed_failures = 0;
+  connects = 0;
+  g_wifi_connected = true;
+  reflect_boot_mark(REFLECT_BOOT_IP);
+  reflect_boot_set(REFLECT_BOOT_NETWORK_READY);
+
+  wifi_cache_t latest = {};
+  memcpy(latest.ssid, wifi_config.sta.ssid, sizeof(latest.ssid));
+  memcpy(latest.bssid, wifi_config.sta.bssid, sizeof(latest.bssid));
+  latest.channel = wifi_config.sta.channel;
+  latest.ip = event->ip_info.ip.addr;
+  latest.netmask = event->ip_info.netmask.addr;
+  latest.gw = event->ip_info.gw.addr;
+  esp_netif_dns_info_t dns;
+  if (esp_netif_get_dns_info(sta_netif, ESP_NETIF_DNS_MAIN, &dns) == ESP_OK &&
+      dns.ip.type == ESP_IPADDR_TYPE_V4) {
+    latest.dns = dns.ip.u_addr.ip4.addr;
+  }
+  wifi_cache_save(&latest);
+
+#if CONFIG_REFLECT_WIFI_ROAMING
+  esp_wifi_set_rssi_threshold(CONFIG_REFLECT_WIFI_ROAM_RSSI);
+#endif
+}
+
+#if CONFIG_REFLECT_WIFI_ROAMING
+static void on_roam_timer(void *) {
+  esp_wifi_set_rssi_threshold(CONFIG_REFLECT_WIFI_ROAM_RSSI);
+}
+
+// Runs on the supplicant's task. The neighbors the AP reported (802.11k)
+// go to it as the candidates of the transition query.
+static void on_neighbor_report(void *, const uint8_t *report,
+                               size_t report_len) {
+  char candidates[ROAM_CANDIDATES_MAX * ROAM_CANDIDATE_SIZE + 1];
+  size_t length = 0;
+  uint32_t count = 0;
+  while (report != NULL && report_len >= 2 && count < ROAM_CANDIDATES_MAX) {
+    auto element_len = report[1];
+    if (report_len < 2u + element_len) {
+      break;
+    }
+    if (report[0] == NEIGHBOR_REPORT_EID &&
+        element_len >= NEIGHBOR_REPORT_MIN_LEN) {
+      auto nr = report + 2;
+      uint32_t info = nr[6] | nr[7] << 8 | nr[8] << 16 | (uint32_t)nr[9] << 24;
+      length += snprintf(candidates + length, sizeof(candidates) - length,
+                         "neighbor=" MACSTR ",0x%08" PRIx32 ",%d,%d,%d ",
+                         MAC2STR(nr), info, nr[10], nr[11], nr[12]);
+      count++;
+    }
+    report += 2 + element_len;
+    report_len -= 2 + element_len;
+  }
+
+  ESP_LOGI(LOG_TAG, "Neighbor report with %" PRIu32 " APs", count);
+  if (esp_wnm_is_btm_supported_connection()) {
+    esp_wnm_send_bss_transition_mgmt_query(REASON_FRAME_LOSS,
+                                           count > 0 ? candidates : NULL, 0);
+  }
+}
+
+// With 802.11v the AP is asked for a better AP to move to, and the roam
+// happens when it answers with a transition request. With 802.11k the
+// neighbors it knows are asked for first and sent along with the query.
+static void on_rssi_low(const wifi_event_bss_rssi_low_t *event) {
+  auto rrm = esp_rrm_is_rrm_supported_connection();
+  auto btm = esp_wnm_is_btm_supported_connection();
+  ESP_LOGI(LOG_TAG, "RSSI %" PRId32 " below %d, %s", event->rssi,
+           CONFIG_REFLECT_WIFI_ROAM_RSSI,
+           rrm   ? "asking the AP for neighbors"
+           : btm ? "asking the AP for a transition"
+                 : "AP can't steer");
+  // Otherwise the query goes out once the report is in
+  auto reported =
+      rrm && esp_rrm_send_neighbor_rep_request(on_neighbor_report, NULL) == 0;
+  if (!reported && btm) {
+    esp_wnm_send_bss_transition_mgmt_query(REASON_FRAME_LOSS, NULL, 0);
+  }
+  // The threshold fires once per arming, so it is armed again later
+  // rather than straight away while the signal is still weak
+  esp_timer_stop(roam_timer);
+  esp_timer_start_once(roam_timer, ROAM_QUERY_INTERVAL_US);
+}
+#endif
 
 static void wifi_event_handler(void *arg, esp_event_base_t event_base,
                                int32_t event_id, void *event_data) {
-  static int s_retry_num = 0;
   if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_DISCONNECTED) {
-    if (s_retry_num < 5) {
-      esp_wifi_connect();
-      s_retry_num++;
-      ESP_LOGI(LOG_TAG, "retry to connect to the AP");
-    }
-    ESP_LOGI(LOG_TAG, "connect to the AP fail");
+    on_disconnected((wifi_event_sta_disconnected_t *)event_data);
+  } else if (event_base == WIFI_EVENT &&
+             event_id == WIFI_EVENT_STA_CONNECTED) {
+    on_connected((wifi_event_sta_connected_t *)event_data);
+#if CONFIG_REFLECT_WIFI_ROAMING
+  } else if (event_base == WIFI_EVENT &&
+             event_id == WIFI_EVENT_STA_BSS_RSSI_LOW) {
+    on_rssi_low((wifi_event_bss_rssi_low_t *)event_data);
+#endif
   } else if (event_base == IP_EVENT && event_id == IP_EVENT_STA_GOT_IP) {
-    ip_event_got_ip_t *event = (ip_event_got_ip_t *)event_data;
-    ESP_LOGI(LOG_TAG, "got ip:" IPSTR, IP2STR(&event->ip_info.ip));
-    g_wifi_connected = true;
+    on_got_ip((ip_event_got_ip_t *)event_data);
   }
 }
 
+bool reflect_wifi_connected() { return g_wifi_connected; }
+
+// When the last connection to the AP dropped, 0 if it never has
+int64_t reflect_wifi_lost_us() { return g_wifi_lost_us; }
+
+// Starts associating and returns; REFLECT_BOOT_NETWORK_READY is set once
+// there is an IP
 void reflect_wifi(void) {
   ESP_ERROR_CHECK(esp_event_handler_register(WIFI_EVENT, ESP_EVENT_ANY_ID,
                                              &wifi_event_handler, NULL));
   ESP_ERROR_CHECK(esp_event_handler_register(IP_EVENT, IP_EVENT_STA_GOT_IP,
                                              &wifi_event_handler, NULL));
 
+  esp_timer_create_args_t reconnect_args = {};
+  reconnect_args.callback = on_reconnect_timer;
+  reconnect_args.name = "wifi_reconnect";
+  ESP_ERROR_CHECK(esp_timer_create(&reconnect_args, &reconnect_timer));
+#if CONFIG_REFLECT_WIFI_ROAMING
+  esp_timer_create_args_t roam_args = {};
+  roam_args.callback = on_roam_timer;
+  roam_args.name = "wifi_roam";
+  ESP_ERROR_CHECK(esp_timer_create(&roam_args, &roam_timer));
+#endif
+
   ESP_ERROR_CHECK(esp_netif_init());
-  esp_netif_t *sta_netif = esp_netif_create_default_wifi_sta();
+  sta_netif = esp_netif_create_default_wifi_sta();
   assert(sta_netif);
 
   wifi_init_config_t cfg = WIFI_INIT_CONFIG_DEFAULT();
@@ -38,20 +375,30 @@ void reflect_wifi(void) {
   ESP_ERROR_CHECK(esp_wifi_set_mode(WIFI_MODE_STA));
   ESP_ERROR_CHECK(esp_wifi_start());
 
-  ESP_LOGI(LOG_TAG, "Connecting to WiFi SSID: %s", CONFIG_WIFI_NAME);
-  wifi_config_t wifi_config;
   memset(&wifi_config, 0, sizeof(wifi_config));
   strncpy((char *)wifi_config.sta.ssid, (char *)CONFIG_WIFI_NAME,
           sizeof(wifi_config.sta.ssid));
   strncpy((char *)wifi_config.sta.password, (char *)CONFIG_WIFI_PASSWORD,
           sizeof(wifi_config.sta.password));
+#if CONFIG_REFLECT_WIFI_ROAMING
+  wifi_config.sta.rm_enabled = 1;
+  wifi_config.sta.btm_enabled = 1;
+#endif
 
-  ESP_ERROR_CHECK(esp_wifi_set_config(
-      static_cast<wifi_interface_t>(ESP_IF_WIFI_STA), &wifi_config));
-  ESP_ERROR_CHECK(esp_wifi_connect());
-
-  // block until we get an IP address
-  while (!g_wifi_connected) {
-    vTaskDelay(pdMS_TO_TICKS(200));
+  wifi_cache_load();
+  if (cache.channel != 0) {
+    ESP_LOGI(LOG_TAG,
+             "Connecting to WiFi SSID: %s at " MACSTR " on channel %d",
+             CONFIG_WIFI_NAME, MAC2STR(cache.bssid), cache.channel);
+    wifi_target(cache.bssid, cache.channel);
+#if CONFIG_REFLECT_WIFI_STATIC_IP
+    if (cache.ip != 0) {
+      wifi_static_ip_start();
+    }
+#endif
+  } else {
+    ESP_LOGI(LOG_TAG, "Connecting to WiFi SSID: %s", CONFIG_WIFI_NAME);
+    wifi_target(NULL, 0);
   }
+  wifi_connect();
 }